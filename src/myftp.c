@@ -5,14 +5,60 @@ CS 360
 12/10/2023
 
 Compiling:
-    gcc -o myftp myftp.c myftp.h
+    gcc -o myftp myftp.c myftpio.c myftpuring.c myftpline.c myftplog.c myftptrace.c myftpzip.c \
+        myftpcrc.c myftpdelta.c myftp.h -lz -lcrypto -lpthread
 
 Running:
-    ./myftp [-d] <hostname | IP address>
+    ./myftp [-d] [-u] [-i] [-b] [-c] [-n] [-s] [-k connections [-z stripe]] [-t file] <hostname | IP address>
 */
 
 #include "myftp.h"
 
+short debug = 0;
+short inlinemode = 0;   // 1: data travels as frames on the control connection (F command)
+short compressmode = 0; // 1: ask for every transfer to be compressed (Y command)
+short checkmode = 1;    // 1: check every get and put against the server's checksum (K command)
+short storemode = 0;    // 1: put only the chunks the server's store lacks (H and M commands)
+
+struct linebuf ctrl;    // Control bytes read past the last server reply
+
+short binarymode = 0;   // 1: commands and replies use the binary protocol (B command)
+uint16_t binsent = 0;   // Request id of the last binary command sent
+uint16_t binreplied = 0;// Request id of the last binary reply received
+
+char tracesession[TRACE_ID];    // -t: this connection's session id (see myftptrace.c)
+int tracesent = 0;              // Command lines sent on this connection, numbered like the server does
+
+#define PIPELINE_MAX    16              // Commands sent before their replies are read
+#define PIPELINE_BYTES  (4*BUF_SIZE)    // Room for requests waiting to be sent
+
+// A remote command whose request is queued or sent but whose reply hasn't been read
+struct pending {
+    char cmd;               // 'L', 'C', 'G', 'P', 'Q', 'Y', 'K', 'V', 'U', 'M', or 'S' for show
+    int fd;                 // Local file being received or sent (-1 if none)
+    int keep;               // 1: a failed get leaves the (resumed) local file alone
+    int zip;                // 1: the server agreed to compress the data (its Y came first)
+    int failed;             // 1: the server turned the command down
+    off_t start;            // Where in the local file the data starts
+    off_t moved;            // Bytes of data received or sent
+    int req;                // Its number on the connection (see tracesent)
+    char path[BUF_SIZE];    // Local file name or path
+};
+
+struct pending pipeline[PIPELINE_MAX];
+int pipelined = 0;              // Commands awaiting replies
+char requests[PIPELINE_BYTES];  // Requests not yet sent
+int requestlen = 0;
+int requestlines = 0;           // ...and how many command lines they hold
+
+#define STRIPE_SIZE     (8 << 20)   // Default bytes per stripe of a striped get
+#define STRIPES_MAX     64
+
+int stripes = 1;                // -k: connections a get is striped over (1: no striping)
+off_t stripesize = STRIPE_SIZE; // -z
+char remotedir[BUF_SIZE];       // Server directory relative to where the session started
+int remotedirok = 1;            // 0: remotedir outgrew its buffer, so no striping
+
 /****************************************************************************************
  * 
  *                                      CLIENT PROTOTYPES
@@ -30,17 +76,43 @@ int checkFileType(char *path, int dir, int rw);
 
 void mypipe(char **left, char **right);
 void pipeToMore(int *streamfd);
+void pipeFeedToMore(int sockfd, int compressed);
 
 // Commands
 
-void cmdEXIT(int sockfd);
+void cmdEXIT(int sockfd, const char *addr);
 void cmdLS();
 void cmdRLS(int sockfd, const char *addr);
+void cmdRSTATS(char *format, int sockfd, const char *addr);
 void cmdCD(char *path);
-void cmdRCD(char *path, int sockfd);
-void cmdGET(char *path, int sockfd, const char *addr);
+void cmdRCD(char *path, int sockfd, const char *addr);
+void cmdGET(char *path, int sockfd, const char *addr, int resume);
 void cmdSHOW(char *path, int sockfd, const char *addr);
-void cmdPUT(char *path, int sockfd, const char *addr);
+void cmdPUT(char *path, int sockfd, const char *addr, int resume);
+void cmdDPUT(char *path, int sockfd, const char *addr);
+
+// Pipeline
+
+struct pending *pipelineQueue(int sockfd, const char *addr, char cmd, char *message, int size, int fd, char *path);
+struct pending *pipelineAdd(char cmd, char *message, int size, int fd, char *path);
+struct pending *pipelineUpload(int sockfd, const char *addr, char cmd, char *message, int fd, char *path);
+void pipelineFlush(int sockfd, const char *addr);
+void pipelineReply(struct pending *p, int sockfd, const char *addr);
+void pipelineCheck(struct pending *p, char *reply);
+void pipelineTrace(struct pending *p, uint64_t began);
+
+// Stripes
+
+int stripedGET(char *path, int sockfd, const char *addr);
+void stripeWorker(int worker, char *path, char *fn, off_t size, off_t *done, const char *addr);
+int stripeFetch(int sockfd, int fd, char *path, off_t offset, off_t length, const char *addr, off_t *received);
+int stripeCheck(int sockfd, int fd, char *path, off_t offset, off_t received);
+void stripeTrackRCD(char *path);
+
+// Chunks
+
+int chunkedPUT(char *path, int fd, char *message, int sockfd, const char *addr);
+int chunkQuery(struct chunk *chunks, int count, int sockfd);
 
 // User
 
@@ -51,13 +123,25 @@ void userInput(int sockfd, const char *addr);
 
 int serverParseMSG(char *buf);
 int serverReceiveMSG(char *dst, int sockfd);
+void serverDecodeBinary(char *dst, struct binhdr *h);
+int serverReadControl(int sockfd, char *dst, int size);
+int serverReceiveInline(int sockfd, int fd, int compressed, off_t *received);
+int serverSendInline(int fd, int sockfd, int compressed, off_t *sent);
 int serverSendAndReceiveMSG(char *message, int sockfd, int size);
-int serverDataConnection(int sockfd, const char *addr);
-int serverConnectAndSend(int sockfd, int size, const char *addr, char *message);
+int serverSendCommands(char *buf, int sockfd, int size);
+int serverUseBinary(int sockfd);
+void serverNoCompression();
+void serverNoChecksums();
+void serverChecksumFailed(char *reply, char *path);
+void serverNoStore();
+int serverRestart(int sockfd, const char *addr, off_t offset);
+int serverDataConnection(int sockfd, const char *addr, int req);
+int serverTrace(int sockfd);
 
 // Client
 
 int clientInit(char *port, const char *addr);
+void clientTrace(const char *cat, const char *name, uint64_t start, int req, long long bytes);
 
 /****************************************************************************************
  * 
@@ -137,16 +221,22 @@ Checks that the file is a directory (if dir is 1) or a regular file (if dir is 0
 @return 0: success 1: failure
 */
 int checkFileType(char *path, int dir, int __type) {
+    uint64_t began = traceNow();
+    char name[BUF_SIZE+8];
 	struct stat finfo;
+    int err;
 
-    // Check if path is __type
-    if (access(path, __type)) {
+    // Check if path is __type, then get file status
+    err = access(path, __type) ? 1 : lstat(path, &finfo) < 0 ? 2 : 0;
+    if (began) {
+        snprintf(name, sizeof(name), "check %s", path);
+        clientTrace("phase", name, began, 0, -1);
+    }
+    if (err == 1) {
         fprintf(stderr, KRED "!!! Error, accessing file type\n");
         return 1;
     }
-
-	// Get file status
-	if (lstat(path, &finfo) < 0) {
+	if (err == 2) {
         fprintf(stderr, KRED "!!! Error, getting file status\n");
 		return 1;
 	}
@@ -216,6 +306,7 @@ If fd is NULL, just execvp the program with args.
 */
 void mypipeCONNECT_AND_EXECVP(int *fd, char **args, int rw) {
     if (debug) printf(KGRN "?? Child %d: Exec'ing command '%s'" KNRM "\n", getpid(), args[0]);
+    signal(SIGPIPE, SIG_DFL);
     if (fd) {
         close(rw);          // Close the fd to be replaced by pipe fd
                             // Fill that closed fd slot with pipe fd
@@ -280,6 +371,37 @@ void pipeToMore(int *streamfd) {
     mypipeCONNECT_AND_EXECVP(streamfd, args, 0); // Does not return
 }
 
+/*
+Fork a new process running more, and feed it through a pipe from sockfd:
+an inline transfer on the control connection, or compressed blocks
+from a data connection, unpacked on the way.
+*/
+void pipeFeedToMore(int sockfd, int compressed) {
+    off_t received;
+    int fd[2];
+
+    if (pipe(fd) < 0) {
+        fprintf(stderr, KRED "!!! Error, creating pipe: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (fork()) {
+        // Parent
+        close(fd[0]);
+        if (inlinemode) serverReceiveInline(sockfd, fd[1], compressed, &received);
+        else            zipContents(sockfd, fd[1], 0, &received);
+        close(fd[1]);
+        waitForChildren(-1, 0);
+        return;
+    }
+
+    // Child
+    if (debug) printf(KGRN "?? Child %d: Started\n", getpid());
+    close(fd[1]);
+    char *args[] = {"more", "-n", "20", NULL};
+    mypipeCONNECT_AND_EXECVP(fd, args, 0); // Does not return
+}
+
 /****************************************************************************************
  * 
  *                                      COMMANDS
@@ -287,15 +409,12 @@ void pipeToMore(int *streamfd) {
  ****************************************************************************************/
 
 /*
-Send exit command to server, await response, then exit.
+Send exit command to server behind anything still pipelined, await response, then exit.
 */
-void cmdEXIT(int sockfd) {
-    char message[BUF_SIZE];
+void cmdEXIT(int sockfd, const char *addr) {
     if (debug) printf(KGRN "?? Exit command encountered\n");
-    writeToFD("Q\n", sockfd, 2);
-    serverReceiveMSG(message, sockfd);
-    if (debug) printf(KGRN "?? Client exiting normally\n");
-    exit(0);
+    pipelineQueue(sockfd, addr, 'Q', "Q\n", 2, -1, "");
+    pipelineFlush(sockfd, addr); // Does not return
 }
 
 /*
@@ -318,23 +437,23 @@ void cmdLS() {
 }
 
 /*
-Establish data connection with server.
-Fork off a new process to pipe the ls -l command into more -n 20.
+Ask the server for ls -l, which is piped into more -n 20 when the reply comes back.
 Remote operation.
 */
 void cmdRLS(int sockfd, const char *addr) {
-    char message[BUF_SIZE];
-    int datasockfd[2];
-
-    strcpy(message, "L\n");
+    pipelineQueue(sockfd, addr, 'L', "L\n", 2, -1, "");
+}
 
-    // Establish data connection
-    datasockfd[0] = serverConnectAndSend(sockfd, 2, addr, message);
-    if (datasockfd[0] < 0) return;
+/*
+Ask the server for its statistics, as a table or in format ("prom" for Prometheus's),
+which are piped into more -n 20 like a listing when the reply comes back.
+Remote operation.
+*/
+void cmdRSTATS(char *format, int sockfd, const char *addr) {
+    char message[BUF_SIZE+2];
 
-    // Pipe to more
-    if (debug) printf(KGRN "?? Forking child process to pipe ls ouptut into more\n");
-    pipeToMore(datasockfd);
+    snprintf(message, BUF_SIZE+2, "S%s\n", format ? format : "");
+    pipelineQueue(sockfd, addr, 'L', message, strlen(message), -1, "");
 }
 
 /*
@@ -354,19 +473,14 @@ void cmdCD(char *path) {
 CD into path stored in second token of buf.
 Server Operation.
 */
-void cmdRCD(char *path, int sockfd) {
+void cmdRCD(char *path, int sockfd, const char *addr) {
     char message[BUF_SIZE+2];
-    int datasockfd;
-    int len;
 
     if (checkArg(path)) return;
 
     // Prepare server message
     snprintf(message, BUF_SIZE+2, "C%s\n", path);
-
-    // Send control message to cd to path on the server
-    if (!serverSendAndReceiveMSG(message, sockfd, strlen(message)))
-        if (debug) printf(KGRN "?? Server successfully changed directory\n");
+    pipelineQueue(sockfd, addr, 'C', message, strlen(message), -1, path);
 }
 
 /*
@@ -374,69 +488,65 @@ Show specified file in server's cwd.
 */
 void cmdSHOW(char *path, int sockfd, const char *addr) {
     char message[BUF_SIZE+2];
-    int datasockfd[2];
 
     if (checkArg(path)) return;
 
     // Prepare server message
     snprintf(message, BUF_SIZE+2, "G%s\n", path);
-
-    // Establish data connection
-    datasockfd[0] = serverConnectAndSend(sockfd, strlen(message), addr, message);
-    if (datasockfd[0] < 0) return;
-
-    // Pipe to more
-    if (debug) printf(KGRN "?? Forking child process to pipe the file '%s' into more\n", path);
-    pipeToMore(datasockfd);
+    pipelineQueue(sockfd, addr, 'S', message, strlen(message), -1, path);
 }
 
 /*
 Get a file from server's cwd.
+The file is created right away and filled (or removed) once the reply comes back.
+Resuming (reget) continues an existing local file from its size instead.
 */
-void cmdGET(char *path, int sockfd, const char *addr) {
+void cmdGET(char *path, int sockfd, const char *addr, int resume) {
     char message[BUF_SIZE+2];
     char fn[BUF_SIZE];
-    int datasockfd;
+    struct pending *p;
+    off_t offset;
     int fd;
 
     if (checkArg(path)) return;
     if (checkFileType(".", 1, W_OK)) return;
+    if (!resume && stripes > 1 && !stripedGET(path, sockfd, addr)) return;
 
-    // Create file
+    // Create file (or open the partial one)
     extractFileName(fn, path);
-    if ((fd = open(fn, O_RDWR | O_CREAT | O_EXCL, S_IRWXU | S_IRGRP | S_IROTH)) < 0) {
+    if ((fd = open(fn, O_RDWR | O_CREAT | (resume ? 0 : O_EXCL), S_IRWXU | S_IRGRP | S_IROTH)) < 0) {
         fprintf(stderr, KRED "!!! Error, creating file '%s': %s\n", fn, strerror(errno));
         return;
     }
     if (debug)  printf(KGRN "?? Created file '%s' in current working directory with FD %d\n", 
                         fn, fd);
 
-    // Prepare server message
-    snprintf(message, BUF_SIZE+2, "G%s\n", path);
-
-    // Establish data connection
-    if ((datasockfd = serverConnectAndSend(sockfd, strlen(message), addr, message)) < 0) {
-        close(fd);
-        close(datasockfd);
-        if (remove(fn) < 0) {
-            fprintf(stderr, KRED "!!! Error, removing file '%s': %s\n", fn, strerror(errno));
-            exit(1);
+    offset = resume ? lseek(fd, 0, SEEK_END) : 0;
+    if (offset > 0) {
+        if (serverRestart(sockfd, addr, offset)) {
+            close(fd);
+            return;
         }
-        if (debug) printf(KGRN "?? Removed file '%s'\n", fn);
-        return;
+        printf(KNRM "* Resuming '%s' at byte %lld\n", fn, (long long)offset);
     }
-    
-    transferContents(datasockfd, fd);
-    close(fd);
-    close(datasockfd);
+
+    // Prepare server message
+    snprintf(message, BUF_SIZE+2, "G%s\n", path);
+    p = pipelineQueue(sockfd, addr, 'G', message, strlen(message), fd, fn);
+    p->keep = offset > 0;
+    p->start = offset;
 }
 
 /*
 Put a file into server's cwd.
+Resuming (reput) sends only what is missing from the server's copy of the file.
+With -s, chunks the server's store already holds aren't sent again (see chunkedPUT).
 */
-void cmdPUT(char *path, int sockfd, const char *addr) {
+void cmdPUT(char *path, int sockfd, const char *addr, int resume) {
     char message[BUF_SIZE+2];
-    int datasockfd;
+    char query[BUF_SIZE+2];
+    struct stat finfo;
+    off_t offset;
     int fd;
 
     if (checkArg(path)) return;
@@ -454,17 +564,696 @@ void cmdPUT(char *path, int sockfd, const char *addr) {
     extractFileName(message+1, path);
     strcat(message, "\n");
 
-    // Establish data connection
-    if ((datasockfd = serverConnectAndSend(sockfd, strlen(message), addr, message)) < 0) {
-        close(fd);
-        close(datasockfd);
+    offset = 0;
+    if (resume) {
+        // Ask how much of the file the server already has
+        pipelineFlush(sockfd, addr);
+        snprintf(query, BUF_SIZE+2, "Z%s", message+1);
+        offset = serverSendAndReceiveMSG(query, sockfd, strlen(query)) ? 0 : strtoll(query+1, NULL, 10);
+        fstat(fd, &finfo);
+
+        if (offset > finfo.st_size) {
+            fprintf(stderr, KRED "!!! Error: Server's copy of '%s' is larger than the local file\n", path);
+            close(fd);
+            return;
+        }
+        if (offset == finfo.st_size && offset) {
+            printf(KNRM "* Server already has all of '%s'\n", path);
+            close(fd);
+            return;
+        }
+        if (offset) {
+            if (serverRestart(sockfd, addr, offset)) {
+                close(fd);
+                return;
+            }
+            lseek(fd, offset, SEEK_SET);
+            printf(KNRM "* Resuming '%s' at byte %lld\n", path, (long long)offset);
+        } else {
+            printf(KNRM "* Nothing to resume on the server, putting all of '%s'\n", path);
+        }
+    }
+
+    if (!offset && storemode && !chunkedPUT(path, fd, message, sockfd, addr)) return;
+    pipelineUpload(sockfd, addr, 'P', message, fd, path)->start = offset;
+}
+
+/*
+Put a file into server's cwd as a delta against the server's copy of it (dput),
+so only the parts that changed travel.  The server's block signatures (V command)
+come back first, then the delta goes out like a put (U command), and the server
+swaps in the rebuilt file once all of it has arrived.
+Without a copy on the server to build on, the whole file is put.
+*/
+void cmdDPUT(char *path, int sockfd, const char *addr) {
+    char message[BUF_SIZE+2];
+    struct signature *sig;
+    struct pending *p;
+    struct stat finfo;
+    off_t literal;
+    int deltafd;
+    int sigfd;
+    int fd;
+
+    if (checkArg(path)) return;
+    if (checkFileType(path, 0, R_OK)) return;
+
+    if ((sigfd = deltaTemp(AT_FDCWD, P_tmpdir)) < 0) {
+        fprintf(stderr, KRED "!!! Error, creating temporary file in '%s': %s\n", P_tmpdir, strerror(errno));
+        return;
+    }
+
+    // Prepare server message
+    message[0] = 'V';
+    extractFileName(message+1, path);
+    strcat(message, "\n");
+
+    // The delta can't be worked out until the signatures are in
+    pipelineFlush(sockfd, addr);
+    p = pipelineQueue(sockfd, addr, 'V', message, strlen(message), sigfd, path);
+    pipelineFlush(sockfd, addr);
+    if (p->failed) {
+        printf(KNRM "* No copy of '%s' on the server to build on, putting all of it\n", path);
+        cmdPUT(path, sockfd, addr, 0);
         return;
     }
 
-    // Open file and transfer contents
-    transferContents(fd, datasockfd);
+    sig = deltaLoad(sigfd);
+    close(sigfd);
+    if (!sig) {
+        fprintf(stderr, KRED "!!! Error, reading block signatures of '%s': %s\n", path, strerror(errno));
+        return;
+    }
+
+    deltafd = -1;
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &finfo) < 0 || (deltafd = deltaTemp(AT_FDCWD, P_tmpdir)) < 0 
+            || deltaGenerate(fd, sig, deltafd, &literal) || lseek(deltafd, 0, SEEK_SET) < 0) {
+        fprintf(stderr, KRED "!!! Error, working out the delta of '%s': %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        if (deltafd >= 0) close(deltafd);
+        deltaFree(sig);
+        return;
+    }
+    deltaFree(sig);
     close(fd);
+    printf(KNRM "* Sending '%s' as a delta: %lld of its %lld bytes are new\n", 
+            path, (long long)literal, (long long)finfo.st_size);
+
+    // The server's K accounts for the whole rebuilt file
+    message[0] = 'U';
+    pipelineUpload(sockfd, addr, 'U', message, deltafd, path)->moved = finfo.st_size;
+}
+
+/****************************************************************************************
+ * 
+ *                                      PIPELINE
+ * 
+ ****************************************************************************************/
+
+/*
+Queue a remote command's request (size bytes of message) to go out with the rest of
+the batch, preceded by a D if the command needs a data connection, and by a Y if
+its data should be compressed.  Gets and puts are followed by a K to check them.
+cmd says how pipelineReply handles its reply; fd and path are the local file it needs.
+
+@return the queued command
+*/
+struct pending *pipelineQueue(int sockfd, const char *addr, char cmd, char *message, int size, int fd, char *path) {
+    struct pending *p;
+
+    // The Y and the K go out in the same batch as their command
+    if (pipelined+3 > PIPELINE_MAX || requestlen+size+6 > PIPELINE_BYTES) pipelineFlush(sockfd, addr);
+
+    if (compressmode && size && strchr("LSGPUM", cmd)) pipelineAdd('Y', "Y\n", 2, -1, "");
+    if (!inlinemode && strchr("LSGPUVM", cmd)) {
+        memcpy(requests+requestlen, "D\n", 2);
+        requestlen += 2;
+        requestlines++;
+    }
+    p = pipelineAdd(cmd, message, size, fd, path);
+    if (checkmode && strchr("GPUM", cmd)) pipelineAdd('K', "K\n", 2, -1, path);
+    if (debug) printf(KGRN "?? Queued %c command (%d awaiting replies)\n", cmd, pipelined);
+    return p;
+}
+
+/*
+Add one command (and size bytes of its request) to the batch.
+
+@return the added command
+*/
+struct pending *pipelineAdd(char cmd, char *message, int size, int fd, char *path) {
+    struct pending *p;
+
+    if (size) memcpy(requests+requestlen, message, size);
+    requestlen += size;
+    if (size) requestlines++;
+
+    p = &pipeline[pipelined++];
+    memset(p, 0, offsetof(struct pending, path));
+    p->cmd = cmd;
+    p->req = tracesent + requestlines;  // Its request is the last one queued, or (size 0) just sent
+    p->fd = fd;
+    strcpy(p->path, path);
+    return p;
+}
+
+/*
+Queue a P, U or M (message) whose data is read from fd, which is closed once sent.
+Inline frames go out right behind the command, so the replies to everything queued
+before it have to be read first; otherwise both sides could end up blocked writing.
+
+@return the queued command
+*/
+struct pending *pipelineUpload(int sockfd, const char *addr, char cmd, char *message, int fd, char *path) {
+    char query[BUF_SIZE];
+    struct pending *p;
+    uint64_t began;
+    off_t sent;
+    int compressed;
+
+    if (!inlinemode) return pipelineQueue(sockfd, addr, cmd, message, strlen(message), fd, path);
+    compressed = 0;
+
+    // Frames follow the command without waiting for A; the server skips them if it says no.
+    // So whether they may be compressed has to be settled first.
+    pipelineFlush(sockfd, addr);
+    if (compressmode) {
+        strcpy(query, "Y\n");
+        compressed = !serverSendAndReceiveMSG(query, sockfd, 2);
+        if (!compressed) serverNoCompression();
+    }
+    if (debug) printf(KGRN "?? Sending %c command to server\n", cmd);
+    serverSendCommands(message, sockfd, strlen(message));
+    began = traceNow();
+    serverSendInline(fd, sockfd, compressed, &sent);
+    clientTrace("phase", "transfer", began, tracesent, sent);
+    if (debug) printf(KGRN "?? Sent %lld bytes from '%s'\n", (long long)sent, path);
+    close(fd);
+    p = pipelineQueue(sockfd, addr, cmd, NULL, 0, -1, path);
+    p->moved = sent;
+    return p;
+}
+
+/*
+Send every queued request in one write, then handle their replies in order.
+*/
+void pipelineFlush(int sockfd, const char *addr) {
+    uint64_t began;
+    int count;
+    int i;
+
+    if (requestlen) {
+        if (debug) printf(KGRN "?? Sending %d pipelined command(s) to server\n", pipelined);
+        began = traceNow();
+        if (serverSendCommands(requests, sockfd, requestlen)) {
+            fprintf(stderr, KRED "!!! Error, writing to server: Unexpected EOF\n");
+            exit(1);
+        }
+        clientTrace("phase", "send requests", began, 0, requestlen);
+        requestlen = 0;
+        requestlines = 0;
+    }
+
+    count = pipelined;
+    pipelined = 0;
+    for (i = 0; i < count; i++) pipelineReply(&pipeline[i], sockfd, addr);
+}
+
+/*
+Handle the server's reply to one pipelined command, then move its data.
+*/
+void pipelineReply(struct pending *p, int sockfd, const char *addr) {
+    char message[BUF_SIZE];
+    uint64_t began = traceNow();
+    uint64_t waited;
+    off_t moved;
+    int datasockfd[2];
+    int failed;
+
+    // The D was sent right ahead of the command
+    datasockfd[0] = -1;
+    if (!inlinemode && strchr("LSGPUVM", p->cmd)) datasockfd[0] = serverDataConnection(sockfd, addr, p->req-1);
+
+    waited = traceNow();
+    failed = serverReceiveMSG(message, sockfd);
+    clientTrace("phase", "reply", waited, p->req, -1);
+    if (p->cmd == 'Q') {
+        if (debug) printf(KGRN "?? Client exiting normally\n");
+        pipelineTrace(p, began);
+        exit(0);
+    }
+
+    if (failed) {
+        p->failed = 1;
+        if (p->cmd == 'Y') serverNoCompression();
+        if (p->cmd == 'K') serverChecksumFailed(message, p[-1].failed ? NULL : p->path);
+        if (datasockfd[0] >= 0) close(datasockfd[0]);
+        if (p->fd >= 0) close(p->fd);
+        if (p->cmd == 'G' && !p->keep && remove(p->path) < 0) {
+            fprintf(stderr, KRED "!!! Error, removing file '%s': %s\n", p->path, strerror(errno));
+            exit(1);
+        }
+        if (p->cmd == 'G' && !p->keep && debug) printf(KGRN "?? Removed file '%s'\n", p->path);
+        pipelineTrace(p, began);
+        return;
+    }
+
+    if (p->cmd == 'Y') {
+        // Its command is always queued right behind it
+        p[1].zip = 1;
+    } else if (p->cmd == 'K') {
+        // ...and a K right after it
+        pipelineCheck(p-1, message);
+    } else if (p->cmd == 'C') {
+        if (debug) printf(KGRN "?? Server successfully changed directory\n");
+        stripeTrackRCD(p->path);
+    } else if (p->cmd == 'L' || p->cmd == 'S') {
+        if (debug) printf(KGRN "?? Forking child process to pipe server output into more\n");
+        if (inlinemode) {
+            pipeFeedToMore(sockfd, p->zip);
+        } else if (p->zip) {
+            pipeFeedToMore(datasockfd[0], 1);
+            close(datasockfd[0]);
+        } else {
+            pipeToMore(datasockfd);
+        }
+    } else if (p->cmd == 'G' || p->cmd == 'V') {
+        waited = traceNow();
+        if (inlinemode) {
+            serverReceiveInline(sockfd, p->fd, p->zip, &moved);
+        } else {
+            if (p->zip) zipContents(datasockfd[0], p->fd, 0, &moved);
+            else        spliceContents(datasockfd[0], p->fd, &moved);
+            close(datasockfd[0]);
+        }
+        if (debug) printf(KGRN "?? Received %lld bytes %s '%s'\n", (long long)moved, 
+                            p->cmd == 'G' ? "into" : "of signatures for", p->path);
+        clientTrace("phase", "transfer", waited, p->req, moved);
+        // The signatures are read back by cmdDPUT
+        if (p->cmd == 'G') close(p->fd);
+        p->moved = moved;
+    } else if ((p->cmd == 'P' || p->cmd == 'U' || p->cmd == 'M') && !inlinemode) {
+        waited = traceNow();
+        if (p->zip) zipContents(p->fd, datasockfd[0], 1, &moved);
+        else        sendFileContents(p->fd, datasockfd[0], &moved);
+        clientTrace("phase", "transfer", waited, p->req, moved);
+        if (debug) printf(KGRN "?? Sent %lld bytes from '%s'\n", (long long)moved, p->path);
+        // A U's or M's count is the whole file, for its K
+        if (p->cmd == 'P') p->moved = moved;
+        close(p->fd);
+        close(datasockfd[0]);
+    }
+    pipelineTrace(p, began);
+}
+
+/*
+Compare the get or put p with the server's account of it (reply to its K, A<bytes> <crc>):
+the same number of bytes, with the same CRC32C as the local file's copy of them.
+A get that doesn't match is removed, unless it was resumed.
+*/
+void pipelineCheck(struct pending *p, char *reply) {
+    uint64_t began;
+    long long bytes;
+    unsigned crc;
+    uint32_t local;
+    int fd;
+
+    // Turned down: there was nothing to check
+    if (p->failed) return;
+
+    if (sscanf(reply+1, "%lld %u", &bytes, &crc) != 2) {
+        fprintf(stderr, KRED "!!! Error, invalid checksum reply: '%s'\n", reply);
+        return;
+    }
+
+    local = 0;
+    began = traceNow();
+    if ((fd = open(p->path, O_RDONLY)) < 0 || crcFile(fd, p->start, p->moved, &local)) {
+        fprintf(stderr, KRED "!!! Error, checksumming '%s': %s\n", p->path, strerror(errno));
+    }
+    if (fd >= 0) close(fd);
+    clientTrace("phase", "checksum", began, p[1].req, p->moved);
+
+    if (bytes == p->moved && crc == local) {
+        if (debug) printf(KGRN "?? Checked '%s': %lld bytes, CRC32C %08x\n", p->path, bytes, crc);
+        return;
+    }
+
+    fprintf(stderr, KRED "!!! Error: '%s' %s %lld bytes (CRC32C %08x) but the server %s %lld (CRC32C %08x)\n", 
+            p->path, p->cmd == 'G' ? "received" : "sent", (long long)p->moved, local, 
+            p->cmd == 'G' ? "sent" : "received", bytes, crc);
+    if (p->cmd != 'G' || p->keep) return;
+
+    if (remove(p->path) < 0) fprintf(stderr, KRED "!!! Error, removing file '%s': %s\n", p->path, strerror(errno));
+    else if (debug) printf(KGRN "?? Removed file '%s'\n", p->path);
+}
+
+/*
+Trace the pipelined command p, from when its reply was first awaited (began) until now.
+*/
+void pipelineTrace(struct pending *p, uint64_t began) {
+    char name[BUF_SIZE+8];
+
+    if (!began) return;
+    snprintf(name, sizeof(name), p->path[0] ? "%c %s" : "%c", p->cmd, p->path);
+    clientTrace("command", name, began, p->req, p->moved ? p->moved : -1);
+}
+
+/****************************************************************************************
+ * 
+ *                                      STRIPES
+ * 
+ ****************************************************************************************/
+
+/*
+Get a large file as stripes of stripesize bytes, fetched with R commands over
+several connections at once.  Each worker process opens its own control connection
+(changing to remotedir first) and data connections, and splices its ranges into
+the file at their offsets.  Afterwards, any stripe that came up short is fetched
+again on the main connection before the file is accepted.
+
+@return 0: handled (or failed) 1: file too small to stripe, get it normally
+*/
+int stripedGET(char *path, int sockfd, const char *addr) {
+    char message[BUF_SIZE+2];
+    char fn[BUF_SIZE];
+    off_t *done;
+    off_t received;
+    off_t offset;
+    off_t length;
+    off_t size;
+    int count;
+    int failed;
+    int fd;
+    int i;
+
+    if (!remotedirok) return 1;
+
+    // The size query's reply has to come after everything already queued
+    pipelineFlush(sockfd, addr);
+    snprintf(message, BUF_SIZE+2, "Z%s\n", path);
+    if (serverSendAndReceiveMSG(message, sockfd, strlen(message))) return 0;
+    size = strtoll(message+1, NULL, 10);
+    if (size < 2*stripesize) return 1;
+    count = (size + stripesize - 1) / stripesize;
+
+    extractFileName(fn, path);
+    if ((fd = open(fn, O_RDWR | O_CREAT | O_EXCL, S_IRWXU | S_IRGRP | S_IROTH)) < 0) {
+        fprintf(stderr, KRED "!!! Error, creating file '%s': %s\n", fn, strerror(errno));
+        return 0;
+    }
+    if (ftruncate(fd, size) < 0 || (done = mmap(NULL, count*sizeof(off_t), PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        fprintf(stderr, KRED "!!! Error, preparing file '%s': %s\n", fn, strerror(errno));
+        close(fd);
+        remove(fn);
+        return 0;
+    }
+
+    printf(KNRM "* Getting '%s' (%lld bytes) as %d stripes over %d connections\n",
+            path, (long long)size, count, stripes < count ? stripes : count);
+    fflush(stdout);
+    for (i = 0; i < stripes && i < count; i++) {
+        if (!fork()) stripeWorker(i, path, fn, size, done, addr); // Does not return
+    }
+    waitForChildren(-1, 0);
+
+    // Reassemble: every stripe must have arrived whole
+    failed = 0;
+    for (i = 0; i < count && !failed; i++) {
+        offset = (off_t)i * stripesize;
+        length = size - offset < stripesize ? size - offset : stripesize;
+        if (done[i] == length) continue;
+
+        fprintf(stderr, KRED "!!! Error: Stripe %d got %lld of %lld bytes, fetching it again\n",
+                i, (long long)done[i], (long long)length);
+        failed = stripeFetch(sockfd, fd, path, offset, length, addr, &received);
+    }
+
+    munmap(done, count*sizeof(off_t));
+    close(fd);
+    if (failed) {
+        fprintf(stderr, KRED "!!! Error: Striped get of '%s' failed\n", path);
+        if (remove(fn) < 0) fprintf(stderr, KRED "!!! Error, removing file '%s': %s\n", fn, strerror(errno));
+        return 0;
+    }
+    if (debug) printf(KGRN "?? Received %lld bytes into '%s'\n", (long long)size, fn);
+    return 0;
+}
+
+/*
+Worker process for a striped get: fetch stripes worker, worker+stripes, ... of the
+file at path into fn, recording how much of each arrived in done.
+*/
+void stripeWorker(int worker, char *path, char *fn, off_t size, off_t *done, const char *addr) {
+    char message[BUF_SIZE+2];
+    char port[BUF_SIZE];
+    off_t offset;
+    int sockfd;
+    int fd;
+    int i;
+
+    if (debug) printf(KGRN "?? Child %d: Stripe worker %d started\n", getpid(), worker);
+
+    // The parent's buffered replies belong to its own connection
+    lineInit(&ctrl);
+    snprintf(port, BUF_SIZE, "%d", SERV_PORT);
+    sockfd = clientInit(port, addr);
+
+    // A connection of its own, traced as a session of its own
+    tracesent = 0;
+    if (tracefd >= 0) {
+        snprintf(tracesession+strlen(tracesession), TRACE_ID-strlen(tracesession), ".%d", worker);
+        serverTrace(sockfd);
+    }
+    if (binarymode && serverUseBinary(sockfd)) exit(1);
+
+    if (remotedir[0]) {
+        snprintf(message, BUF_SIZE+2, "C%s\n", remotedir);
+        if (serverSendAndReceiveMSG(message, sockfd, strlen(message))) exit(1);
+    }
+
+    if ((fd = open(fn, O_RDWR)) < 0) {
+        fprintf(stderr, KRED "!!! Child %d Error, opening file '%s': %s\n", getpid(), fn, strerror(errno));
+        exit(1);
+    }
+
+    for (i = worker; (offset = (off_t)i * stripesize) < size; i += stripes) {
+        stripeFetch(sockfd, fd, path, offset, size - offset < stripesize ? size - offset : stripesize,
+                    addr, &done[i]);
+    }
+
+    close(fd);
+    strcpy(message, "Q\n");
+    serverSendAndReceiveMSG(message, sockfd, 2);
+    exit(0);
+}
+
+/*
+Fetch length bytes of the file at path, starting at offset, over a new data connection
+and splice them into fd at the same offset.  The D and R requests (and K, to check
+the stripe) go out together.
+
+@return 0: success 1: failure (received holds what arrived, 0 if it doesn't check out)
+*/
+int stripeFetch(int sockfd, int fd, char *path, off_t offset, off_t length, const char *addr, off_t *received) {
+    char message[BUF_SIZE+64];
+    uint64_t began = traceNow();
+    uint64_t waited;
+    int datasockfd;
+    int failed;
+    int req;
+
+    *received = 0;
+    snprintf(message, BUF_SIZE+64, "D\nR%lld %lld %s\n%s", (long long)offset, (long long)length, path,
+                checkmode ? "K\n" : "");
+    if (debug) printf(KGRN "?? Requesting bytes %lld-%lld of '%s'\n", 
+                        (long long)offset, (long long)(offset+length), path);
+    req = tracesent + 1;
+    serverSendCommands(message, sockfd, strlen(message));
+
+    datasockfd = serverDataConnection(sockfd, addr, req);
+    waited = traceNow();
+    failed = serverReceiveMSG(message, sockfd);
+    clientTrace("phase", "reply", waited, req+1, -1);
+    if (!failed && lseek(fd, offset, SEEK_SET) < 0) {
+        fprintf(stderr, KRED "!!! Error, seeking in FD %d: %s\n", fd, strerror(errno));
+        failed = 1;
+    }
+    waited = traceNow();
+    if (!failed) spliceContents(datasockfd, fd, received);
+    if (!failed) clientTrace("phase", "transfer", waited, req+1, *received);
     close(datasockfd);
+
+    // The K's reply comes either way
+    waited = traceNow();
+    if (checkmode && stripeCheck(sockfd, fd, path, offset, failed ? -1 : *received)) *received = 0;
+    if (checkmode) clientTrace("command", "K", waited, req+2, *received);
+
+    if (began) {
+        snprintf(message, BUF_SIZE+64, "R %lld %lld %s", (long long)offset, (long long)length, path);
+        clientTrace("command", message, began, req+1, *received);
+    }
+    return failed || *received != length;
+}
+
+/*
+Read the reply to a stripe's K and compare it with the received bytes of path at offset in fd
+(-1: the stripe wasn't fetched, so the reply is only read).
+
+@return 0: success 1: failure (the stripe doesn't match)
+*/
+int stripeCheck(int sockfd, int fd, char *path, off_t offset, off_t received) {
+    char message[BUF_SIZE];
+    long long bytes;
+    unsigned crc;
+    uint32_t local;
+
+    if (serverReceiveMSG(message, sockfd)) {
+        serverChecksumFailed(message, received < 0 ? NULL : path);
+        return 0;
+    }
+    if (received < 0) return 0;
+
+    if (sscanf(message+1, "%lld %u", &bytes, &crc) != 2 || crcFile(fd, offset, received, &local)) {
+        fprintf(stderr, KRED "!!! Error: Cannot check bytes %lld-%lld\n", 
+                (long long)offset, (long long)(offset+received));
+        return 1;
+    }
+    if (bytes == received && crc == local) return 0;
+
+    fprintf(stderr, KRED "!!! Error: Bytes %lld-%lld have CRC32C %08x, but the server sent %lld with %08x\n",
+            (long long)offset, (long long)(offset+received), local, bytes, crc);
+    return 1;
+}
+
+/*
+Follow a successful rcd, so that stripe workers can change to the same server directory.
+*/
+void stripeTrackRCD(char *path) {
+    int len;
+
+    len = strlen(remotedir);
+    if (path[0] == '/') len = 0;
+    if (len + strlen(path) + 2 > BUF_SIZE) {
+        remotedirok = 0;
+        return;
+    }
+    if (len) remotedir[len++] = '/';
+    strcpy(remotedir+len, path);
+}
+
+/****************************************************************************************
+ * 
+ *                                      CHUNKS
+ * 
+ ****************************************************************************************/
+
+/*
+Put a file (open as fd; message is its P) through the server's store: ask which of its
+chunks (see deltaChunk) the store holds already, then send the rest, and references
+to those, with an M command.  The server assembles the file once it has all arrived.
+fd is closed if the file is handled here.
+
+@return 0: handled (or failed) 1: the store has none of it, put the file normally
+*/
+int chunkedPUT(char *path, int fd, char *message, int sockfd, const char *addr) {
+    struct chunk *chunks;
+    struct stat finfo;
+    off_t literal;
+    int deltafd;
+    int stored;
+    int count;
+    int i;
+
+    if (fstat(fd, &finfo) < 0 || !(chunks = deltaChunkFile(fd, &count))) return 1;
+
+    // The answers have to be in before the chunks can be picked
+    pipelineFlush(sockfd, addr);
+    if (chunkQuery(chunks, count, sockfd)) {
+        free(chunks);
+        return 1;
+    }
+    for (stored = 0, i = 0; i < count; i++) stored += chunks[i].stored;
+    if (!stored) {
+        if (debug) printf(KGRN "?? Server's store has none of the %d chunks of '%s'\n", count, path);
+        free(chunks);
+        return 1;
+    }
+
+    if ((deltafd = deltaTemp(AT_FDCWD, P_tmpdir)) < 0 || deltaGenerateChunks(fd, chunks, count, deltafd, &literal) 
+            || lseek(deltafd, 0, SEEK_SET) < 0) {
+        fprintf(stderr, KRED "!!! Error, picking the new chunks of '%s': %s\n", path, strerror(errno));
+        if (deltafd >= 0) close(deltafd);
+        free(chunks);
+        close(fd);
+        return 0;
+    }
+    free(chunks);
+    close(fd);
+    printf(KNRM "* Sending '%s' through the server's store: %lld of its %lld bytes are new\n", 
+            path, (long long)literal, (long long)finfo.st_size);
+
+    // The server's K accounts for the whole assembled file
+    message[0] = 'M';
+    pipelineUpload(sockfd, addr, 'M', message, deltafd, path)->moved = finfo.st_size;
+    return 0;
+}
+
+/*
+Mark which of count chunks the server's store holds, asking about CHUNK_QUERY at a time
+with H commands, PIPELINE_MAX of them per batch.  Nothing else may be awaiting replies.
+
+@return 0: success 1: failure (the server has no store)
+*/
+int chunkQuery(struct chunk *chunks, int count, int sockfd) {
+    char buf[PIPELINE_MAX * (2 + CHUNK_QUERY * (2*CHUNK_HASH+1))];
+    char reply[BUF_SIZE];
+    int queries;
+    int failed;
+    int batch;
+    int end;
+    int len;
+    int n;
+    int i;
+    int j;
+
+    failed = 0;
+    for (batch = 0; batch < count; batch = end) {
+        end = count - batch > PIPELINE_MAX * CHUNK_QUERY ? batch + PIPELINE_MAX * CHUNK_QUERY : count;
+        for (len = 0, queries = 0, i = batch; i < end; i++) {
+            if ((i - batch) % CHUNK_QUERY == 0) {
+                if (len) buf[len++] = '\n';
+                buf[len++] = 'H';
+                queries++;
+            } else {
+                buf[len++] = ' ';
+            }
+            deltaHex(chunks[i].hash, buf+len);
+            len += 2*CHUNK_HASH;
+        }
+        buf[len++] = '\n';
+
+        if (debug) printf(KGRN "?? Asking the server's store about %d chunk(s)\n", end - batch);
+        if (serverSendCommands(buf, sockfd, len)) {
+            fprintf(stderr, KRED "!!! Error, writing to server: Unexpected EOF\n");
+            exit(1);
+        }
+
+        // Every reply is read, even after a failure, to stay in step
+        for (i = batch; queries--; ) {
+            if (serverReceiveMSG(reply, sockfd)) failed = 1;
+            n = strlen(reply);
+            for (j = 0; j < CHUNK_QUERY && i < end; j++, i++) {
+                chunks[i].stored = !failed && j+1 < n && reply[j+1] == '1';
+            }
+        }
+        if (failed) {
+            serverNoStore();
+            return 1;
+        }
+    }
+    return 0;
 }
 
 /****************************************************************************************
@@ -475,26 +1264,37 @@ void cmdPUT(char *path, int sockfd, const char *addr) {
 
 /*
 Interpret null-terminated user command (cmd) with arg.
+Remote commands are only queued; local ones wait for the queued replies first.
 */
 void userParseInput(char *cmd, char *arg, int sockfd, const char *addr) {
     if (debug) printf(KGRN "?? Received command: '%s'\n", cmd);
 
     if (!strcmp(cmd, "exit")) {
-        cmdEXIT(sockfd);
+        cmdEXIT(sockfd, addr);
     } else if (!strcmp(cmd, "ls")) {
+        pipelineFlush(sockfd, addr);
         cmdLS();
     } else if (!strcmp(cmd, "rls")) {
         cmdRLS(sockfd, addr);
+    } else if (!strcmp(cmd, "rstats")) {
+        cmdRSTATS(arg, sockfd, addr);
     } else if (!strcmp(cmd, "cd")) {
+        pipelineFlush(sockfd, addr);
         cmdCD(arg);
     } else if (!strcmp(cmd, "rcd")) {
-        cmdRCD(arg, sockfd);
+        cmdRCD(arg, sockfd, addr);
     } else if (!strcmp(cmd, "show")) {
         cmdSHOW(arg, sockfd, addr);
     } else if (!strcmp(cmd, "get")) {
-        cmdGET(arg, sockfd, addr);
+        cmdGET(arg, sockfd, addr, 0);
+    } else if (!strcmp(cmd, "reget")) {
+        cmdGET(arg, sockfd, addr, 1);
     } else if (!strcmp(cmd, "put")) {
-        cmdPUT(arg, sockfd, addr);
+        cmdPUT(arg, sockfd, addr, 0);
+    } else if (!strcmp(cmd, "reput")) {
+        cmdPUT(arg, sockfd, addr, 1);
+    } else if (!strcmp(cmd, "dput")) {
+        cmdDPUT(arg, sockfd, addr);
     } else {
         fprintf(stderr, KRED "!!! Error: Unknown command: '%s'\n", cmd);
         return;
@@ -525,30 +1325,48 @@ void userCleanAndParseInput(char *buf, int sockfd, const char *addr) {
 
 /*
 Take in input from the user.
+Every complete line that has arrived is queued before any replies are awaited,
+so the remote commands of a script are pipelined.  EOF exits like "exit".
 */
 void userInput(int sockfd, const char *addr) {
+    char line[BUF_SIZE];
     char buf[BUF_SIZE];
+    char *nl;
     int actual;
+    int len;
+    int size;
     
+    len = 0;
     while (1) {
         printf(KNRM "MYFTP > ");
         fflush(stdout);
 
         errno = 0;
-        while (actual = read(0, buf, BUF_SIZE-1)) {
-            if (errno && actual < 0) {
-                fprintf(stderr, KRED "!!! Error, reading user input: %s\n", strerror(errno));
-                exit(1);
-            }
-
-            buf[actual] = 0;
+        actual = read(0, buf+len, BUF_SIZE-len-1);
+        if (actual < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, KRED "!!! Error, reading user input: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (actual == 0) {
+            buf[len] = 0;
             userCleanAndParseInput(buf, sockfd, addr);
-
-            printf(KNRM "MYFTP > ");
-            fflush(stdout);
+            printf(KNRM "\n* End of input\n");
+            cmdEXIT(sockfd, addr); // Does not return
+        }
+        len += actual;
+
+        // A full buffer without a newline counts as one line
+        while ((nl = memchr(buf, '\n', len)) || len == BUF_SIZE-1) {
+            size = nl ? nl-buf+1 : len;
+            memcpy(line, buf, size);
+            line[size] = 0;
+            memmove(buf, buf+size, len-size);
+            len -= size;
+            userCleanAndParseInput(line, sockfd, addr);
         }
 
-        fprintf(stderr, "\n! Error, reading user input: Unexpected EOF received\n");
+        pipelineFlush(sockfd, addr);
     }
 }
 
@@ -577,33 +1395,228 @@ int serverParseMSG(char *buf) {
 /*
 Receive message from server and store it in dst (null-terminated).
 dst MUST be of size BUF_SIZE or more.
+Anything the server sent after the message (like inline frames) stays in ctrl.
 
 @return 0: success 1: failure
 */
 int serverReceiveMSG(char *dst, int sockfd) {
+    struct binhdr h;
     int actual;
-    int head;
+    int len;
     
     if (debug) printf(KGRN "?? Awaiting server response...\n");
 
-    head = 0;
-    errno = 0;
-    while (actual = read(sockfd, dst+head, BUF_SIZE-head-1)){
-        if (errno && actual < 0) {
+    while ((len = binarymode ? binNext(&ctrl, &h, dst, BUF_SIZE-1)
+                             : lineNext(&ctrl, dst, BUF_SIZE)) == LINE_NONE) {
+        errno = 0;
+        actual = lineFill(&ctrl, sockfd);
+        if (actual < 0) {
+            if (errno == EINTR) continue;
             fprintf(stderr, KRED "!!! Error, reading from FD %d: %s\n", sockfd, strerror(errno));
             exit(1);
         }
-        dst[head+actual] = 0;
-        if (actual == BUF_SIZE-head-1 || strchr(dst, '\n')) {
-            dst[head+actual-1] = 0;
-            return serverParseMSG(dst);
+        if (actual == 0) {
+            fprintf(stderr, KRED "!!! Error, reading server message: "
+                            "Control socket closed unexpectedly\n");
+            exit(1);
         }
-        head += actual;
     }
 
-    fprintf(stderr, KRED "!!! Error, reading server message: "
-                    "Control socket closed unexpectedly\n");
-    exit(1);
+    if (len == LINE_LONG) {
+        fprintf(stderr, KRED "!!! Error, server response longer than %d bytes\n", BUF_SIZE-1);
+        if (binarymode) exit(1);
+        return 1;
+    }
+    if (binarymode) serverDecodeBinary(dst, &h);
+    return serverParseMSG(dst);
+}
+
+/*
+Turn the binary reply with header h and its payload (in dst) into the matching
+text reply, so callers read both protocols alike.  Replies come back in the
+order the commands went out, so a skipped or repeated request id means the
+connection is out of step.
+*/
+void serverDecodeBinary(char *dst, struct binhdr *h) {
+    uint64_t value;
+    uint64_t pair[2];
+    uint32_t code;
+
+    if (h->id != (uint16_t)(binreplied + 1)) {
+        fprintf(stderr, KRED "!!! Error: Reply to request %u arrived while expecting %u\n", 
+                h->id, (uint16_t)(binreplied + 1));
+        exit(1);
+    }
+    binreplied = h->id;
+
+    if (h->op == 'A' && (h->flags & BIN_TEXT) && h->len < BUF_SIZE-1) {
+        memmove(dst+1, dst, h->len + 1);
+        dst[0] = 'A';
+    } else if (h->op == 'A' && h->len == sizeof(value)) {
+        memcpy(&value, dst, sizeof(value));
+        snprintf(dst, BUF_SIZE, "A%lld", (long long)be64toh(value));
+    } else if (h->op == 'E' && h->len == sizeof(code)) {
+        memcpy(&code, dst, sizeof(code));
+        snprintf(dst, BUF_SIZE, "E%s", errorText(ntohl(code)));
+    } else if (h->op == 'A' && h->len == sizeof(pair)) {
+        memcpy(pair, dst, sizeof(pair));
+        snprintf(dst, BUF_SIZE, "A%lld %lld", (long long)be64toh(pair[0]), (long long)be64toh(pair[1]));
+    } else if (h->op == 'A' && h->len == 0) {
+        strcpy(dst, "A");
+    } else {
+        snprintf(dst, BUF_SIZE, "%c (%u byte payload)", h->op, h->len);
+    }
+}
+
+/*
+Read up to size bytes of inline data from the control connection,
+starting with whatever serverReceiveMSG left in ctrl.
+
+@return bytes read
+*/
+int serverReadControl(int sockfd, char *dst, int size) {
+    int actual;
+
+    if (lineUsed(&ctrl)) return lineTake(&ctrl, dst, size);
+
+    while ((actual = read(sockfd, dst, size)) < 0 && errno == EINTR);
+    if (actual < 0) {
+        fprintf(stderr, KRED "!!! Error, reading from FD %d: %s\n", sockfd, strerror(errno));
+        exit(1);
+    }
+    if (actual == 0) {
+        fprintf(stderr, KRED "!!! Error, reading inline data: "
+                        "Control socket closed unexpectedly\n");
+        exit(1);
+    }
+    return actual;
+}
+
+/*
+Receive an inline transfer's frames from the control connection and write their payload to fd,
+unpacking it first if compressed.
+Once fd stops taking data (e.g. the user quit more), the rest is still read and dropped
+so that the control connection stays in step with the server.
+
+@return 0: success 1: failure
+*/
+int serverReceiveInline(int sockfd, int fd, int compressed, off_t *received) {
+    static char buf[FRAME_MAX];
+    struct zipper *zp;
+    uint32_t len;
+    char *data;
+    char *dst;
+    int failed;
+    int actual;
+    int written;
+    int head;
+    int size;
+    int n;
+
+    *received = 0;
+    failed = 0;
+    zp = NULL;
+    if (compressed && !(zp = zipOpen(0))) {
+        fprintf(stderr, KRED "!!! Error, setting up decompression: %s\n", strerror(errno));
+        failed = 1;
+    }
+
+    while (1) {
+        for (head = 0; head < FRAME_HDR; head += serverReadControl(sockfd, (char*)&len+head, FRAME_HDR-head));
+        len = ntohl(len);
+
+        if (len == FRAME_END) break;
+        if (len == FRAME_ABORT) {
+            fprintf(stderr, KRED "!!! Error: Server abandoned the transfer\n");
+            zipClose(zp);
+            return 1;
+        }
+        if (len > FRAME_MAX) {
+            fprintf(stderr, KRED "!!! Error, reading inline data: Frame of %u bytes is too long\n", len);
+            exit(1);
+        }
+
+        while (len) {
+            // A block at a time, so each whole one can be written out
+            dst = buf;
+            size = zp ? zipNeed(zp, &dst) : FRAME_MAX;
+            actual = serverReadControl(sockfd, dst, size < len ? size : len);
+            len -= actual;
+
+            data = buf;
+            n = actual;
+            if (zp && (n = zipGot(zp, actual, &data)) == ZIP_BAD) {
+                fprintf(stderr, KRED "!!! Error, reading inline data: Corrupt compressed block\n");
+                zipClose(zp);
+                zp = NULL;
+                failed = 1;
+            }
+            if (n <= 0) continue;
+            *received += n;
+
+            for (head = 0; !failed && head < n; head += written) {
+                if ((written = write(fd, data+head, n-head)) >= 0) continue;
+                written = 0;
+                if (errno == EINTR) continue;
+                if (errno != EPIPE) fprintf(stderr, KRED "!!! Error, writing to FD %d: %s\n", fd, strerror(errno));
+                failed = 1;
+            }
+        }
+    }
+
+    if (zp && !zp->ended) {
+        fprintf(stderr, KRED "!!! Error, reading inline data: Compressed stream cut short\n");
+        failed = 1;
+    }
+    zipClose(zp);
+    if (debug) printf(KGRN "?? Finished receiving inline data\n");
+    return failed;
+}
+
+/*
+Send fd's contents to the server as inline frames, ending with an empty frame
+(or an abort frame if fd can't be read).  Compressed, each frame carries one block,
+and the block that ends the stream goes right before the empty frame.
+
+@return 0: success 1: failure
+*/
+int serverSendInline(int fd, int sockfd, int compressed, off_t *sent) {
+    static char buf[FRAME_HDR+FRAME_MAX];
+    struct zipper *zp;
+    uint32_t len;
+    int actual;
+    int size;
+
+    *sent = 0;
+    zp = NULL;
+    if (compressed && !(zp = zipOpen(1))) {
+        fprintf(stderr, KRED "!!! Error, setting up compression: %s\n", strerror(errno));
+        len = htonl(FRAME_ABORT);
+        writeToFD((char*)&len, sockfd, FRAME_HDR);
+        return 1;
+    }
+
+    do {
+        // A block may grow by its header, and not at all beyond that
+        while ((actual = read(fd, zp ? zp->raw : buf+FRAME_HDR, FRAME_MAX - (zp ? ZIP_HDR : 0))) < 0 
+                && errno == EINTR);
+        if (actual < 0) fprintf(stderr, KRED "!!! Error, reading from FD %d: %s\n", fd, strerror(errno));
+        if (actual > 0) *sent += actual;
+
+        size = actual > 0 ? actual : 0;
+        if (zp && actual >= 0) size = zipPack(zp, zp->raw, actual, buf+FRAME_HDR);
+        len = htonl(actual < 0 ? FRAME_ABORT : size);
+        memcpy(buf, &len, FRAME_HDR);
+        writeToFD(buf, sockfd, FRAME_HDR + (actual >= 0 ? size : 0));
+    } while (actual > 0);
+
+    // The frame that carried the compressed stream's end still needs its empty frame
+    if (zp && actual == 0) {
+        len = htonl(FRAME_END);
+        writeToFD((char*)&len, sockfd, FRAME_HDR);
+    }
+    zipClose(zp);
+    return actual < 0;
 }
 
 
@@ -614,52 +1627,163 @@ Puts server response into message.
 @return 0: success 1: failure
 */
 int serverSendAndReceiveMSG(char *message, int sockfd, int size) {
+    uint64_t began = traceNow();
+    char name[64];
+    int failed;
+
+    if (began) snprintf(name, sizeof(name), "%.*s", (int)strcspn(message, "\n"), message);
     if (debug) printf(KGRN "?? Sending %c command to server\n", message[0]);
-    if (writeToFD(message, sockfd, size)) {
+    if (serverSendCommands(message, sockfd, size)) {
         fprintf(stderr, KRED "!!! Error, writing to server: Unexpected EOF\n");
         exit(1);
     }
-    return serverReceiveMSG(message, sockfd);
+    failed = serverReceiveMSG(message, sockfd);
+    if (began) clientTrace("command", name, began, tracesent, -1);
+    return failed;
+}
+
+/*
+Send size bytes of command lines to the server, each encoded as a binary protocol
+message with the next request id if the binary protocol is in use.
+
+@return 0: success 1: failure
+*/
+int serverSendCommands(char *buf, int sockfd, int size) {
+    char out[PIPELINE_BYTES];
+    char *line;
+    char *nl;
+    int outlen;
+    int len;
+
+    // Both sides number the commands on a connection from 1 (see myftptrace.c)
+    for (line = buf; (nl = memchr(line, '\n', buf+size-line)); line = nl+1) tracesent++;
+
+    if (!binarymode) return writeToFD(buf, sockfd, size);
+
+    outlen = 0;
+    for (line = buf; line < buf+size; line = nl+1) {
+        if (!(nl = memchr(line, '\n', buf+size-line))) nl = buf+size;
+        len = nl - line;
+        if (len == 0) continue;
+
+        // Lines are at most BUF_SIZE long, so one always fits in an empty out
+        if (outlen + BIN_HDR + len > PIPELINE_BYTES) {
+            if (writeToFD(out, sockfd, outlen)) return 1;
+            outlen = 0;
+        }
+        outlen += binEncode(out+outlen, line[0], 0, ++binsent, line+1, len-1);
+    }
+    return outlen ? writeToFD(out, sockfd, outlen) : 0;
+}
+
+/*
+Ask the server for the binary protocol (B command) on the connection sockfd.
+Servers without it reject B, and the connection keeps using text lines.
+
+@return 0: success 1: failure
+*/
+int serverUseBinary(int sockfd) {
+    char message[BUF_SIZE];
+
+    binarymode = 0;
+    snprintf(message, BUF_SIZE, "B%d\n", BIN_VERSION);
+    if (serverSendAndReceiveMSG(message, sockfd, strlen(message))) return 1;
+    if (atoi(message+1) != BIN_VERSION) {
+        fprintf(stderr, KRED "!!! Error: Server offered unknown binary protocol '%s'\n", message+1);
+        return 1;
+    }
+    binarymode = 1;
+    binsent = 0;
+    binreplied = 0;
+    return 0;
+}
+
+/*
+The server turned down a Y, so stop asking; transfers already queued behind a Y
+just go uncompressed.
+*/
+void serverNoCompression() {
+    if (!compressmode) return;
+    fprintf(stderr, KRED "!!! Error: Server does not support compression, sending data uncompressed\n");
+    compressmode = 0;
+}
+
+/*
+The server turned down a K, so stop asking.
+*/
+void serverNoChecksums() {
+    if (!checkmode) return;
+    fprintf(stderr, KRED "!!! Error: Server does not support checksums, transfers go unchecked\n");
+    checkmode = 0;
+}
+
+/*
+The server turned down a K with reply: if it doesn't know the command, stop asking;
+otherwise only the transfer of path (NULL: none to speak of) goes unchecked.
+*/
+void serverChecksumFailed(char *reply, char *path) {
+    if (reply[0] == 'E' && !strcmp(reply+1, errorText(ERR_CMD))) {
+        serverNoChecksums();
+    } else if (path) {
+        fprintf(stderr, KRED "!!! Error: Could not check '%s' against the server\n", path);
+    }
+}
+
+/*
+The server turned down an H, so stop asking; files are put whole.
+*/
+void serverNoStore() {
+    if (!storemode) return;
+    fprintf(stderr, KRED "!!! Error: Server has no store, putting files whole\n");
+    storemode = 0;
+}
+
+/*
+Have the server start the next G or P at offset (T command),
+after the replies to everything queued so far.
+
+@return 0: success 1: failure
+*/
+int serverRestart(int sockfd, const char *addr, off_t offset) {
+    char message[BUF_SIZE];
+
+    pipelineFlush(sockfd, addr);
+    snprintf(message, BUF_SIZE, "T%lld\n", (long long)offset);
+    return serverSendAndReceiveMSG(message, sockfd, strlen(message));
 }
 
 /*
-Establish a data connection with the server.
+Establish a data connection with the server, whose D (command number req) was already
+sent (see pipelineQueue).
 
 @return Data socket file descriptor
 */
-int serverDataConnection(int sockfd, const char *addr) {
+int serverDataConnection(int sockfd, const char *addr, int req) {
+    uint64_t began = traceNow();
     char port[BUF_SIZE];
 
-    strcpy(port, "D\n");
-    if (serverSendAndReceiveMSG(port, sockfd, 2)) {
+    if (serverReceiveMSG(port, sockfd)) {
         fprintf(stderr, KRED "!!! Error: Unable to establish data connection\n");
         exit(1);
     }
+    clientTrace("command", "D", began, req, -1);
 
     if (debug) printf(KGRN "?? Connecting to server '%s' on port number '%s'\n", addr, port+1);
     return clientInit(port+1, addr);
 }
 
 /*
-Establish a data connection with the server.
-Then send size bytes of null-terminated message to server.
-message MUST be initialized with BUF_SIZE or more.
-Server response stored in message.
+Name this connection's session on the server (I command), so that the server's trace
+of it carries the same session id as ours.  Servers without tracing still accept it.
 
-@return Data socket FD (-1 for errors)
+@return 0: success 1: failure
 */
-int serverConnectAndSend(int sockfd, int size, const char *addr, char *message) {
-    int datasockfd;
-    int len;
-    datasockfd = serverDataConnection(sockfd, addr);
-    if (debug) printf(KGRN "?? Data connection secured on server '%s'\n", addr);
+int serverTrace(int sockfd) {
+    char message[BUF_SIZE];
 
-    // Send control message to ls -l on the server
-    if (serverSendAndReceiveMSG(message, sockfd, size)) {
-        close(datasockfd);
-        return -1;
-    }
-    return datasockfd;
+    traceThread(getpid(), "session %s", tracesession);
+    snprintf(message, BUF_SIZE, "I%s\n", tracesession);
+    return serverSendAndReceiveMSG(message, sockfd, strlen(message));
 }
 
 
@@ -678,6 +1802,7 @@ Create a new client connecting to server (addr) on port (stored in buf).
 */
 int clientInit(char *port, const char *addr) {
     struct addrinfo hints, *actualdata;
+    uint64_t began = traceNow();
     int sockfd;
     int err;
 
@@ -689,6 +1814,7 @@ int clientInit(char *port, const char *addr) {
         fprintf(stderr, KRED "!!! Error, translating host name '%s': %s\n", addr, gai_strerror(err));
         exit(1);
     }
+    clientTrace("phase", "getaddrinfo", began, 0, -1);
 
     // Create socket
     if ((sockfd = socket(actualdata->ai_family, actualdata->ai_socktype, 0)) < 0) {
@@ -699,45 +1825,107 @@ int clientInit(char *port, const char *addr) {
     if (debug) printf(KGRN "?? Created socket with descriptor %d\n", sockfd);
 
     // Connect to server
+    began = traceNow();
     if (connect(sockfd, actualdata->ai_addr, actualdata->ai_addrlen) < 0) {
         fprintf(stderr, KRED "!!! Error, connecting to server\n");
         exit(1);
     }
+    clientTrace("phase", "connect", began, 0, -1);
 
     freeaddrinfo(actualdata);
     return sockfd;
 }
 
+/*
+Trace the span name (of category cat, see myftptrace.c) from start until now, as part
+of command number req on the connection (0 if none), along with bytes (-1 if none).
+*/
+void clientTrace(const char *cat, const char *name, uint64_t start, int req, long long bytes) {
+    traceSpan(getpid(), cat, name, start, tracesession, req, bytes);
+}
+
 /****************************************************************************************
  * 
  *                                      MAIN
  * 
  ****************************************************************************************/
 
+#define USAGE "!!! Usage: ./myftp [-d] [-u] [-i] [-b] [-c] [-n] [-s] [-k connections [-z stripe]] [-t file]\n" \
+              "                 <hostname | IP address>\n"
+
 /*
-Checks for proper arguments.
-Debug flag "-d" must be first argument if debugging is desired.
+Parse a positive size option argument, which may end in k, m or g, or exit with usage.
 */
-void mainParseArgs(int argc, char const **argv) {
-    // Check for correct number of args
-    if (argc < 2 || argc > 3) {
-        fprintf(stderr, KRED "!!! Usage: ./myftps [-d] <hostname | IP address>\n");
+off_t mainParseSize(char opt, char *arg, off_t max) {
+    char *end;
+    long long n;
+
+    errno = 0;
+    n = strtoll(arg, &end, 10);
+    if (*end == 'k' || *end == 'K')         n <<= 10, end++;
+    else if (*end == 'm' || *end == 'M')    n <<= 20, end++;
+    else if (*end == 'g' || *end == 'G')    n <<= 30, end++;
+    if (errno || *end || n <= 0 || n > max) {
+        fprintf(stderr, KRED "!!! Error: Option -%c expects a positive size up to %lld, got '%s'\n", 
+                opt, (long long)max, arg);
+        fprintf(stderr, KRED USAGE);
         exit(1);
     }
+    return n;
+}
 
-    // Init debug
-    if (argc == 3) {
-        if (strcmp(argv[1], "-d")) {
-            fprintf(stderr, KRED "!!! Encountered unknown token '%s'\n", argv[1]);
-            fprintf(stderr, KRED "!!! Usage: ./myftps [-d] <hostname | IP address>\n");
+/*
+Checks for proper arguments.
+Debug flag "-d", io_uring flag "-u", inline data flag "-i", binary protocol flag "-b",
+compression flag "-c", no-checksum flag "-n" and store flag "-s" must come before the host.
+"-k" stripes large gets over that many connections, in stripes of "-z" bytes.
+"-t" traces the phases of every command into the given file (see myftptrace.c).
+*/
+void mainParseArgs(int argc, char * const *argv) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+duibcnsk:z:t:")) != -1) {
+        if (opt == 'd') {
+            debug = 1;
+        } else if (opt == 'u') {
+            xferuring = 1;
+        } else if (opt == 'i') {
+            inlinemode = 1;
+        } else if (opt == 'b') {
+            binarymode = 1;
+        } else if (opt == 'c') {
+            compressmode = 1;
+        } else if (opt == 'n') {
+            checkmode = 0;
+        } else if (opt == 's') {
+            storemode = 1;
+        } else if (opt == 'k') {
+            stripes = mainParseSize(opt, optarg, STRIPES_MAX);
+        } else if (opt == 'z') {
+            stripesize = mainParseSize(opt, optarg, 1LL << 40);
+        } else if (opt == 't') {
+            if (traceStart(optarg, "myftp")) {
+                fprintf(stderr, KRED "!!! Error, opening trace '%s': %s\n", optarg, strerror(errno));
+                exit(1);
+            }
+            snprintf(tracesession, TRACE_ID, "%lx-%d", (long)time(NULL), getpid());
+        } else {
+            fprintf(stderr, KRED USAGE);
             exit(1);
         }
-        printf(KGRN "?? Debug output enabled\n");
-        debug = 1;
     }
+
+    // Check for correct number of args
+    if (optind != argc-1) {
+        if (optind < argc-1) fprintf(stderr, KRED "!!! Encountered unknown token '%s'\n", argv[optind]);
+        fprintf(stderr, KRED USAGE);
+        exit(1);
+    }
+
+    if (debug) printf(KGRN "?? Debug output enabled\n");
 }
 
-int main(int argc, char const *argv[]){
+int main(int argc, char *argv[]){
     char port[BUF_SIZE];
     int sockfd;
 
@@ -754,6 +1942,38 @@ int main(int argc, char const *argv[]){
     sockfd = clientInit(port, argv[argc-1]);
     printf(KNRM "* Connected to server '%s' on port %d\n", argv[argc-1], SERV_PORT);
 
+    // more quitting early shows up as a write error instead
+    signal(SIGPIPE, SIG_IGN);
+
+    // Servers without the binary protocol reject B, leaving text lines in use
+    if (binarymode) {
+        if (serverUseBinary(sockfd)) {
+            fprintf(stderr, KRED "!!! Error: Server does not support the binary protocol, using text\n");
+        } else {
+            printf(KNRM "* Speaking binary protocol version %d\n", BIN_VERSION);
+        }
+    }
+
+    // Servers without inline data reject F, leaving data connections in use
+    if (inlinemode) {
+        strcpy(port, "F\n");
+        if (serverSendAndReceiveMSG(port, sockfd, 2)) {
+            fprintf(stderr, KRED "!!! Error: Server does not support inline data, using data connections\n");
+            inlinemode = 0;
+        } else {
+            printf(KNRM "* Sending data inline on the control connection\n");
+        }
+    }
+
+    // Servers without tracing reject I, so only our side of the session is traced
+    if (tracefd >= 0) {
+        if (serverTrace(sockfd)) {
+            fprintf(stderr, KRED "!!! Error: Server does not support tracing, tracing the client only\n");
+        } else {
+            printf(KNRM "* Tracing session '%s'\n", tracesession);
+        }
+    }
+
     // Start communications
     userInput(sockfd, argv[argc-1]); // Does not return
 
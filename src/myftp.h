@@ -8,6 +8,8 @@ CS 360
 #ifndef MYFTP
 #define MYFTP
 
+#define _GNU_SOURCE // splice, pipe sizes, accept4
+
 // Standard Libraries
 #include <unistd.h>
 #include <stdlib.h>
@@ -24,9 +26,29 @@ CS 360
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <sys/sysmacros.h>
+#include <endian.h>
+#include <sys/inotify.h>
+#include <signal.h>
+#include <sched.h>
+#include <stddef.h>
+#include <pwd.h>
+#include <grp.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <linux/futex.h>
 
 // Networking
 #include <netinet/in.h>
+#include <linux/tcp.h> // struct tcp_info with delivery rate
 #include <arpa/inet.h>
 #include <netdb.h>
 
@@ -36,6 +58,17 @@ CS 360
 
 #define BUF_SIZE    PATH_MAX+6
 #define SERV_PORT   4987
+#define SPLICE_PIPE_SIZE    (1 << 20) // Requested pipe capacity for splice transfers
+#define URING_SLOTS         8 // Chunks an io_uring transfer keeps in flight
+#define URING_CHUNK         (128 << 10) // Bytes per io_uring chunk
+
+// Inline data (F command): transfers travel on the control connection as frames,
+// each a 32-bit big-endian payload length followed by the payload
+
+#define FRAME_HDR   4
+#define FRAME_MAX   (64 << 10)  // Largest payload a frame may carry
+#define FRAME_END   0           // Length that ends a transfer
+#define FRAME_ABORT 0xffffffffu // Length that abandons a transfer
 
 // Colors
 
@@ -43,11 +76,309 @@ CS 360
 #define KRED "\x1B[31m"
 #define KGRN "\x1B[32m"
 
-short debug = 0;
+extern short debug;
+
+// Logging (myftplog.c): messages at each level print as KRED "!!!", KNRM "*" or KGRN "??",
+// followed by who is talking.  After logStart, they go through a ring drained by a thread.
+
+#define LOG_ERROR   0
+#define LOG_INFO    1
+#define LOG_DEBUG   2
+
+#define logError(...)   logWrite(LOG_ERROR, __VA_ARGS__)
+#define logInfo(...)    logWrite(LOG_INFO, __VA_ARGS__)
+#define logDebug(...)   do { if (debug) logWrite(LOG_DEBUG, __VA_ARGS__); } while (0)
+
+extern short logquiet;
+extern char logrole[32];
+
+void logRole(const char *role, int withpid);
+int logStart(char *path);
+void logWrite(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Tracing (myftptrace.c, -t): spans of each command's phases, as Chrome trace-event JSON.
+// A client names its session with I<id>; spans then carry the id and the command's number.
+
+#define TRACE_ID    48              // Longest session id (with its null terminator)
+
+extern int tracefd;
+
+int traceStart(char *path, char *name);
+uint64_t traceNow(void);
+void traceThread(int tid, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void traceSpan(int tid, const char *cat, const char *name, uint64_t start,
+                const char *session, int req, long long bytes);
+
+// Implemented separately by myftp.c and myftpserve.c
 
-void mypipeCONNECT_AND_EXECVP(int *fd, char **args, int child);
 void waitForChildren(int pid, int options);
+
+// Implemented by myftp.c
+
+void mypipeCONNECT_AND_EXECVP(int *fd, char **args, int child);
 int transferContents(int fd1, int fd2);
 int writeToFD(char *message, int sockfd, int size);
 
+// Implemented by myftpserve.c
+
+int serverHelper(const char *role);
+
+// Transfer engines (myftpio.c)
+
+#define XFER_DONE   0   // xferRun results
+#define XFER_FAIL   1
+#define XFER_AGAIN  2
+
+#define XFER_COPY       0   // read/write through a user buffer
+#define XFER_SENDFILE   1   // file -> socket with sendfile
+#define XFER_SPLICE     2   // socket -> pipe -> file with splice
+#define XFER_URING      3   // either direction with io_uring (see myftpio.c: xferuring)
+#define XFER_DEFLATE    4   // anything -> socket as compressed blocks (Y command)
+#define XFER_INFLATE    5   // compressed blocks from a socket -> anything
+#define XFER_MEMORY     6   // memory (mem) -> anything with write
+
+struct uring;
+struct zipper;
+
+struct xfer {
+    int mode;
+    int in;
+    int out;
+    int waitfd;             // FD to wait on for XFER_AGAIN instead of in/out (-1 if none)
+    int waitevents;         // What to wait for on waitfd
+    struct uring *ring;
+    struct zipper *zip;     // Compression stage (XFER_DEFLATE and XFER_INFLATE)
+    char *data;             // Last block XFER_INFLATE unpacked
+    const char *mem;        // Source of XFER_MEMORY (in is unused)
+    off_t offset;           // Next read offset in in (sendfile and memory only)
+    off_t remaining;        // Bytes left to read from in (-1: until EOF)
+    off_t moved;            // Bytes written to out so far (before compression for XFER_DEFLATE)
+    int summed;             // 1: the bytes pass through user space, and crc covers those moved
+    uint32_t crc;           // CRC32C of them (see myftpcrc.c)
+    int pipefd[2];          // Splice pipe
+    off_t inpipe;           // Bytes sitting in the splice pipe
+    int head;               // Unwritten part of buf (or data, or zip->block) is [head, tail)
+    int tail;
+    int chunk;              // Bytes moved per sendfile or splice call (the splice pipe's size)
+    int sock;               // Socket end, autotuned once the transfer is under way (-1: none)
+    int tuned;
+    struct timespec started;
+    char buf[BUF_SIZE];
+};
+
+extern short xferuring;
+
+void xferInit(struct xfer *x, int mode, int in, int out, off_t offset, off_t count);
+int xferRun(struct xfer *x);
+void xferClose(struct xfer *x);
+void xferTune(struct xfer *x);
+int xferTake(struct xfer *x, char *dst, int n);
+int spliceContents(int sockfd, int fd, off_t *received);
+int sendFileContents(int fd, int sockfd, off_t *sent);
+int zipContents(int in, int out, int deflating, off_t *moved);
+
+// Control line framer (myftpline.c): lines and inline frames share one ring
+
+#define LINE_RING   8192    // Control bytes buffered per connection (a power of two above BUF_SIZE)
+#define LINE_NONE   -1      // lineNext: no complete line yet
+#define LINE_LONG   -2      // lineNext: a line too long for the caller was dropped
+
+struct linebuf {
+    unsigned head;          // Next unread byte (free-running, wrapped by LINE_RING)
+    unsigned tail;          // Next byte to fill
+    unsigned scanned;       // Bytes after head already known to hold no newline
+    int skipping;           // Dropping the rest of a line that was too long
+    char ring[LINE_RING];
+};
+
+void lineInit(struct linebuf *lb);
+int lineUsed(struct linebuf *lb);
+int lineRoom(struct linebuf *lb);
+int lineFill(struct linebuf *lb, int fd);
+int lineNext(struct linebuf *lb, char *dst, int size);
+int linePeek(struct linebuf *lb, char **data);
+void lineDrop(struct linebuf *lb, int n);
+int lineTake(struct linebuf *lb, char *dst, int size);
+
+// Binary control protocol (B command, myftpline.c): once negotiated, every command
+// and reply is a fixed header followed by len bytes of payload.  Command payloads
+// are the same arguments the text commands carry.  A reply's payload is empty,
+// or an 8-byte value (D's port, Z's size) for A, or a 4-byte error code for E.
+// An A flagged BIN_TEXT carries text instead (H's answer).
+
+#define BIN_VERSION 1           // Highest protocol version spoken
+#define BIN_HDR     8
+#define BIN_TEXT    1           // The payload is text
+
+struct binhdr {
+    uint8_t op;                 // Command letter, or A / E for replies
+    uint8_t flags;              // BIN_ flags; receivers ignore ones they don't know
+    uint16_t id;                // Request id, echoed by its reply (big-endian)
+    uint32_t len;               // Payload bytes (big-endian)
+};
+
+#define ERR_NDIR    1001        // Error codes below 1000 are errno values
+#define ERR_NREG    1002
+#define ERR_DATA    1003
+#define ERR_BASE    1004
+#define ERR_RNGE    1005
+#define ERR_LONG    1006
+#define ERR_CMD     1007
+
+int binEncode(char *dst, char op, uint8_t flags, uint16_t id, char *payload, int len);
+int binNext(struct linebuf *lb, struct binhdr *h, char *payload, int size);
+char *errorText(int code);
+
+// Transfer compression (Y command, myftpzip.c): the next L, G, R, P, V or U after an accepted Y
+// moves its data as blocks, each a header (two 32-bit big-endian lengths: the block's
+// data, then its payload) followed by the payload.  A payload as long as the data is
+// the data itself; a shorter one is the data deflated (raw zlib).  A block without
+// data ends the stream.
+
+#define ZIP_CHUNK   (64 << 10)  // Most data one block holds
+#define ZIP_HDR     8
+#define ZIP_NONE    0           // zipGot: the block needs more bytes
+#define ZIP_END     -1          // zipGot: the stream ended
+#define ZIP_BAD     -2          // zipGot: the block can't be unpacked
+
+struct zipper {
+    void *stream;           // zlib's state (myftpzip.c)
+    int deflating;
+    int poor;               // Blocks in a row that didn't shrink
+    int skip;               // Blocks left to store without trying to deflate them
+    int ended;              // The end of the stream was packed or unpacked
+    int have;               // Bytes of the block being unpacked so far
+    uint32_t rawlen;        // Header of the block being unpacked
+    uint32_t packed;
+    off_t rawbytes;         // Totals for debug output
+    off_t wirebytes;
+    off_t blocks;
+    off_t stored;
+    char raw[ZIP_CHUNK];
+    char block[ZIP_HDR + ZIP_CHUNK];
+};
+
+struct zipper *zipOpen(int deflating);
+void zipClose(struct zipper *zp);
+int zipPack(struct zipper *zp, char *raw, int n, char *dst);
+int zipNeed(struct zipper *zp, char **dst);
+int zipGot(struct zipper *zp, int n, char **data);
+
+// Checksums (K command, myftpcrc.c): CRC32C of what the last G, R or P moved (or U or M rebuilt),
+// taken on the way where the transfer passes through user space
+
+uint32_t crcUpdate(uint32_t crc, const char *buf, size_t n);
+int crcFile(int fd, off_t offset, off_t length, uint32_t *crc);
+
+// Delta puts (V and U commands, myftpdelta.c): V sends the signatures of the server's copy
+// of a file, and U replaces it with the copy rebuilt from a delta against those signatures
+
+#define DELTA_STRONG    16      // Bytes of each block's SHA-256 kept in its signature
+
+// Content-defined chunks (see myftpdelta.c) name data in the server's deduplicating store
+// (H and M commands, myftpstore.c): H asks which of a list of chunks the store holds,
+// and M puts a file as a delta of literals and references to those chunks
+
+#define CHUNK_MIN   (32 << 10)      // Chunk size bounds, and the size chunks bunch around
+#define CHUNK_AVG   (128 << 10)
+#define CHUNK_MAX   (512 << 10)
+#define CHUNK_HARD  0xffffc00000000000ULL   // Cut masks before and after CHUNK_AVG (18 and 16 bits)
+#define CHUNK_EASY  0xffff000000000000ULL
+#define CHUNK_HASH  32              // SHA-256
+#define CHUNK_QUERY 62              // Hashes per H command (64 hex digits and a space each)
+
+struct signature;
+
+struct chunk {
+    off_t offset;
+    uint32_t length;
+    int stored;                     // 1: the server's store has it
+    unsigned char hash[CHUNK_HASH];
+};
+
+int deltaTemp(int dirfd, const char *path);
+int deltaSignatures(int fd, int out);
+struct signature *deltaLoad(int fd);
+void deltaFree(struct signature *sig);
+int deltaGenerate(int fd, struct signature *sig, int out, off_t *literal);
+int deltaApply(int basis, int delta, int out, off_t *size);
+int deltaCopy(int in, off_t offset, int out, off_t length);
+int deltaChunk(const unsigned char *p, off_t n);
+struct chunk *deltaChunkFile(int fd, int *count);
+int deltaGenerateChunks(int fd, struct chunk *chunks, int count, int out, off_t *literal);
+void deltaHex(const unsigned char *hash, char *dst);
+
+// io_uring backend (myftpuring.c)
+
+int uringInit(struct xfer *x);
+int uringRun(struct xfer *x);
+void uringClose(struct xfer *x);
+
+// Directory lister (myftplist.c, myftpserve only)
+
+struct lister;
+
+struct lister *listOpen(int dirfd);
+int listRead(struct lister *l, char *buf, int size);
+void listClose(struct lister *l);
+
+// Path metadata cache (myftpmeta.c, myftpserve only)
+
+extern unsigned long metahits;
+extern unsigned long metamisses;
+
+int metaInit(void);
+void metaDrain(void);
+int metaCheck(int dirfd, dev_t dirdev, ino_t dirino, char *path, int type, mode_t *mode);
+
+// Deduplicating store (myftpstore.c, myftpserve only)
+
+extern int storefd;
+
+int storeInit(char *path);
+int storeParse(char *hex, unsigned char *hash);
+int storeHas(const unsigned char *hash);
+int storeApply(int delta, int out, off_t *size);
+int storeSave(int dirfd, char *name, int fd);
+int storeSaveLater(int dirfd, char *name, int fd);
+int storeUnshare(int dirfd, char *name, int fd, off_t offset);
+
+// Hot file cache (myftpcache.c, myftpserve only), shared by every process forked after cacheInit
+
+#define CACHE_ADMIT (64 << 10)      // Default largest file cached
+
+struct cachestats {
+    unsigned long hits;             // Gets sent from the cache
+    unsigned long misses;
+    unsigned long admits;           // Files copied in
+    unsigned long evictions;
+};
+
+extern off_t cachesize;
+
+int cacheInit(off_t capacity, off_t admit);
+int cacheGet(struct stat *finfo, const char **data);
+int cacheAdmit(int fd, struct stat *finfo, const char **data);
+void cacheRelease(int i);
+int cacheStats(struct cachestats *stats);
+
+// Server statistics (S command, myftpstats.c, myftpserve only), shared by every process
+// forked after statsInit.  Each command's latency is split into these phases:
+
+#define STATS_CHECK     0           // Permission and file type checks
+#define STATS_ACCEPT    1           // Waiting for the data connection
+#define STATS_TRANSFER  2           // Moving the data
+#define STATS_TOTAL     3           // From the command's arrival until it is done
+#define STATS_PHASES    4
+#define STATS_DUMP      5           // Seconds between rewrites of the -p report
+
+int statsInit(int slots);
+void statsSlot(int i);
+uint64_t statsNow(void);
+void statsSession(int delta);
+void statsBytes(off_t in, off_t out);
+void statsCommand(char op, int failed, uint64_t *ns, int phases);
+int statsReport(int fd, int prometheus);
+int statsDump(char *path);
+
 #endif
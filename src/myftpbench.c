@@ -0,0 +1,618 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+Compiling:
+    gcc -o myftpbench myftpbench.c myftp.h
+
+Running (from the directory holding myftp and myftpserve, usually through "make bench"):
+    ./myftpbench [-s sizes] [-e entries] [-r runs] [-S server args] [-C client args]
+                 [-d dir] [-l label] [-o file]
+
+Loopback benchmark driver for myftp and myftpserve.
+
+Starts ./myftpserve in a scratch directory and measures, on 127.0.0.1:
+- get and put throughput for each file size (-s), by running the real client
+  (./myftp) on a batch of copies of the file, -r times.  CPU is counted on both
+  sides per GB moved: the client's from wait4, the server's from /proc, so the
+  server should run as one process (-e, the default).
+- rls latency on directories of several sizes (-e), and the round-trip time of
+  rcd, timed one command at a time over a control connection of its own.
+Results are written as JSON, so runs can be compared across commits.
+*/
+
+#include "myftp.h"
+#include <sys/resource.h>
+#include <ftw.h>
+
+short debug = 0;
+
+#define BENCH_SIZES     "1k,64k,1m,64m,1g"
+#define BENCH_ENTRIES   "10,1000,10000"
+#define BENCH_RUNS      5
+#define BENCH_BATCH     (256 << 20)     // Bytes a batch of small files adds up to...
+#define BENCH_FILES     100             // ...in at most this many files
+#define BENCH_RCD       1000            // rcd round trips timed
+#define BENCH_RLS       50              // rls commands timed per directory
+#define BENCH_LIST      16              // Most sizes or directories measured
+#define BENCH_WAIT      5               // Seconds to wait for the server to listen
+
+char client[PATH_MAX];          // ./myftp and ./myftpserve, found before changing directory
+char server[PATH_MAX];
+char scratch[PATH_MAX];         // Scratch directory, with srv and cli under it
+char srvdir[PATH_MAX+8];
+char clidir[PATH_MAX+8];
+pid_t serverpid = -1;
+char *serverargs = "-e";
+char *clientargs = "";
+
+/****************************************************************************************
+ * 
+ *                                      PROTOTYPES
+ * 
+ ****************************************************************************************/
+
+// Useful
+
+int benchRemove(const char *path, const struct stat *sb, int flag, struct FTW *ftw);
+void benchCleanup(void);
+void benchDie(const char *what);
+double benchNow(void);
+int benchCompare(const void *a, const void *b);
+int benchSplit(char *args, char **argv, int max);
+int benchParseList(char *arg, long long *list, int sized);
+void benchFill(char *path, long long size);
+
+// Processes
+
+void benchStartServer(void);
+double benchServerCPU(void);
+double benchClient(char *dir, char *script, double *cpu);
+
+// Measurements
+
+void benchTransfer(FILE *out, char op, long long size, int runs);
+int benchConnect(int port);
+void benchCommand(int fd, char *cmd, char *reply);
+void benchRCD(FILE *out);
+void benchRLS(FILE *out, long long entries, int last);
+
+/****************************************************************************************
+ * 
+ *                                      USEFUL
+ * 
+ ****************************************************************************************/
+
+/*
+Remove one entry of the scratch directory (nftw callback, deepest first).
+*/
+int benchRemove(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+    (void)sb;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+/*
+Stop the server and remove the scratch directory (at exit).
+*/
+void benchCleanup(void) {
+    if (serverpid > 0) {
+        kill(serverpid, SIGTERM);
+        waitpid(serverpid, NULL, 0);
+        serverpid = -1;
+    }
+    if (scratch[0]) nftw(scratch, benchRemove, 16, FTW_DEPTH | FTW_PHYS);
+    scratch[0] = 0;
+}
+
+/*
+Report a failed step and exit (cleaning up on the way).
+*/
+void benchDie(const char *what) {
+    fprintf(stderr, KRED "!!! Error, %s: %s\n", what, errno ? strerror(errno) : "failed");
+    exit(1);
+}
+
+/*
+@return seconds on the monotonic clock
+*/
+double benchNow(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int benchCompare(const void *a, const void *b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+Split args at spaces into argv (at most max-1 words, null-terminated).
+
+@return the number of words
+*/
+int benchSplit(char *args, char **argv, int max) {
+    char *save;
+    char *tok;
+    int n = 0;
+
+    for (tok = strtok_r(args, " ", &save); tok && n < max-1; tok = strtok_r(NULL, " ", &save)) argv[n++] = tok;
+    argv[n] = NULL;
+    return n;
+}
+
+/*
+Read a comma-separated list of positive numbers into list (at most BENCH_LIST);
+with sized, each may end in k, m or g.
+
+@return how many (0: invalid)
+*/
+int benchParseList(char *arg, long long *list, int sized) {
+    char *end;
+    int n = 0;
+
+    while (*arg && n < BENCH_LIST) {
+        errno = 0;
+        list[n] = strtoll(arg, &end, 10);
+        if (sized && (*end == 'k' || *end == 'K'))         list[n] <<= 10, end++;
+        else if (sized && (*end == 'm' || *end == 'M'))    list[n] <<= 20, end++;
+        else if (sized && (*end == 'g' || *end == 'G'))    list[n] <<= 30, end++;
+        if (errno || end == arg || list[n] <= 0 || (*end && *end != ',')) return 0;
+        n++;
+        arg = *end ? end+1 : end;
+    }
+    return *arg ? 0 : n;
+}
+
+/*
+Create the file at path with size bytes that don't compress (xorshift output).
+*/
+void benchFill(char *path, long long size) {
+    static uint64_t buf[1 << 17];
+    static uint64_t state = 0x9e3779b97f4a7c15ULL;
+    long long done;
+    size_t want;
+    size_t i;
+    int fd;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU | S_IRGRP | S_IROTH)) < 0) benchDie("creating test file");
+    for (done = 0; done < size; done += want) {
+        want = size - done < (long long)sizeof(buf) ? (size_t)(size - done) : sizeof(buf);
+        for (i = 0; i < (want + 7) / 8; i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            buf[i] = state;
+        }
+        if (writeToFD((char*)buf, fd, want)) benchDie("writing test file");
+    }
+    close(fd);
+}
+
+/*
+Write size bytes of buf to fd.
+
+@return 0: success 1: failure
+*/
+int writeToFD(char *buf, int fd, int size) {
+    int actual;
+
+    while (size > 0) {
+        if ((actual = write(fd, buf, size)) < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        buf += actual;
+        size -= actual;
+    }
+    return 0;
+}
+
+/****************************************************************************************
+ * 
+ *                                      PROCESSES
+ * 
+ ****************************************************************************************/
+
+/*
+Start ./myftpserve in srvdir, with its output discarded, and wait until it listens.
+*/
+void benchStartServer(void) {
+    char *argv[32];
+    double deadline;
+    int devnull;
+    int fd;
+
+    // Another server on the port would be measured instead
+    if ((fd = benchConnect(SERV_PORT)) >= 0) {
+        fprintf(stderr, KRED "!!! Error: Something is already listening on port %d\n", SERV_PORT);
+        exit(1);
+    }
+
+    argv[0] = server;
+    benchSplit(strdup(serverargs), argv+1, 31);
+    if ((serverpid = fork()) < 0) benchDie("forking server");
+    if (serverpid == 0) {
+        devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        if (chdir(srvdir) < 0) exit(1);
+        execv(server, argv);
+        exit(1);
+    }
+
+    for (deadline = benchNow() + BENCH_WAIT; (fd = benchConnect(SERV_PORT)) < 0; usleep(10000)) {
+        if (benchNow() > deadline || waitpid(serverpid, NULL, WNOHANG) == serverpid) {
+            serverpid = -1;
+            errno = 0;
+            benchDie("starting myftpserve");
+        }
+    }
+    close(fd);
+}
+
+/*
+@return CPU seconds the server (and any children it has reaped) has used so far
+*/
+double benchServerCPU(void) {
+    unsigned long long utime, stime, cutime, cstime;
+    char path[64];
+    char buf[1024];
+    char *p;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", serverpid);
+    if (!(f = fopen(path, "r"))) return 0;
+    p = fgets(buf, sizeof(buf), f);
+    fclose(f);
+
+    // Fields 14 to 17, counting from the one after the command name
+    if (!p || !(p = strrchr(buf, ')'))
+            || sscanf(p+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu",
+                        &utime, &stime, &cutime, &cstime) != 4) {
+        return 0;
+    }
+    return (double)(utime + stime + cutime + cstime) / sysconf(_SC_CLK_TCK);
+}
+
+/*
+Run ./myftp in dir on the commands in script, with its output discarded.
+cpu is set to the CPU seconds it used.
+
+@return wall clock seconds it took
+*/
+double benchClient(char *dir, char *script, double *cpu) {
+    struct rusage usage;
+    char *argv[32];
+    double start;
+    int devnull;
+    int status;
+    int fd[2];
+    int n;
+    pid_t pid;
+
+    argv[0] = client;
+    n = benchSplit(strdup(clientargs), argv+1, 30);
+    argv[n+1] = "127.0.0.1";
+    argv[n+2] = NULL;
+
+    if (pipe(fd) < 0) benchDie("creating pipe");
+    start = benchNow();
+    if ((pid = fork()) < 0) benchDie("forking client");
+    if (pid == 0) {
+        devnull = open("/dev/null", O_WRONLY);
+        dup2(fd[0], STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(fd[0]);
+        close(fd[1]);
+        if (chdir(dir) < 0) exit(1);
+        execv(client, argv);
+        exit(1);
+    }
+    close(fd[0]);
+    if (writeToFD(script, fd[1], strlen(script))) benchDie("writing client commands");
+    close(fd[1]);
+
+    if (wait4(pid, &status, 0, &usage) < 0) benchDie("waiting for client");
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        errno = 0;
+        benchDie("running myftp");
+    }
+    *cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    return benchNow() - start;
+}
+
+/****************************************************************************************
+ * 
+ *                                      MEASUREMENTS
+ * 
+ ****************************************************************************************/
+
+/*
+Time op ('g': get, 'p': put) on a batch of files of size bytes, runs times over,
+and write its JSON object to out.  A batch is hard links to one file, enough of
+them to add up to BENCH_BATCH (at most BENCH_FILES), all sent in one client session.
+*/
+void benchTransfer(FILE *out, char op, long long size, int runs) {
+    char src[PATH_MAX+64];
+    char dst[PATH_MAX+64];
+    char *script;
+    char *from = op == 'g' ? srvdir : clidir;
+    char *to = op == 'g' ? clidir : srvdir;
+    double seconds[runs];
+    double clientcpu;
+    double servercpu;
+    double cpu;
+    double before;
+    double gb;
+    struct stat finfo;
+    int files;
+    int run;
+    int len;
+    int i;
+
+    files = BENCH_BATCH / size;
+    if (files < 1) files = 1;
+    if (files > BENCH_FILES) files = BENCH_FILES;
+    fprintf(stderr, KNRM "* Benchmarking %s of %lld bytes (%d file(s) per run)\n",
+            op == 'g' ? "get" : "put", size, files);
+
+    snprintf(src, sizeof(src), "%s/bench", from);
+    benchFill(src, size);
+    if (!(script = malloc((size_t)files * 32 + 8))) benchDie("allocating commands");
+    for (len = 0, i = 0; i < files; i++) {
+        snprintf(dst, sizeof(dst), "%s/bench.%d", from, i);
+        if (link(src, dst) < 0) benchDie("linking test file");
+        len += sprintf(script+len, "%s bench.%d\n", op == 'g' ? "get" : "put", i);
+    }
+    strcpy(script+len, "exit\n");
+
+    clientcpu = servercpu = 0;
+    for (run = 0; run < runs; run++) {
+        before = benchServerCPU();
+        seconds[run] = benchClient(clidir, script, &cpu);
+        clientcpu += cpu;
+        servercpu += benchServerCPU() - before;
+
+        for (i = 0; i < files; i++) {
+            snprintf(dst, sizeof(dst), "%s/bench.%d", to, i);
+            if (stat(dst, &finfo) < 0 || finfo.st_size != size) {
+                errno = 0;
+                benchDie("checking transferred file");
+            }
+            unlink(dst);
+        }
+    }
+
+    for (i = 0; i < files; i++) {
+        snprintf(dst, sizeof(dst), "%s/bench.%d", from, i);
+        unlink(dst);
+    }
+    unlink(src);
+    free(script);
+
+    qsort(seconds, runs, sizeof(double), benchCompare);
+    gb = (double)size * files / 1e9;
+    fprintf(out, "    {\"op\": \"%s\", \"size\": %lld, \"files\": %d, \"runs\": %d, "
+                 "\"median_s\": %.6f, \"min_s\": %.6f, \"mb_per_s\": %.2f, "
+                 "\"client_cpu_s_per_gb\": %.3f, \"server_cpu_s_per_gb\": %.3f}",
+            op == 'g' ? "get" : "put", size, files, runs, seconds[runs/2], seconds[0],
+            gb * 1e3 / seconds[runs/2], clientcpu / runs / gb, servercpu / runs / gb);
+}
+
+/*
+@return a socket connected to port on loopback (-1 on failure)
+*/
+int benchConnect(int port) {
+    struct sockaddr_in addr;
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+Read one reply line from the control connection fd into reply (BUF_SIZE bytes),
+after sending cmd (if not NULL).  Replies are read a byte at a time, so nothing
+past the line is consumed.  An E reply, or a closed connection, ends the run.
+*/
+void benchCommand(int fd, char *cmd, char *reply) {
+    int len;
+
+    if (cmd && writeToFD(cmd, fd, strlen(cmd))) benchDie("sending command");
+    for (len = 0; len < BUF_SIZE-1; len++) {
+        if (read(fd, reply+len, 1) != 1) benchDie("reading reply");
+        if (reply[len] == '\n') break;
+    }
+    reply[len] = 0;
+    if (reply[0] != 'A') {
+        fprintf(stderr, KRED "!!! Error: Server answered '%s'\n", reply);
+        exit(1);
+    }
+}
+
+/*
+Time rcd round trips (into a directory and back out, alternately) and write
+their JSON object to out.
+*/
+void benchRCD(FILE *out) {
+    char reply[BUF_SIZE];
+    char path[PATH_MAX+16];
+    double samples[BENCH_RCD];
+    double start;
+    int fd;
+    int i;
+
+    fprintf(stderr, KNRM "* Benchmarking rcd round trips\n");
+    snprintf(path, sizeof(path), "%s/rcd", srvdir);
+    if (mkdir(path, S_IRWXU) < 0) benchDie("creating directory");
+    if ((fd = benchConnect(SERV_PORT)) < 0) benchDie("connecting to server");
+
+    for (i = 0; i < BENCH_RCD; i++) {
+        start = benchNow();
+        benchCommand(fd, i % 2 ? "C..\n" : "Crcd\n", reply);
+        samples[i] = benchNow() - start;
+    }
+    benchCommand(fd, "Q\n", reply);
+    close(fd);
+
+    qsort(samples, BENCH_RCD, sizeof(double), benchCompare);
+    fprintf(out, "  \"rcd\": {\"samples\": %d, \"median_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f},\n",
+            BENCH_RCD, samples[BENCH_RCD/2] * 1e6, samples[BENCH_RCD*99/100] * 1e6, samples[BENCH_RCD-1] * 1e6);
+}
+
+/*
+Time rls of a directory holding entries files (D and L in one write, as a client's
+batch with nothing else queued has them, then the listing read to the end of the
+data connection), and write its JSON object to out (followed by a comma unless last).
+*/
+void benchRLS(FILE *out, long long entries, int last) {
+    char reply[BUF_SIZE];
+    char path[PATH_MAX+64];
+    char buf[1 << 16];
+    double samples[BENCH_RLS];
+    double start;
+    long long bytes;
+    ssize_t actual;
+    int datafd;
+    int fd;
+    int i;
+
+    fprintf(stderr, KNRM "* Benchmarking rls of %lld entries\n", entries);
+    snprintf(path, sizeof(path), "%s/ls%lld", srvdir, entries);
+    if (mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) < 0) benchDie("creating directory");
+    for (i = 0; i < entries; i++) {
+        snprintf(path, sizeof(path), "%s/ls%lld/entry%d", srvdir, entries, i);
+        if ((fd = open(path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR)) < 0) benchDie("creating entry");
+        close(fd);
+    }
+
+    if ((fd = benchConnect(SERV_PORT)) < 0) benchDie("connecting to server");
+    snprintf(path, sizeof(path), "Cls%lld\n", entries);
+    benchCommand(fd, path, reply);
+
+    bytes = 0;
+    for (i = 0; i < BENCH_RLS; i++) {
+        start = benchNow();
+        if (writeToFD("D\nL\n", fd, 4)) benchDie("sending command");
+        benchCommand(fd, NULL, reply);
+        if ((datafd = benchConnect(atoi(reply+1))) < 0) benchDie("opening data connection");
+        benchCommand(fd, NULL, reply);
+        for (bytes = 0; (actual = read(datafd, buf, sizeof(buf))) > 0; bytes += actual);
+        if (actual < 0) benchDie("reading listing");
+        close(datafd);
+        samples[i] = benchNow() - start;
+    }
+    benchCommand(fd, "Q\n", reply);
+    close(fd);
+
+    qsort(samples, BENCH_RLS, sizeof(double), benchCompare);
+    fprintf(out, "    {\"entries\": %lld, \"bytes\": %lld, \"samples\": %d, \"median_us\": %.1f, "
+                 "\"p99_us\": %.1f, \"max_us\": %.1f}%s\n",
+            entries, bytes, BENCH_RLS, samples[BENCH_RLS/2] * 1e6, samples[BENCH_RLS*99/100] * 1e6,
+            samples[BENCH_RLS-1] * 1e6, last ? "" : ",");
+}
+
+/****************************************************************************************
+ * 
+ *                                      MAIN
+ * 
+ ****************************************************************************************/
+
+#define USAGE "!!! Usage: ./myftpbench [-s sizes] [-e entries] [-r runs] [-S server args] [-C client args]\n" \
+              "                        [-d dir] [-l label] [-o file]\n"
+
+int main(int argc, char *argv[]) {
+    long long sizes[BENCH_LIST];
+    long long entries[BENCH_LIST];
+    char *sizearg = BENCH_SIZES;
+    char *entryarg = BENCH_ENTRIES;
+    char *parent = P_tmpdir;
+    char *label = "";
+    char stamp[64];
+    time_t now;
+    FILE *out = stdout;
+    int nsizes;
+    int nentries;
+    int runs = BENCH_RUNS;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "s:e:r:S:C:d:l:o:")) != -1) {
+        if (opt == 's') {
+            sizearg = optarg;
+        } else if (opt == 'e') {
+            entryarg = optarg;
+        } else if (opt == 'r') {
+            runs = atoi(optarg);
+        } else if (opt == 'S') {
+            serverargs = optarg;
+        } else if (opt == 'C') {
+            clientargs = optarg;
+        } else if (opt == 'd') {
+            parent = optarg;
+        } else if (opt == 'l') {
+            label = optarg;
+        } else if (opt == 'o') {
+            if (!(out = fopen(optarg, "w"))) benchDie("opening output file");
+        } else {
+            fprintf(stderr, KRED USAGE);
+            exit(1);
+        }
+    }
+    if (optind < argc || runs < 1 || runs > 1000 || !(nsizes = benchParseList(sizearg, sizes, 1))
+            || !(nentries = benchParseList(entryarg, entries, 0))) {
+        fprintf(stderr, KRED USAGE);
+        exit(1);
+    }
+
+    if (!realpath("myftp", client) || !realpath("myftpserve", server)) benchDie("finding ./myftp and ./myftpserve");
+    snprintf(scratch, sizeof(scratch), "%s/myftpbench-XXXXXX", parent);
+    if (!mkdtemp(scratch)) {
+        scratch[0] = 0;
+        benchDie("creating scratch directory");
+    }
+    atexit(benchCleanup);
+    signal(SIGPIPE, SIG_IGN);
+    snprintf(srvdir, sizeof(srvdir), "%s/srv", scratch);
+    snprintf(clidir, sizeof(clidir), "%s/cli", scratch);
+    if (mkdir(srvdir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) < 0 || mkdir(clidir, S_IRWXU) < 0) {
+        benchDie("creating scratch directory");
+    }
+    benchStartServer();
+
+    now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(out, "{\n  \"label\": \"%s\",\n  \"time\": \"%s\",\n  \"server_args\": \"%s\",\n"
+                 "  \"client_args\": \"%s\",\n  \"transfers\": [\n", label, stamp, serverargs, clientargs);
+    for (i = 0; i < nsizes; i++) {
+        benchTransfer(out, 'g', sizes[i], runs);
+        fprintf(out, ",\n");
+        benchTransfer(out, 'p', sizes[i], runs);
+        fprintf(out, "%s\n", i == nsizes-1 ? "" : ",");
+    }
+    fprintf(out, "  ],\n");
+    benchRCD(out);
+    fprintf(out, "  \"rls\": [\n");
+    for (i = 0; i < nentries; i++) benchRLS(out, entries[i], i == nentries-1);
+    fprintf(out, "  ]\n}\n");
+
+    if (out != stdout) fclose(out);
+    return 0;
+}
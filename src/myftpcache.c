@@ -0,0 +1,464 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+Hot file cache shared by all of myftpserve's processes (-m).
+
+Most gets ask for the same few small files, and each one costs an open, an
+fstat and a trip through the page cache.  The contents of small files are
+kept instead in one shared anonymous mapping, made before the server forks,
+so children and workers all see the same cache.  An entry is keyed by the
+file's device, inode, mtime and size: a file that changes just stops
+matching, and its old entry ages out.
+
+The mapping holds a header (lock, LRU list ends and counters), a hash table
+of slot chains, the slots, and then each slot's data, cachesize bytes apiece
+(the largest file admitted).  Every slot is on the LRU list, free ones at the
+old end.  A miss admits the file if it fits, evicting the oldest slot no
+transfer is sending from; the slot is filled outside the lock and only
+becomes visible once it is whole.  A hit pins its slot until the transfer is
+done (cacheRelease), so the data can be written straight from the mapping.
+
+Processes can be killed at any point, so neither the lock nor a pin may
+outlive its owner.  The lock is a robust process-shared mutex: whoever takes
+it after its owner died rebuilds the hash chains and the LRU list from the
+slots.  A pin is the pinning process's pid, and pins whose process is gone
+are dropped when a slot is needed.
+*/
+
+#include "myftp.h"
+
+#define CACHE_FREE      0
+#define CACHE_FILLING   1
+#define CACHE_READY     2
+
+#define CACHE_PINS      8       // Transfers that can send from one slot at once
+
+struct cacheslot {
+    int state;
+    int next;                   // Next slot in its hash chain (-1: none)
+    int newer;                  // Its neighbours on the LRU list (-1: none)
+    int older;
+    pid_t pins[CACHE_PINS];     // Processes sending from it, one per transfer (0: unused)
+    dev_t dev;                  // The file it holds
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+};
+
+struct cachehdr {
+    pthread_mutex_t lock;
+    int slots;
+    int buckets;                // A power of two
+    int newest;                 // Ends of the LRU list
+    int oldest;
+    struct cachestats stats;
+};
+
+struct cachehdr *cache = NULL;  // The shared mapping (NULL: no cache)
+int *cachebucket;               // Its hash table, slots and data
+struct cacheslot *cacheslots;
+char *cachedata;
+off_t cachesize = 0;            // Largest file admitted (bytes per slot)
+
+/****************************************************************************************
+ * 
+ *                                      PROTOTYPES
+ * 
+ ****************************************************************************************/
+
+void cacheLock(void);
+void cacheUnlock(void);
+void cacheRebuild(void);
+unsigned cacheHash(struct stat *finfo);
+int cacheFind(struct stat *finfo);
+void cacheChain(int i);
+void cacheUnlink(int i);
+void cacheUnlist(int i);
+void cacheList(int i, int newest);
+int cacheAlive(pid_t pid);
+int cacheReap(int i);
+int cachePin(int i);
+int cacheVictim(void);
+
+/****************************************************************************************
+ * 
+ *                                      HELPERS
+ * 
+ ****************************************************************************************/
+
+void cacheLock(void) {
+    // Its owner died holding it, maybe halfway through changing the lists
+    if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+        logError("Error: A process died holding the cache lock, rebuilding the cache");
+        cacheRebuild();
+        pthread_mutex_consistent(&cache->lock);
+    }
+}
+
+void cacheUnlock(void) {
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+Relink the hash chains and the LRU list from the slots' states (with the lock held).
+The order of use is lost; free slots go back to the old end.
+*/
+void cacheRebuild(void) {
+    int i;
+
+    for (i = 0; i < cache->buckets; i++) cachebucket[i] = -1;
+    cache->newest = cache->oldest = -1;
+    for (i = 0; i < cache->slots; i++) {
+        if (cacheslots[i].state == CACHE_READY) cacheChain(i);
+        cacheList(i, cacheslots[i].state != CACHE_FREE);
+    }
+}
+
+/*
+@return the hash bucket of the file described by finfo
+*/
+unsigned cacheHash(struct stat *finfo) {
+    uint64_t h = (uint64_t)finfo->st_ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)finfo->st_dev;
+
+    return (h ^ (h >> 29)) & (cache->buckets - 1);
+}
+
+/*
+Find the ready slot holding the file described by finfo (with the lock held).
+
+@return its index (-1: not cached)
+*/
+int cacheFind(struct stat *finfo) {
+    struct cacheslot *c;
+    int i;
+
+    for (i = cachebucket[cacheHash(finfo)]; i >= 0; i = c->next) {
+        c = &cacheslots[i];
+        if (c->ino == finfo->st_ino && c->dev == finfo->st_dev && c->size == finfo->st_size
+                && c->mtime.tv_sec == finfo->st_mtim.tv_sec && c->mtime.tv_nsec == finfo->st_mtim.tv_nsec) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+Put slot i in its hash chain (with the lock held).
+*/
+void cacheChain(int i) {
+    struct stat key;
+
+    key.st_dev = cacheslots[i].dev;
+    key.st_ino = cacheslots[i].ino;
+    cacheslots[i].next = cachebucket[cacheHash(&key)];
+    cachebucket[cacheHash(&key)] = i;
+}
+
+/*
+Take slot i out of its hash chain (with the lock held).
+*/
+void cacheUnlink(int i) {
+    struct stat key;
+    int *p;
+
+    key.st_dev = cacheslots[i].dev;
+    key.st_ino = cacheslots[i].ino;
+    for (p = &cachebucket[cacheHash(&key)]; *p >= 0; p = &cacheslots[*p].next) {
+        if (*p == i) {
+            *p = cacheslots[i].next;
+            return;
+        }
+    }
+}
+
+/*
+Take slot i off the LRU list (with the lock held).
+*/
+void cacheUnlist(int i) {
+    struct cacheslot *c = &cacheslots[i];
+
+    if (c->newer >= 0)  cacheslots[c->newer].older = c->older;
+    else                cache->newest = c->older;
+    if (c->older >= 0)  cacheslots[c->older].newer = c->newer;
+    else                cache->oldest = c->newer;
+}
+
+/*
+Put slot i (off the list) at the new end of the LRU list, or at the old end if not newest
+(with the lock held).
+*/
+void cacheList(int i, int newest) {
+    struct cacheslot *c = &cacheslots[i];
+
+    if (newest) {
+        c->newer = -1;
+        c->older = cache->newest;
+        if (cache->newest >= 0) cacheslots[cache->newest].newer = i;
+        else                    cache->oldest = i;
+        cache->newest = i;
+    } else {
+        c->older = -1;
+        c->newer = cache->oldest;
+        if (cache->oldest >= 0) cacheslots[cache->oldest].older = i;
+        else                    cache->newest = i;
+        cache->oldest = i;
+    }
+}
+
+/*
+@return 1: process pid is running 0: it has exited (even if its parent hasn't reaped it yet)
+*/
+int cacheAlive(pid_t pid) {
+    char path[32];
+    char stat[256];
+    char *state;
+    int actual;
+    int fd;
+
+    if (kill(pid, 0) < 0 && errno == ESRCH) return 0;
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return errno != ENOENT;
+    actual = read(fd, stat, sizeof(stat)-1);
+    close(fd);
+    if (actual <= 0) return 1;
+    stat[actual] = 0;
+
+    // "pid (comm) state ...", where comm may hold anything
+    if (!(state = strrchr(stat, ')')) || !state[1]) return 1;
+    return state[2] != 'Z' && state[2] != 'X';
+}
+
+/*
+Drop slot i's pins held by processes that have exited (with the lock held).
+
+@return the pins left
+*/
+int cacheReap(int i) {
+    pid_t *pins = cacheslots[i].pins;
+    int left = 0;
+    int j;
+
+    for (j = 0; j < CACHE_PINS; j++) {
+        if (pins[j] && !cacheAlive(pins[j])) {
+            logError("Error: Process %d exited holding a cache pin", pins[j]);
+            pins[j] = 0;
+        }
+        if (pins[j]) left++;
+    }
+    return left;
+}
+
+/*
+Pin slot i for this process (with the lock held).
+
+@return 0: success 1: failure (CACHE_PINS transfers are sending from it already)
+*/
+int cachePin(int i) {
+    pid_t *pins = cacheslots[i].pins;
+    int j;
+
+    for (j = 0; j < CACHE_PINS && pins[j]; j++);
+    if (j == CACHE_PINS && cacheReap(i) == CACHE_PINS) return 1;
+    for (j = 0; pins[j]; j++);
+    pins[j] = getpid();
+    return 0;
+}
+
+/*
+Pick the slot a new file goes in (with the lock held): the oldest one on the LRU
+list that nothing is sending from, which is evicted if it holds a file.  Free slots
+are the oldest of all.
+
+@return its index (-1: every slot is busy)
+*/
+int cacheVictim(void) {
+    int i;
+
+    for (i = cache->oldest; i >= 0 && cacheReap(i); i = cacheslots[i].newer);
+    if (i < 0) return -1;
+    if (cacheslots[i].state == CACHE_READY) {
+        cacheUnlink(i);
+        cache->stats.evictions++;
+    }
+    cacheslots[i].state = CACHE_FREE;
+    return i;
+}
+
+/****************************************************************************************
+ * 
+ *                                      CACHE
+ * 
+ ****************************************************************************************/
+
+/*
+Map a cache of capacity bytes for files of at most admit bytes, shared with
+every process forked afterwards.
+
+@return 0: success 1: failure
+*/
+int cacheInit(off_t capacity, off_t admit) {
+    pthread_mutexattr_t attr;
+    size_t bytes;
+    long slots;
+    int buckets;
+    int err;
+
+    slots = capacity / admit;
+    if (slots < 1) slots = 1;
+    if (slots > (1 << 20)) {
+        errno = EINVAL;
+        return 1;
+    }
+    for (buckets = 1; buckets < slots; buckets <<= 1);
+
+    bytes = sizeof(struct cachehdr) + sizeof(int) * buckets + sizeof(struct cacheslot) * slots;
+    bytes = (bytes + 63) & ~(size_t)63;
+    if ((cache = mmap(NULL, bytes + (size_t)slots * admit, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        cache = NULL;
+        return 1;
+    }
+    cachebucket = (int*)(cache + 1);
+    cacheslots = (struct cacheslot*)(cachebucket + buckets);
+    cachedata = (char*)cache + bytes;
+    cachesize = admit;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    err = pthread_mutex_init(&cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (err) {
+        munmap(cache, bytes + (size_t)slots * admit);
+        cache = NULL;
+        errno = err;
+        return 1;
+    }
+
+    // Every slot starts out free (and unpinned)
+    cache->slots = slots;
+    cache->buckets = buckets;
+    cacheRebuild();
+    return 0;
+}
+
+/*
+Look up the file described by finfo.  A hit is pinned until cacheRelease.
+
+@return the slot holding it (-1: not cached, or pinned too often already), with
+        data pointing at its contents
+*/
+int cacheGet(struct stat *finfo, const char **data) {
+    int i;
+
+    cacheLock();
+    if ((i = cacheFind(finfo)) >= 0 && !cachePin(i)) {
+        cacheUnlist(i);
+        cacheList(i, 1);
+        cache->stats.hits++;
+    } else {
+        i = -1;
+        cache->stats.misses++;
+    }
+    cacheUnlock();
+
+    if (i >= 0) *data = cachedata + (size_t)i * cachesize;
+    return i;
+}
+
+/*
+Cache the file at fd (described by finfo) if it is small enough and a slot is
+free to take it.  Its contents are read into the slot with the lock released;
+if the file changed meanwhile, the slot is given back.  An admitted file is
+pinned until cacheRelease, like a hit.
+
+@return the slot now holding it (-1: not admitted), with data pointing at its contents
+*/
+int cacheAdmit(int fd, struct stat *finfo, const char **data) {
+    struct stat after;
+    char *dst;
+    off_t done;
+    ssize_t actual;
+    int changed;
+    int i;
+
+    if (finfo->st_size == 0 || finfo->st_size > cachesize) return -1;
+
+    cacheLock();
+    // Another process may have just cached it
+    if (cacheFind(finfo) >= 0 || (i = cacheVictim()) < 0) {
+        cacheUnlock();
+        return -1;
+    }
+    cacheslots[i].state = CACHE_FILLING;
+    cacheslots[i].pins[0] = getpid();
+    cacheslots[i].dev = finfo->st_dev;
+    cacheslots[i].ino = finfo->st_ino;
+    cacheslots[i].mtime = finfo->st_mtim;
+    cacheslots[i].size = finfo->st_size;
+    cacheUnlist(i);
+    cacheList(i, 1);
+    cacheUnlock();
+
+    dst = cachedata + (size_t)i * cachesize;
+    for (done = 0; done < finfo->st_size; done += actual) {
+        if ((actual = pread(fd, dst+done, finfo->st_size-done, done)) < 0 && errno == EINTR) {
+            actual = 0;
+            continue;
+        }
+        if (actual <= 0) break;
+    }
+
+    changed = done != finfo->st_size || fstat(fd, &after) < 0 || after.st_size != finfo->st_size
+            || after.st_mtim.tv_sec != finfo->st_mtim.tv_sec || after.st_mtim.tv_nsec != finfo->st_mtim.tv_nsec;
+
+    cacheLock();
+    if (changed) {
+        cacheslots[i].state = CACHE_FREE;
+        cacheslots[i].pins[0] = 0;
+        cacheUnlist(i);
+        cacheList(i, 0);
+        cacheUnlock();
+        return -1;
+    }
+    cacheslots[i].state = CACHE_READY;
+    cacheChain(i);
+    cache->stats.admits++;
+    cacheUnlock();
+
+    *data = dst;
+    return i;
+}
+
+/*
+Unpin slot i once its transfer is done.
+*/
+void cacheRelease(int i) {
+    pid_t self = getpid();
+    int j;
+
+    cacheLock();
+    for (j = 0; j < CACHE_PINS; j++) {
+        if (cacheslots[i].pins[j] == self) {
+            cacheslots[i].pins[j] = 0;
+            break;
+        }
+    }
+    cacheUnlock();
+}
+
+/*
+Copy the cache's counters (shared by all processes) into stats.
+
+@return 0: success 1: failure (no cache)
+*/
+int cacheStats(struct cachestats *stats) {
+    if (!cache) return 1;
+    cacheLock();
+    *stats = cache->stats;
+    cacheUnlock();
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+CRC32C checksums shared by myftp and myftpserve, for checking transfers end to
+end (K command).
+
+Transfers that copy through user space anyway sum the bytes as they go (see
+myftpio.c).  sendfile, splice and io_uring never bring the data into user space,
+so for those the part of the file that was read or written is summed once the
+transfer is done: the file is still in the page cache, and reading it back and
+summing it with the CPU's crc32 instruction (SSE 4.2) runs at several GB/s.
+myftpserve does that in a helper process for all but small files, so its other
+sessions don't wait on it.  CPUs without the instruction fall back to a table,
+a byte at a time.
+*/
+
+#include "myftp.h"
+
+#define CRC_POLY    0x82f63b78  // Castagnoli polynomial, bit-reversed
+#define CRC_READ    (1 << 20)   // Bytes read back at a time
+
+uint32_t crctable[256];
+int crchardware = -1;           // 1: crc32 instruction available 0: use crctable -1: not checked yet
+
+/****************************************************************************************
+ * 
+ *                                      PROTOTYPES
+ * 
+ ****************************************************************************************/
+
+uint32_t crcTable(uint32_t crc, const unsigned char *p, size_t n);
+uint32_t crcHardware(uint32_t crc, const unsigned char *p, size_t n);
+
+/****************************************************************************************
+ * 
+ *                                      HELPERS
+ * 
+ ****************************************************************************************/
+
+/*
+Run n bytes at p through the CRC register crc, a byte at a time.
+
+@return the new register
+*/
+uint32_t crcTable(uint32_t crc, const unsigned char *p, size_t n) {
+    uint32_t c;
+    int i;
+    int k;
+
+    if (!crctable[1]) {
+        for (i = 0; i < 256; i++) {
+            for (c = i, k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ CRC_POLY : c >> 1;
+            crctable[i] = c;
+        }
+    }
+    while (n--) crc = crctable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+/*
+Run n bytes at p through the CRC register crc, 8 bytes per crc32 instruction.
+
+@return the new register
+*/
+__attribute__((target("sse4.2")))
+uint32_t crcHardware(uint32_t crc, const unsigned char *p, size_t n) {
+    unsigned long long c;
+    unsigned long long v;
+
+    while (n && ((uintptr_t)p & 7)) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+        n--;
+    }
+    for (c = crc; n >= 8; p += 8, n -= 8) {
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    crc = c;
+    while (n--) crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#else
+uint32_t crcHardware(uint32_t crc, const unsigned char *p, size_t n) {
+    return crcTable(crc, p, n);
+}
+#endif
+
+/****************************************************************************************
+ * 
+ *                                      CHECKSUMS
+ * 
+ ****************************************************************************************/
+
+/*
+Continue the CRC32C crc (0 to start) over n more bytes of buf.
+
+@return the checksum so far
+*/
+uint32_t crcUpdate(uint32_t crc, const char *buf, size_t n) {
+    if (crchardware < 0) {
+#if defined(__x86_64__)
+        crchardware = __builtin_cpu_supports("sse4.2");
+#else
+        crchardware = 0;
+#endif
+    }
+    if (crchardware)    return ~crcHardware(~crc, (const unsigned char *)buf, n);
+    else                return ~crcTable(~crc, (const unsigned char *)buf, n);
+}
+
+/*
+Checksum length bytes of the file at fd (open for reading), starting at offset, into crc.
+The file is read rather than mapped: another session may truncate it meanwhile (T and P),
+which has to fail the checksum instead of raising SIGBUS in the whole process.
+
+@return 0: success 1: failure (the file is shorter, or can't be read)
+*/
+int crcFile(int fd, off_t offset, off_t length, uint32_t *crc) {
+    static char buf[CRC_READ];
+    size_t size;
+    ssize_t actual;
+
+    *crc = 0;
+    posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    while (length > 0) {
+        size = length < CRC_READ ? length : CRC_READ;
+        if ((actual = pread(fd, buf, size, offset)) < 0 && errno == EINTR) continue;
+        if (actual <= 0) return 1;
+        size = actual;
+        *crc = crcUpdate(*crc, buf, size);
+        offset += size;
+        length -= size;
+    }
+    return 0;
+}
@@ -0,0 +1,703 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+Delta puts shared by myftp and myftpserve (V and U commands), in the manner of rsync.
+
+The server describes its copy of a file as fixed-size blocks, each with a weak
+rolling checksum and a strong hash (deltaSignatures).  The client slides a
+window over its own copy, rolling the weak checksum one byte at a time, and
+wherever it finds a block the server already has (weak checksum first, then
+the strong hash), sends a reference to it instead of its bytes
+(deltaGenerate).  The server rebuilds the file from its old copy and the
+delta into a new file (deltaApply); block references and literals are
+copied between files with copy_file_range, so the data stays in the kernel.
+
+For the server's deduplicating store (H and M commands, see myftpstore.c), files
+are instead cut into chunks wherever their content says so (deltaChunk), so an
+insertion only changes the chunks around it, and each chunk is known by its
+SHA-256.  The client sends the chunks the server has as 'H' records in place of
+their bytes (deltaGenerateChunks).
+
+Both sides keep the streams in temporary files, so either end of them can
+move with the same engines as any other transfer (inline, compressed, etc).
+
+Signature stream: the block size (32 bits) and file size (64 bits), then for
+each block its weak checksum (32 bits) and the first DELTA_STRONG bytes of
+its SHA-256.  Delta stream: the block size, then records, each an opcode:
+    'L' <length:32> <bytes>     literal bytes
+    'C' <first:32> <count:32>   count blocks of the old copy, starting at block first
+    'E' <size:64>               end of the delta; the rebuilt file's size
+    'H' <sha256:256>            a chunk from the server's store (block size 0)
+All numbers are big-endian.
+*/
+
+#include "myftp.h"
+#include <openssl/sha.h>
+
+#define DELTA_MIN       1024        // Block size bounds (rsync's rule: about the square root of the size)
+#define DELTA_MAX       (128 << 10)
+#define DELTA_LITERAL   (1 << 20)   // Most bytes one literal record carries
+#define DELTA_BUF       (1 << 20)   // Bytes read or written at a time
+
+struct signature {
+    uint32_t blocksize;
+    off_t size;                 // Size of the server's copy
+    uint32_t blocks;
+    uint32_t *weak;
+    unsigned char *strong;      // DELTA_STRONG bytes per block
+    int *head;                  // Hash table of full blocks by weak checksum (chains through next)
+    int *next;
+    uint32_t mask;
+};
+
+// Buffered output of a stream
+struct deltaout {
+    int fd;
+    int len;
+    char buf[DELTA_BUF];
+};
+
+/****************************************************************************************
+ * 
+ *                                      PROTOTYPES
+ * 
+ ****************************************************************************************/
+
+uint32_t deltaWeak(const unsigned char *p, int n, uint32_t *a, uint32_t *b);
+int deltaWrite(int fd, const char *buf, size_t n);
+int deltaPut(struct deltaout *o, const void *data, size_t n);
+int deltaFlush(struct deltaout *o);
+int deltaLiteral(struct deltaout *o, const unsigned char *p, off_t n);
+int deltaRun(struct deltaout *o, uint32_t *run);
+uint32_t deltaBucket(struct signature *sig, uint32_t weak);
+int deltaMatch(struct signature *sig, int k, uint32_t weak, const unsigned char *p, unsigned char *md, int *hashed);
+
+/****************************************************************************************
+ * 
+ *                                      HELPERS
+ * 
+ ****************************************************************************************/
+
+/*
+Weak checksum of the n bytes at p: a is their sum and b the sum of the running sums,
+both kept so the window can be rolled a byte at a time.
+
+@return the checksum
+*/
+uint32_t deltaWeak(const unsigned char *p, int n, uint32_t *a, uint32_t *b) {
+    uint32_t s1 = 0;
+    uint32_t s2 = 0;
+
+    while (n--) {
+        s1 += *p++;
+        s2 += s1;
+    }
+    *a = s1;
+    *b = s2;
+    return (s1 & 0xffff) | (s2 << 16);
+}
+
+/*
+Write all n bytes of buf to fd.
+
+@return 0: success 1: failure
+*/
+int deltaWrite(int fd, const char *buf, size_t n) {
+    ssize_t actual;
+
+    while (n) {
+        if ((actual = write(fd, buf, n)) < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        buf += actual;
+        n -= actual;
+    }
+    return 0;
+}
+
+/*
+Add n bytes of data to the output, writing it out whenever the buffer fills.
+
+@return 0: success 1: failure
+*/
+int deltaPut(struct deltaout *o, const void *data, size_t n) {
+    if (o->len + n > sizeof(o->buf) && deltaFlush(o)) return 1;
+    if (n > sizeof(o->buf)) return deltaWrite(o->fd, data, n);
+    memcpy(o->buf+o->len, data, n);
+    o->len += n;
+    return 0;
+}
+
+/*
+Write out whatever the output is holding.
+
+@return 0: success 1: failure
+*/
+int deltaFlush(struct deltaout *o) {
+    int failed = deltaWrite(o->fd, o->buf, o->len);
+
+    o->len = 0;
+    return failed;
+}
+
+/*
+Add n bytes at p to the delta as literal records.
+
+@return 0: success 1: failure
+*/
+int deltaLiteral(struct deltaout *o, const unsigned char *p, off_t n) {
+    char rec[5];
+    uint32_t len;
+    int size;
+
+    for (; n > 0; p += size, n -= size) {
+        size = n < DELTA_LITERAL ? n : DELTA_LITERAL;
+        rec[0] = 'L';
+        len = htonl(size);
+        memcpy(rec+1, &len, 4);
+        if (deltaPut(o, rec, 5) || deltaPut(o, p, size)) return 1;
+    }
+    return 0;
+}
+
+/*
+Add a reference to run[1] old blocks, starting at block run[0], to the delta.
+
+@return 0: success 1: failure
+*/
+int deltaRun(struct deltaout *o, uint32_t *run) {
+    char rec[9];
+    uint32_t be;
+
+    rec[0] = 'C';
+    be = htonl(run[0]);
+    memcpy(rec+1, &be, 4);
+    be = htonl(run[1]);
+    memcpy(rec+5, &be, 4);
+    return deltaPut(o, rec, 9);
+}
+
+/*
+@return the hash table bucket for blocks with the weak checksum weak
+*/
+uint32_t deltaBucket(struct signature *sig, uint32_t weak) {
+    return ((weak * 0x9e3779b1u) >> 11 ^ weak) & sig->mask;
+}
+
+/*
+Check whether the full block at p, with weak checksum weak, is the server's block k.
+Its strong hash is only worked out (into md, noting it in hashed) when the weak checksums match.
+
+@return 1: match 0: no match
+*/
+int deltaMatch(struct signature *sig, int k, uint32_t weak, const unsigned char *p, unsigned char *md, int *hashed) {
+    if (sig->weak[k] != weak || (off_t)(k + 1) * sig->blocksize > sig->size) return 0;
+    if (!*hashed) SHA256(p, sig->blocksize, md);
+    *hashed = 1;
+    return !memcmp(md, sig->strong + (size_t)k * DELTA_STRONG, DELTA_STRONG);
+}
+
+/*
+Append length bytes of in, starting at offset, to out (at its file position).
+copy_file_range keeps the data in the kernel (or just shares the extents);
+filesystems that can't do it are read and written instead.
+
+@return 0: success 1: failure (errno EPROTO: in is too short)
+*/
+int deltaCopy(int in, off_t offset, int out, off_t length) {
+    static char buf[DELTA_BUF];
+    ssize_t actual;
+
+    while (length > 0) {
+        actual = copy_file_range(in, &offset, out, NULL, length, 0);
+        if (actual < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            actual = pread(in, buf, length < DELTA_BUF ? length : DELTA_BUF, offset);
+            if (actual > 0 && deltaWrite(out, buf, actual)) return 1;
+            if (actual > 0) offset += actual;
+        }
+        if (actual < 0 && errno == EINTR) continue;
+        if (actual < 0) return 1;
+        if (actual == 0) {
+            errno = EPROTO;
+            return 1;
+        }
+        length -= actual;
+    }
+    return 0;
+}
+
+/****************************************************************************************
+ * 
+ *                                      STREAMS
+ * 
+ ****************************************************************************************/
+
+/*
+Open an unnamed temporary file in the directory path (relative to dirfd),
+for holding a signature or delta stream.
+
+@return the file's FD (-1 on failure)
+*/
+int deltaTemp(int dirfd, const char *path) {
+    return openat(dirfd, path, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+}
+
+/*
+Write the signature stream of the file at fd to out.
+
+@return 0: success 1: failure
+*/
+int deltaSignatures(int fd, int out) {
+    static struct deltaout o;
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    struct stat finfo;
+    uint32_t blocksize;
+    uint32_t weak;
+    uint32_t a;
+    uint32_t b;
+    uint64_t size;
+    off_t offset;
+    char *buf;
+    ssize_t actual;
+    int failed;
+    int n;
+    int i;
+
+    if (fstat(fd, &finfo) < 0) return 1;
+    for (blocksize = DELTA_MIN; blocksize < DELTA_MAX && (off_t)blocksize * blocksize < finfo.st_size; blocksize <<= 1);
+    if (!(buf = malloc(DELTA_BUF))) return 1;
+
+    o.fd = out;
+    o.len = 0;
+    weak = htonl(blocksize);
+    size = htobe64(finfo.st_size);
+    failed = deltaPut(&o, &weak, 4) || deltaPut(&o, &size, 8);
+
+    // Whole blocks at a time, DELTA_BUF being a multiple of every block size
+    for (offset = 0; !failed && offset < finfo.st_size; offset += actual) {
+        if ((actual = pread(fd, buf, DELTA_BUF, offset)) < 0 && errno == EINTR) {
+            actual = 0;
+            continue;
+        }
+        if (actual <= 0) {
+            if (actual == 0) errno = EPROTO;
+            failed = 1;
+            break;
+        }
+        // Only the file's last block may come up short
+        if (actual % blocksize && offset + actual < finfo.st_size) actual -= actual % blocksize;
+
+        for (i = 0; !failed && i < actual; i += n) {
+            n = actual - i < (ssize_t)blocksize ? actual - i : (int)blocksize;
+            weak = htonl(deltaWeak((unsigned char*)buf+i, n, &a, &b));
+            SHA256((unsigned char*)buf+i, n, md);
+            failed = deltaPut(&o, &weak, 4) || deltaPut(&o, md, DELTA_STRONG);
+        }
+    }
+
+    free(buf);
+    return failed || deltaFlush(&o);
+}
+
+/*
+Read a signature stream from the start of fd, indexing its full blocks by weak checksum.
+
+@return the signatures (NULL on failure; errno EPROTO: the stream is malformed)
+*/
+struct signature *deltaLoad(int fd) {
+    struct signature *sig;
+    unsigned char hdr[12];
+    uint32_t blocksize;
+    uint64_t size;
+    size_t need;
+    size_t got;
+    char *buf;
+    ssize_t actual;
+    uint32_t i;
+    uint32_t h;
+
+    if (pread(fd, hdr, 12, 0) != 12) {
+        errno = EPROTO;
+        return NULL;
+    }
+    memcpy(&blocksize, hdr, 4);
+    memcpy(&size, hdr+4, 8);
+    blocksize = ntohl(blocksize);
+    size = be64toh(size);
+    if (blocksize < DELTA_MIN || blocksize > DELTA_MAX || size > (uint64_t)blocksize * UINT32_MAX / 2) {
+        errno = EPROTO;
+        return NULL;
+    }
+
+    if (!(sig = calloc(1, sizeof(struct signature)))) return NULL;
+    sig->blocksize = blocksize;
+    sig->size = size;
+    sig->blocks = (size + blocksize - 1) / blocksize;
+    for (sig->mask = 1; sig->mask < 2 * sig->blocks; sig->mask <<= 1);
+    sig->mask--;
+
+    need = (size_t)sig->blocks * (4 + DELTA_STRONG);
+    buf = malloc(need + 1);
+    sig->weak = malloc(sizeof(uint32_t) * (sig->blocks + 1));
+    sig->strong = malloc((size_t)DELTA_STRONG * (sig->blocks + 1));
+    sig->head = malloc(sizeof(int) * (sig->mask + 1));
+    sig->next = malloc(sizeof(int) * (sig->blocks + 1));
+    if (!buf || !sig->weak || !sig->strong || !sig->head || !sig->next) {
+        free(buf);
+        deltaFree(sig);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // One byte more than needed, so a longer stream shows up too
+    for (got = 0; got < need + 1; got += actual) {
+        if ((actual = pread(fd, buf+got, need + 1 - got, 12 + got)) < 0 && errno == EINTR) actual = 0;
+        else if (actual <= 0) break;
+    }
+    if (got != need) {
+        if (actual >= 0) errno = EPROTO;
+        free(buf);
+        deltaFree(sig);
+        return NULL;
+    }
+
+    // Chained last to first, so the lowest of equal blocks is found first and runs stay together
+    memset(sig->head, -1, sizeof(int) * (sig->mask + 1));
+    for (i = sig->blocks; i-- > 0; ) {
+        memcpy(&sig->weak[i], buf + (size_t)i * (4 + DELTA_STRONG), 4);
+        sig->weak[i] = ntohl(sig->weak[i]);
+        memcpy(sig->strong + (size_t)i * DELTA_STRONG, buf + (size_t)i * (4 + DELTA_STRONG) + 4, DELTA_STRONG);
+
+        // A short last block is never looked for
+        if ((off_t)(i + 1) * blocksize > sig->size) continue;
+        h = deltaBucket(sig, sig->weak[i]);
+        sig->next[i] = sig->head[h];
+        sig->head[h] = i;
+    }
+    free(buf);
+    return sig;
+}
+
+/*
+Release signatures (NULL is ignored).
+*/
+void deltaFree(struct signature *sig) {
+    if (!sig) return;
+    free(sig->weak);
+    free(sig->strong);
+    free(sig->head);
+    free(sig->next);
+    free(sig);
+}
+
+/****************************************************************************************
+ * 
+ *                                      DELTAS
+ * 
+ ****************************************************************************************/
+
+/*
+Write the delta that turns the file sig describes into the file at fd to out.
+literal is set to how many of fd's bytes had to be sent as they are.
+
+@return 0: success 1: failure
+*/
+int deltaGenerate(int fd, struct signature *sig, int out, off_t *literal) {
+    static struct deltaout o;
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    const unsigned char *p;
+    struct stat finfo;
+    uint32_t bs = sig->blocksize;
+    uint32_t run[2] = {0, 0};
+    uint32_t weak;
+    uint32_t a;
+    uint32_t b;
+    uint64_t size;
+    off_t pos;
+    off_t lit;
+    char rec[9];
+    int hashed;
+    int runs;
+    int k;
+
+    *literal = 0;
+    if (fstat(fd, &finfo) < 0) return 1;
+    p = NULL;
+    if (finfo.st_size && (p = mmap(NULL, finfo.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) return 1;
+    if (p) madvise((void*)p, finfo.st_size, MADV_SEQUENTIAL);
+
+    o.fd = out;
+    o.len = 0;
+    weak = htonl(bs);
+    if (deltaPut(&o, &weak, 4)) goto failure;
+
+    // The run of old blocks being referenced, sent once it stops growing
+    runs = 0;
+    lit = 0;
+    pos = 0;
+    if (finfo.st_size >= bs) deltaWeak(p, bs, &a, &b);
+    while (pos + bs <= finfo.st_size) {
+        weak = (a & 0xffff) | (b << 16);
+        hashed = 0;
+
+        // The block after the last match is the likeliest, then any with the same weak checksum
+        k = runs && run[0] + run[1] < sig->blocks ? (int)(run[0] + run[1]) : -1;
+        if (k < 0 || !deltaMatch(sig, k, weak, p+pos, md, &hashed)) {
+            for (k = sig->head[deltaBucket(sig, weak)]; k >= 0; k = sig->next[k]) {
+                if (deltaMatch(sig, k, weak, p+pos, md, &hashed)) break;
+            }
+        }
+
+        if (k < 0) {
+            // Roll the window a byte along
+            if (pos + bs < finfo.st_size) {
+                a += p[pos+bs] - p[pos];
+                b += a - bs * p[pos];
+            }
+            pos++;
+            continue;
+        }
+
+        if (pos > lit || (runs && (uint32_t)k != run[0] + run[1])) {
+            if (runs && deltaRun(&o, run)) goto failure;
+            runs = 0;
+            if (deltaLiteral(&o, p+lit, pos-lit)) goto failure;
+            *literal += pos - lit;
+        }
+        if (!runs) {
+            run[0] = k;
+            run[1] = 0;
+            runs = 1;
+        }
+        run[1]++;
+
+        pos += bs;
+        lit = pos;
+        if (pos + bs <= finfo.st_size) deltaWeak(p+pos, bs, &a, &b);
+    }
+
+    if (runs && deltaRun(&o, run)) goto failure;
+    if (deltaLiteral(&o, p+lit, finfo.st_size-lit)) goto failure;
+    *literal += finfo.st_size - lit;
+
+    rec[0] = 'E';
+    size = htobe64(finfo.st_size);
+    memcpy(rec+1, &size, 8);
+    if (deltaPut(&o, rec, 9) || deltaFlush(&o)) goto failure;
+    if (p) munmap((void*)p, finfo.st_size);
+    return 0;
+
+failure:
+    if (p) munmap((void*)p, finfo.st_size);
+    return 1;
+}
+
+/*
+Rebuild a file into out (empty, at its start) from its old copy (basis) and the delta
+stream at the start of delta.  size is set to the rebuilt file's size.
+
+@return 0: success 1: failure (errno EPROTO: the delta is malformed or cut short)
+*/
+int deltaApply(int basis, int delta, int out, off_t *size) {
+    unsigned char rec[9];
+    struct stat finfo;
+    uint32_t bs;
+    uint32_t first;
+    uint32_t count;
+    uint32_t len;
+    uint64_t end;
+    off_t offset;
+    off_t length;
+
+    *size = 0;
+    if (fstat(basis, &finfo) < 0) return 1;
+    if (pread(delta, &bs, 4, 0) != 4) goto bad;
+    bs = ntohl(bs);
+    if (bs < DELTA_MIN || bs > DELTA_MAX) goto bad;
+
+    for (offset = 4; pread(delta, rec, 1, offset) == 1; ) {
+        if (rec[0] == 'L') {
+            if (pread(delta, rec+1, 4, offset+1) != 4) goto bad;
+            memcpy(&len, rec+1, 4);
+            len = ntohl(len);
+            if (deltaCopy(delta, offset+5, out, len)) return 1;
+            offset += 5 + len;
+            *size += len;
+            continue;
+        }
+
+        if (pread(delta, rec+1, 8, offset+1) != 8) goto bad;
+        offset += 9;
+        if (rec[0] == 'E') {
+            memcpy(&end, rec+1, 8);
+            if (be64toh(end) != (uint64_t)*size) goto bad;
+            return 0;
+        }
+        if (rec[0] != 'C') goto bad;
+
+        memcpy(&first, rec+1, 4);
+        memcpy(&count, rec+5, 4);
+        first = ntohl(first);
+        count = ntohl(count);
+        if ((off_t)first * bs >= finfo.st_size || count == 0) goto bad;
+        length = (off_t)count * bs;
+        if (length > finfo.st_size - (off_t)first * bs) length = finfo.st_size - (off_t)first * bs;
+        if (deltaCopy(basis, (off_t)first * bs, out, length)) return 1;
+        *size += length;
+    }
+
+bad:
+    errno = EPROTO;
+    return 1;
+}
+
+/****************************************************************************************
+ * 
+ *                                      CHUNKS
+ * 
+ ****************************************************************************************/
+
+/*
+Find where the chunk starting at p ends, given n bytes left in the file.
+A rolling gear hash over the last 64 bytes picks the cut (FastCDC): cuts are
+harder to hit before CHUNK_AVG bytes and easier after, so chunks bunch up
+around that size, and never fall below CHUNK_MIN or above CHUNK_MAX.
+
+@return the chunk's length
+*/
+int deltaChunk(const unsigned char *p, off_t n) {
+    static uint64_t gear[256];
+    uint64_t h;
+    uint64_t x;
+    int limit;
+    int normal;
+    int i;
+
+    if (n <= CHUNK_MIN) return n;
+
+    // Both sides have to cut in the same places, so the table is the same fixed sequence
+    if (!gear[0]) {
+        for (x = 0x6d79667470ULL, i = 0; i < 256; i++) {
+            x += 0x9e3779b97f4a7c15ULL;
+            h = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+            gear[i] = h ^ (h >> 31);
+        }
+    }
+
+    limit = n < CHUNK_MAX ? n : CHUNK_MAX;
+    normal = limit < CHUNK_AVG ? limit : CHUNK_AVG;
+    h = 0;
+    for (i = CHUNK_MIN - 64; i < normal; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (i >= CHUNK_MIN && !(h & CHUNK_HARD)) return i + 1;
+    }
+    for (; i < limit; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CHUNK_EASY)) return i + 1;
+    }
+    return limit;
+}
+
+/*
+Cut the file at fd into chunks and hash each one.  count is set to how many there are.
+
+@return the chunks (NULL for an empty file, or on failure)
+*/
+struct chunk *deltaChunkFile(int fd, int *count) {
+    const unsigned char *p;
+    struct chunk *chunks;
+    struct chunk *more;
+    struct stat finfo;
+    off_t pos;
+    int room;
+
+    *count = 0;
+    if (fstat(fd, &finfo) < 0 || finfo.st_size == 0) return NULL;
+    if ((p = mmap(NULL, finfo.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) return NULL;
+    madvise((void*)p, finfo.st_size, MADV_SEQUENTIAL);
+
+    room = finfo.st_size / CHUNK_AVG + 16;
+    if (!(chunks = malloc(sizeof(struct chunk) * room))) {
+        munmap((void*)p, finfo.st_size);
+        return NULL;
+    }
+
+    for (pos = 0; pos < finfo.st_size; pos += chunks[(*count)++].length) {
+        if (*count == room) {
+            room *= 2;
+            if (!(more = realloc(chunks, sizeof(struct chunk) * room))) {
+                free(chunks);
+                munmap((void*)p, finfo.st_size);
+                *count = 0;
+                return NULL;
+            }
+            chunks = more;
+        }
+        chunks[*count].offset = pos;
+        chunks[*count].length = deltaChunk(p+pos, finfo.st_size-pos);
+        chunks[*count].stored = 0;
+        SHA256(p+pos, chunks[*count].length, chunks[*count].hash);
+    }
+
+    munmap((void*)p, finfo.st_size);
+    return chunks;
+}
+
+/*
+Write the stream that puts the file at fd (cut into count chunks) through the server's
+store to out: chunks marked stored as references, the rest as literals.
+literal is set to how many of fd's bytes had to be sent as they are.
+
+@return 0: success 1: failure
+*/
+int deltaGenerateChunks(int fd, struct chunk *chunks, int count, int out, off_t *literal) {
+    static struct deltaout o;
+    const unsigned char *p;
+    struct stat finfo;
+    uint32_t none = 0;
+    uint64_t size;
+    char rec[9];
+    int failed;
+    int i;
+
+    *literal = 0;
+    if (fstat(fd, &finfo) < 0) return 1;
+    p = NULL;
+    if (finfo.st_size && (p = mmap(NULL, finfo.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) return 1;
+
+    o.fd = out;
+    o.len = 0;
+    failed = deltaPut(&o, &none, 4);
+    for (i = 0; !failed && i < count; i++) {
+        if (chunks[i].offset + chunks[i].length > finfo.st_size) {
+            errno = EPROTO;
+            failed = 1;
+        } else if (chunks[i].stored) {
+            failed = deltaPut(&o, "H", 1) || deltaPut(&o, chunks[i].hash, CHUNK_HASH);
+        } else {
+            failed = deltaLiteral(&o, p + chunks[i].offset, chunks[i].length);
+            *literal += chunks[i].length;
+        }
+    }
+
+    rec[0] = 'E';
+    size = htobe64(finfo.st_size);
+    memcpy(rec+1, &size, 8);
+    if (!failed) failed = deltaPut(&o, rec, 9) || deltaFlush(&o);
+    if (p) munmap((void*)p, finfo.st_size);
+    return failed;
+}
+
+/*
+Write hash (CHUNK_HASH bytes) into dst as null-terminated lowercase hex.
+*/
+void deltaHex(const unsigned char *hash, char *dst) {
+    int i;
+
+    for (i = 0; i < CHUNK_HASH; i++) sprintf(dst + 2*i, "%02x", hash[i]);
+}
@@ -0,0 +1,551 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+Transfer engines shared by myftp and myftpserve.
+
+A transfer (struct xfer) moves bytes from one FD to another with the cheapest
+mechanism the kernel supports for that pair, and falls back to a plain
+read/write copy through a user buffer when it can't.  Transfers work on
+both blocking and non-blocking FDs: xferRun returns XFER_AGAIN whenever
+an FD would block, and can be called again once it is ready.
+
+File transfers tune themselves to the connection: once one has run for
+TUNE_PROBE bytes or TUNE_TIME seconds, the socket's RTT and delivery rate
+(TCP_INFO) give the bandwidth-delay product, and the socket buffer and splice
+pipe are grown to cover it where the kernel's own autotuning fell short.
+
+Compressed transfers (XFER_DEFLATE, XFER_INFLATE) can't skip user space, so
+they read and write through their stream's block buffers (see myftpzip.c).
+Memory transfers (XFER_MEMORY) write straight from a caller's buffer, such as
+myftpserve's shared file cache.  Transfers whose bytes pass through user space
+anyway (copies, compressed and memory transfers) checksum them on the way, so
+the K command doesn't have to read them back.
+*/
+
+#include "myftp.h"
+
+#define SENDFILE_MAX 0x7ffff000 // Most bytes Linux will move in one sendfile call
+#define TUNE_PROBE  (4 << 20)   // Bytes moved before a transfer is tuned...
+#define TUNE_TIME   0.25        // ...or seconds, whichever comes first
+#define TUNE_BUF_MAX (64 << 20) // Largest socket buffer asked for
+
+short xferuring = 0;    // 1: try io_uring for file <-> socket transfers first
+
+/****************************************************************************************
+ * 
+ *                                      PROTOTYPES
+ * 
+ ****************************************************************************************/
+
+int xferCopy(struct xfer *x);
+int xferSendfile(struct xfer *x);
+int xferSplice(struct xfer *x);
+int xferFallback(struct xfer *x);
+int xferDeflate(struct xfer *x);
+int xferInflate(struct xfer *x);
+int xferMemory(struct xfer *x);
+int xferBufferLimit(int opt);
+
+/****************************************************************************************
+ * 
+ *                                      TRANSFERS
+ * 
+ ****************************************************************************************/
+
+/*
+Prepare x to move count bytes from in to out using mode.
+offset is where reading starts in in (sendfile only; others use the FD's own offset).
+count -1 means until in reaches EOF.  For XFER_MEMORY, set x->mem to the count bytes
+to send afterwards.
+
+With xferuring set, file -> socket (XFER_SENDFILE) and socket -> file (XFER_SPLICE)
+transfers of at least a chunk run on io_uring instead, when the kernel allows it.
+*/
+void xferInit(struct xfer *x, int mode, int in, int out, off_t offset, off_t count) {
+    memset(x, 0, sizeof(struct xfer));
+    x->mode = mode;
+    x->in = in;
+    x->out = out;
+    x->waitfd = -1;
+    x->offset = offset;
+    x->remaining = count;
+    x->pipefd[0] = -1;
+    x->pipefd[1] = -1;
+    x->sock = mode == XFER_SENDFILE || mode == XFER_DEFLATE ? out 
+                : mode == XFER_SPLICE || mode == XFER_INFLATE ? in : -1;
+    x->chunk = mode == XFER_SENDFILE ? TUNE_PROBE : 0;
+    x->summed = mode == XFER_COPY || mode == XFER_DEFLATE || mode == XFER_INFLATE || mode == XFER_MEMORY;
+    clock_gettime(CLOCK_MONOTONIC, &x->started);
+
+    // Without its stream, xferRun fails the transfer
+    if (mode == XFER_DEFLATE || mode == XFER_INFLATE) {
+        x->zip = zipOpen(mode == XFER_DEFLATE);
+        return;
+    }
+
+    if (xferuring && (mode == XFER_SENDFILE || mode == XFER_SPLICE) 
+        && (count < 0 || count >= URING_CHUNK) && !uringInit(x)) return;
+
+    if (mode == XFER_SPLICE) {
+        if (pipe(x->pipefd) < 0) {
+            logDebug("Creating splice pipe failed (%s), using read/write", strerror(errno));
+            x->mode = XFER_COPY;
+            x->summed = 1;
+            return;
+        }
+        // Bigger pipe means fewer splice calls; the default size still works if this fails
+        if ((x->chunk = fcntl(x->pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE)) <= 0)
+            x->chunk = fcntl(x->pipefd[1], F_GETPIPE_SZ);
+    }
+}
+
+/*
+Move as much as possible without blocking on a non-blocking FD.
+
+@return XFER_DONE: finished XFER_AGAIN: an FD would block XFER_FAIL: failure (errno set)
+*/
+int xferRun(struct xfer *x) {
+    if (x->mode == XFER_URING)      return uringRun(x);
+    if (x->mode == XFER_SENDFILE)   return xferSendfile(x);
+    if (x->mode == XFER_SPLICE)     return xferSplice(x);
+    if (x->mode == XFER_DEFLATE)    return xferDeflate(x);
+    if (x->mode == XFER_INFLATE)    return xferInflate(x);
+    if (x->mode == XFER_MEMORY)     return xferMemory(x);
+    return xferCopy(x);
+}
+
+/*
+Release anything the transfer allocated.  Does not close in or out.
+*/
+void xferClose(struct xfer *x) {
+    uringClose(x);
+    zipClose(x->zip);
+    x->zip = NULL;
+    x->waitfd = -1;
+    if (x->pipefd[0] >= 0) close(x->pipefd[0]);
+    if (x->pipefd[1] >= 0) close(x->pipefd[1]);
+    x->pipefd[0] = -1;
+    x->pipefd[1] = -1;
+}
+
+/*
+@return the most an unprivileged SO_SNDBUF or SO_RCVBUF (opt) may ask for (0: unknown)
+*/
+int xferBufferLimit(int opt) {
+    char buf[32];
+    int limit = 0;
+    int fd;
+
+    fd = open(opt == SO_SNDBUF ? "/proc/sys/net/core/wmem_max" : "/proc/sys/net/core/rmem_max", 
+                O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    if (read(fd, buf, sizeof(buf)-1) > 0) limit = atoi(buf);
+    close(fd);
+    return limit;
+}
+
+/*
+Once the transfer has run long enough to measure, size its socket buffer (and splice pipe)
+to the connection's bandwidth-delay product.  Buffers only ever grow here: asking for
+a size also switches off the kernel's autotuning, so nothing is asked for unless it
+beats what the kernel already chose.
+*/
+void xferTune(struct xfer *x) {
+    struct tcp_info ti;
+    struct timespec now;
+    socklen_t len;
+    double secs;
+    double rate;
+    double rtt;
+    long long bdp;
+    long long want;
+    int before;
+    int after;
+    int limit;
+    int size;
+    int opt;
+
+    if (x->sock < 0 || x->tuned) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec - x->started.tv_sec) + (now.tv_nsec - x->started.tv_nsec) / 1e9;
+    if (x->moved < TUNE_PROBE && secs < TUNE_TIME) return;
+    x->tuned = 1;
+
+    // Sendfile was only held back until now so a blocking send could be tuned on the way
+    if (x->mode == XFER_SENDFILE) x->chunk = SENDFILE_MAX;
+
+    memset(&ti, 0, sizeof(ti));
+    len = sizeof(ti);
+    if (getsockopt(x->sock, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0 || secs <= 0) return;
+
+    // The receiving side only has its own estimate of the RTT and what it has read so far
+    rtt = (ti.tcpi_rtt > ti.tcpi_rcv_rtt ? ti.tcpi_rtt : ti.tcpi_rcv_rtt) / 1e6;
+    rate = ti.tcpi_delivery_rate ? (double)ti.tcpi_delivery_rate : x->moved / secs;
+    if (rtt <= 0) return;
+    bdp = rate * rtt;
+
+    // Twice the BDP leaves room for the kernel's bookkeeping and for the window to grow
+    want = 2*bdp < TUNE_BUF_MAX ? 2*bdp : TUNE_BUF_MAX;
+    opt = x->sock == x->out ? SO_SNDBUF : SO_RCVBUF;
+    len = sizeof(before);
+    if (getsockopt(x->sock, SOL_SOCKET, opt, &before, &len) < 0) return;
+    after = before;
+
+    // The kernel doubles what it is asked for, and caps unprivileged requests
+    if (want > before) {
+        size = want / 2;
+        if (setsockopt(x->sock, SOL_SOCKET, opt == SO_SNDBUF ? SO_SNDBUFFORCE : SO_RCVBUFFORCE, 
+                        &size, sizeof(size)) < 0) {
+            limit = xferBufferLimit(opt);
+            if (size > limit) size = limit;
+            if (2LL*size > before) setsockopt(x->sock, SOL_SOCKET, opt, &size, sizeof(size));
+        }
+        len = sizeof(after);
+        getsockopt(x->sock, SOL_SOCKET, opt, &after, &len);
+    }
+
+    // Splice up to a BDP at a time, as far as the pipe may grow (the pipe is empty here)
+    if (x->pipefd[1] >= 0 && bdp > x->chunk) {
+        size = bdp < TUNE_BUF_MAX ? bdp : TUNE_BUF_MAX;
+        if ((size = fcntl(x->pipefd[1], F_SETPIPE_SZ, size)) > 0) x->chunk = size;
+    }
+
+    logDebug("Tuned FD %d after %lld bytes: rtt %.2f ms, %.1f MB/s, bdp %lld, "
+                "%s %d -> %d, chunk %d", x->sock, (long long)x->moved, rtt*1e3, 
+                rate/(1 << 20), bdp, opt == SO_SNDBUF ? "sndbuf" : "rcvbuf", before, after, x->chunk);
+}
+
+/*
+Switch a zero-copy transfer that hasn't moved anything yet over to read/write.
+
+@return same as xferRun
+*/
+int xferFallback(struct xfer *x) {
+    logDebug("Zero-copy unavailable for FD %d to FD %d (%s), using read/write", 
+                x->in, x->out, strerror(errno));
+    if (x->mode == XFER_SENDFILE && lseek(x->in, x->offset, SEEK_SET) < 0) return XFER_FAIL;
+    xferClose(x);
+    x->mode = XFER_COPY;
+    x->summed = 1;
+    return xferCopy(x);
+}
+
+/*
+Read into the transfer buffer, then write it out.
+*/
+int xferCopy(struct xfer *x) {
+    ssize_t actual;
+    size_t want;
+
+    while (1) {
+        // Flush whatever is buffered first
+        while (x->head < x->tail) {
+            actual = write(x->out, x->buf+x->head, x->tail-x->head);
+            if (actual < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return XFER_AGAIN;
+                return XFER_FAIL;
+            }
+            x->crc = crcUpdate(x->crc, x->buf+x->head, actual);
+            x->head += actual;
+            x->moved += actual;
+        }
+        x->head = x->tail = 0;
+        xferTune(x);
+
+        if (x->remaining == 0) return XFER_DONE;
+
+        want = sizeof(x->buf);
+        if (x->remaining > 0 && x->remaining < want) want = x->remaining;
+        actual = read(x->in, x->buf, want);
+        if (actual < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return XFER_AGAIN;
+            return XFER_FAIL;
+        }
+        if (actual == 0) return XFER_DONE;
+        x->tail = actual;
+        x->offset += actual;
+        if (x->remaining > 0) x->remaining -= actual;
+    }
+}
+
+/*
+File to socket without copying through user space.
+Partial sends just advance the offset; the loop picks up where it left off.
+*/
+int xferSendfile(struct xfer *x) {
+    ssize_t actual;
+    size_t want;
+
+    while (x->remaining) {
+        want = x->chunk;
+        if (x->remaining > 0 && x->remaining < want) want = x->remaining;
+        actual = sendfile(x->out, x->in, &x->offset, want);
+        if (actual < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return XFER_AGAIN;
+            if (x->moved == 0 && (errno == EINVAL || errno == ENOSYS)) return xferFallback(x);
+            return XFER_FAIL;
+        }
+        if (actual == 0) break;     // File shrank since it was stat'ed
+        x->moved += actual;
+        if (x->remaining > 0) x->remaining -= actual;
+        xferTune(x);
+    }
+    return XFER_DONE;
+}
+
+/*
+Memory to any FD, usually in a single write.
+*/
+int xferMemory(struct xfer *x) {
+    ssize_t actual;
+
+    while (x->remaining > 0) {
+        if ((actual = write(x->out, x->mem + x->offset, x->remaining)) < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return XFER_AGAIN;
+            return XFER_FAIL;
+        }
+        x->crc = crcUpdate(x->crc, x->mem + x->offset, actual);
+        x->offset += actual;
+        x->remaining -= actual;
+        x->moved += actual;
+    }
+    return XFER_DONE;
+}
+
+/*
+Copy up to n bytes of an XFER_MEMORY transfer's source into dst, for callers
+that frame the data themselves.  Doesn't count (or checksum) them as moved.
+
+@return bytes copied (0: the source is used up)
+*/
+int xferTake(struct xfer *x, char *dst, int n) {
+    if (n > x->remaining) n = x->remaining;
+    memcpy(dst, x->mem + x->offset, n);
+    x->offset += n;
+    x->remaining -= n;
+    return n;
+}
+
+/*
+Socket to file through a pipe, without copying through user space.
+The pipe is always drained into the file before more is spliced in,
+so the only place this can block is on the socket.
+*/
+int xferSplice(struct xfer *x) {
+    ssize_t actual;
+    size_t want;
+
+    while (1) {
+        // Drain everything that landed in the pipe into the file
+        while (x->inpipe > 0) {
+            actual = splice(x->pipefd[0], NULL, x->out, NULL, x->inpipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (actual < 0) {
+                if (errno == EINTR) continue;
+                return XFER_FAIL;
+            }
+            x->inpipe -= actual;
+            x->moved += actual;
+        }
+        xferTune(x);
+
+        if (x->remaining == 0) return XFER_DONE;
+
+        want = x->chunk;
+        if (x->remaining > 0 && x->remaining < want) want = x->remaining;
+        actual = splice(x->in, NULL, x->pipefd[1], NULL, want, 
+                        SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+        if (actual < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return XFER_AGAIN;
+            if (x->moved == 0 && (errno == EINVAL || errno == ENOSYS)) return xferFallback(x);
+            return XFER_FAIL;
+        }
+        if (actual == 0) return XFER_DONE;
+        x->inpipe = actual;
+        if (x->remaining > 0) x->remaining -= actual;
+    }
+}
+
+/*
+Read in a block's worth at a time and write it out packed, ending with the block
+that ends the stream.  The packed block waits in the stream, between head and tail,
+until out takes all of it.
+*/
+int xferDeflate(struct xfer *x) {
+    struct zipper *zp = x->zip;
+    ssize_t actual;
+    size_t want;
+
+    if (!zp) return XFER_FAIL;
+    while (1) {
+        while (x->head < x->tail) {
+            actual = write(x->out, zp->block+x->head, x->tail-x->head);
+            if (actual < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return XFER_AGAIN;
+                return XFER_FAIL;
+            }
+            x->head += actual;
+        }
+        x->head = x->tail = 0;
+        xferTune(x);
+
+        if (zp->ended) return XFER_DONE;
+
+        want = ZIP_CHUNK;
+        if (x->remaining >= 0 && x->remaining < want) want = x->remaining;
+        actual = want ? read(x->in, zp->raw, want) : 0;
+        if (actual < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return XFER_AGAIN;
+            return XFER_FAIL;
+        }
+        x->crc = crcUpdate(x->crc, zp->raw, actual);
+        x->tail = zipPack(zp, zp->raw, actual, zp->block);
+        x->offset += actual;
+        x->moved += actual;
+        if (x->remaining > 0) x->remaining -= actual;
+    }
+}
+
+/*
+Read blocks in and write out what they unpack to.  The unpacked data waits in
+the transfer (from head to tail of data) until out takes all of it.
+A stream cut short of its last block fails with EPROTO.
+*/
+int xferInflate(struct xfer *x) {
+    struct zipper *zp = x->zip;
+    ssize_t actual;
+    char *dst;
+    int need;
+    int n;
+
+    if (!zp) return XFER_FAIL;
+    while (1) {
+        while (x->head < x->tail) {
+            actual = write(x->out, x->data+x->head, x->tail-x->head);
+            if (actual < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return XFER_AGAIN;
+                return XFER_FAIL;
+            }
+            x->crc = crcUpdate(x->crc, x->data+x->head, actual);
+            x->head += actual;
+            x->moved += actual;
+        }
+        x->head = x->tail = 0;
+        xferTune(x);
+
+        if (zp->ended) return XFER_DONE;
+
+        need = zipNeed(zp, &dst);
+        actual = read(x->in, dst, need);
+        if (actual < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return XFER_AGAIN;
+            return XFER_FAIL;
+        }
+        if (actual == 0 || (n = zipGot(zp, actual, &x->data)) == ZIP_BAD) {
+            errno = EPROTO;
+            return XFER_FAIL;
+        }
+        if (n > 0) x->tail = n;
+    }
+}
+
+/****************************************************************************************
+ * 
+ *                                      BLOCKING WRAPPERS
+ * 
+ ****************************************************************************************/
+
+/*
+Receive everything from sockfd until EOF and write it to fd.
+Data moves socket -> pipe -> file with splice, so it never passes through user space.
+Falls back to a read/write loop if the kernel cannot splice from sockfd or into fd.
+The number of bytes actually written to fd is stored in received.
+
+@return 0: success 1: failure
+*/
+int spliceContents(int sockfd, int fd, off_t *received) {
+    struct xfer x;
+    int err;
+
+    logDebug("Splicing contents from FD %d to FD %d...", sockfd, fd);
+
+    xferInit(&x, XFER_SPLICE, sockfd, fd, 0, -1);
+    err = xferRun(&x);
+    *received = x.moved;
+    xferClose(&x);
+
+    if (err != XFER_DONE) {
+        logError("Error, splicing FD %d to FD %d: %s", sockfd, fd, strerror(errno));
+        return 1;
+    }
+    logDebug("Spliced %lld bytes", (long long)*received);
+    return 0;
+}
+
+/*
+Send everything from the file at fd to sockfd, starting at fd's current offset.
+Uses sendfile (or io_uring) so the data never passes through user space.
+The number of bytes actually sent is stored in sent.
+
+@return 0: success 1: failure
+*/
+int sendFileContents(int fd, int sockfd, off_t *sent) {
+    struct xfer x;
+    off_t offset;
+    int err;
+
+    logDebug("Sending contents from FD %d to FD %d...", fd, sockfd);
+
+    if ((offset = lseek(fd, 0, SEEK_CUR)) < 0) offset = 0;
+    xferInit(&x, XFER_SENDFILE, fd, sockfd, offset, -1);
+    err = xferRun(&x);
+    *sent = x.moved;
+    xferClose(&x);
+
+    if (err != XFER_DONE) {
+        logError("Error, sending FD %d to FD %d: %s", fd, sockfd, strerror(errno));
+        return 1;
+    }
+    logDebug("Sent %lld bytes", (long long)*sent);
+    return 0;
+}
+
+/*
+Compress (deflating is 1) everything from in into blocks on out, or unpack the
+blocks arriving on in into out, until the stream ends.  in is read from its
+current offset.  The number of bytes read (compressing) or written (unpacking)
+is stored in moved.
+
+@return 0: success 1: failure
+*/
+int zipContents(int in, int out, int deflating, off_t *moved) {
+    struct xfer x;
+    int err;
+
+    logDebug("%s contents from FD %d to FD %d...", deflating ? "Compressing" : "Decompressing", in, out);
+
+    xferInit(&x, deflating ? XFER_DEFLATE : XFER_INFLATE, in, out, 0, -1);
+    err = xferRun(&x);
+    *moved = x.moved;
+    xferClose(&x);
+
+    if (err != XFER_DONE) {
+        // more quitting early isn't worth a message
+        if (errno != EPIPE) logError("Error, %s FD %d to FD %d: %s", 
+                                    deflating ? "compressing" : "decompressing", in, out, strerror(errno));
+        return 1;
+    }
+    logDebug("%s %lld bytes", deflating ? "Compressed" : "Decompressed", (long long)*moved);
+    return 0;
+}
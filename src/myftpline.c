@@ -0,0 +1,259 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+Control connection line framer shared by myftp and myftpserve.
+
+Control bytes land in a fixed ring (struct linebuf) and are split into lines
+as they arrive.  Each byte is searched for a newline only once, however many
+reads a line takes to arrive, and nothing is moved around when a line is
+taken off the front.  Bytes that aren't lines (inline frames) are read from
+the same ring with linePeek/lineTake.
+
+A line that can't fit the caller's buffer is dropped whole and reported as
+LINE_LONG, rather than being cut into pieces that would each run as commands.
+
+Connections that negotiate the binary protocol (see myftp.h) read whole
+messages off the same ring with binNext instead.
+*/
+
+#include "myftp.h"
+
+#define LINE_MASK (LINE_RING - 1)
+
+/****************************************************************************************
+ * 
+ *                                      PROTOTYPES
+ * 
+ ****************************************************************************************/
+
+char *lineScan(struct linebuf *lb, unsigned from, unsigned to);
+void lineCopy(struct linebuf *lb, char *dst, int n);
+
+/****************************************************************************************
+ * 
+ *                                      HELPERS
+ * 
+ ****************************************************************************************/
+
+/*
+Search ring positions [from, to) for a newline, in at most two pieces around the wrap.
+memchr is vectorized by the C library, so long stretches are cheap.
+
+@return the newline (NULL if none)
+*/
+char *lineScan(struct linebuf *lb, unsigned from, unsigned to) {
+    unsigned start = from & LINE_MASK;
+    unsigned n = to - from;
+    unsigned first = LINE_RING - start;
+    char *nl;
+
+    if (n <= first) return memchr(lb->ring+start, '\n', n);
+    if ((nl = memchr(lb->ring+start, '\n', first))) return nl;
+    return memchr(lb->ring, '\n', n - first);
+}
+
+/*
+Copy the first n unread bytes into dst without consuming them.
+*/
+void lineCopy(struct linebuf *lb, char *dst, int n) {
+    unsigned start = lb->head & LINE_MASK;
+    unsigned first = LINE_RING - start;
+
+    if ((unsigned)n <= first) {
+        memcpy(dst, lb->ring+start, n);
+        return;
+    }
+    memcpy(dst, lb->ring+start, first);
+    memcpy(dst+first, lb->ring, n-first);
+}
+
+/****************************************************************************************
+ * 
+ *                                      FRAMER
+ * 
+ ****************************************************************************************/
+
+/*
+Empty the framer.
+*/
+void lineInit(struct linebuf *lb) {
+    lb->head = 0;
+    lb->tail = 0;
+    lb->scanned = 0;
+    lb->skipping = 0;
+}
+
+/*
+@return unread bytes held
+*/
+int lineUsed(struct linebuf *lb) {
+    return lb->tail - lb->head;
+}
+
+/*
+@return bytes that can still be read in
+*/
+int lineRoom(struct linebuf *lb) {
+    return LINE_RING - (lb->tail - lb->head);
+}
+
+/*
+Read whatever fd has (up to the free room) into the ring, with one readv
+covering both sides of the wrap.
+
+@return same as read (call only with room to spare, since 0 means EOF)
+*/
+int lineFill(struct linebuf *lb, int fd) {
+    struct iovec iov[2];
+    unsigned start = lb->tail & LINE_MASK;
+    unsigned room = lineRoom(lb);
+    int actual;
+
+    iov[0].iov_base = lb->ring + start;
+    iov[0].iov_len = LINE_RING - start < room ? LINE_RING - start : room;
+    iov[1].iov_base = lb->ring;
+    iov[1].iov_len = room - iov[0].iov_len;
+
+    if ((actual = readv(fd, iov, iov[1].iov_len ? 2 : 1)) > 0) lb->tail += actual;
+    return actual;
+}
+
+/*
+Take the next complete line off the front, without its newline, into dst
+(null-terminated, at most size-1 characters).
+
+@return the line's length, LINE_NONE: no complete line yet, LINE_LONG: a line
+        longer than size-1 was dropped
+*/
+int lineNext(struct linebuf *lb, char *dst, int size) {
+    unsigned end;
+    char *nl;
+    int len;
+
+    if (!(nl = lineScan(lb, lb->head + lb->scanned, lb->tail))) {
+        lb->scanned = lb->tail - lb->head;
+
+        // It can't fit anymore, so stop holding on to it
+        if ((int)lb->scanned >= size) {
+            lb->head = lb->tail;
+            lb->scanned = 0;
+            lb->skipping = 1;
+        }
+        return LINE_NONE;
+    }
+
+    // Position of the newline counted from head, across the wrap
+    end = (nl - lb->ring - lb->head) & LINE_MASK;
+    len = end;
+    if (lb->skipping || len >= size) {
+        lineDrop(lb, len + 1);
+        lb->skipping = 0;
+        return LINE_LONG;
+    }
+
+    lineCopy(lb, dst, len);
+    dst[len] = 0;
+    lineDrop(lb, len + 1);
+    return len;
+}
+
+/*
+Point data at the unread bytes that are contiguous in the ring.
+
+@return how many there are
+*/
+int linePeek(struct linebuf *lb, char **data) {
+    unsigned start = lb->head & LINE_MASK;
+    unsigned n = lb->tail - lb->head;
+
+    *data = lb->ring + start;
+    return n < LINE_RING - start ? n : LINE_RING - start;
+}
+
+/*
+Consume n unread bytes.
+*/
+void lineDrop(struct linebuf *lb, int n) {
+    lb->head += n;
+    lb->scanned = (int)lb->scanned > n ? lb->scanned - n : 0;
+}
+
+/*
+Copy and consume up to size unread bytes.
+
+@return bytes taken
+*/
+int lineTake(struct linebuf *lb, char *dst, int size) {
+    int n = lineUsed(lb);
+
+    if (n > size) n = size;
+    lineCopy(lb, dst, n);
+    lineDrop(lb, n);
+    return n;
+}
+
+/****************************************************************************************
+ * 
+ *                                      BINARY PROTOCOL
+ * 
+ ****************************************************************************************/
+
+/*
+Write a binary protocol message (header, then len bytes of payload) to dst,
+which needs room for BIN_HDR+len bytes.
+
+@return the message's size
+*/
+int binEncode(char *dst, char op, uint8_t flags, uint16_t id, char *payload, int len) {
+    struct binhdr h;
+
+    h.op = op;
+    h.flags = flags;
+    h.id = htons(id);
+    h.len = htonl(len);
+    memcpy(dst, &h, BIN_HDR);
+    if (len) memcpy(dst+BIN_HDR, payload, len);
+    return BIN_HDR + len;
+}
+
+/*
+Take the next whole binary protocol message off the front: its header into h
+(in host byte order) and its payload into payload (null-terminated, so it
+needs size+1 bytes).
+
+@return the payload's length, LINE_NONE: no whole message yet, LINE_LONG: the
+        payload is longer than size (nothing is taken; the stream can't be trusted)
+*/
+int binNext(struct linebuf *lb, struct binhdr *h, char *payload, int size) {
+    if (lineUsed(lb) < BIN_HDR) return LINE_NONE;
+    lineCopy(lb, (char*)h, BIN_HDR);
+    h->id = ntohs(h->id);
+    h->len = ntohl(h->len);
+
+    if (h->len > (uint32_t)size) return LINE_LONG;
+    if (lineUsed(lb) < BIN_HDR + (int)h->len) return LINE_NONE;
+
+    lineDrop(lb, BIN_HDR);
+    lineTake(lb, payload, h->len);
+    payload[h->len] = 0;
+    return h->len;
+}
+
+/*
+@return the message for an error code (an errno value or one of the ERR_ codes)
+*/
+char *errorText(int code) {
+    switch (code) {
+        case ERR_NDIR:  return "File is not a directory";
+        case ERR_NREG:  return "File is not regular";
+        case ERR_DATA:  return "Data connection missing";
+        case ERR_BASE:  return "Base file name expected, pathname received";
+        case ERR_RNGE:  return "Invalid byte range";
+        case ERR_LONG:  return "Command too long";
+        case ERR_CMD:   return "Invalid command";
+        default:        return strerror(code);
+    }
+}
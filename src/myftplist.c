@@ -0,0 +1,483 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+In-process directory lister for myftpserve's L command.
+
+Produces ls -l style lines without forking ls: entries are read in large
+getdents64 batches and formatted one at a time straight into the caller's
+buffer, so a listing streams out as the directory is read instead of
+waiting for the whole directory to be read and sorted.  Entries come out
+in directory order, and there is no "total" line since it would need every
+entry up front.
+
+Finished listings are cached by directory inode for every session in the
+process, so clients polling the same directories are answered from memory.
+Each cached directory is watched with inotify, and a change to it or to any
+file in it drops the listing.  Without inotify, a listing is only trusted
+while the directory's mtime is unchanged and for LIST_CACHE_TTL seconds,
+since a file growing doesn't touch its directory's mtime.
+*/
+
+#include "myftp.h"
+
+#define LIST_DENTS  (64 << 10) // Bytes of directory entries per getdents64 call
+#define LIST_LINE   (2*PATH_MAX + 128) // Longest line: name -> symlink target plus fields
+#define LIST_NAMES  16 // Owner and group names remembered per listing
+#define LIST_RECENT (182*24*60*60) // Like ls, older times show the year instead of the time
+
+#define LIST_CACHED         32          // Directories whose listings are kept
+#define LIST_CACHE_MAX      (4 << 20)   // Largest listing worth caching
+#define LIST_CACHE_BYTES    (16 << 20)  // Memory all cached listings may use
+#define LIST_CACHE_TTL      2           // Seconds a listing is trusted without inotify
+#define LIST_WATCH (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO \
+                    | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct listname {
+    int valid;
+    unsigned id;
+    char name[32];
+};
+
+// A cached listing, freed once neither the cache nor any lister refers to it
+struct listdata {
+    int refs;
+    int len;
+    char bytes[];
+};
+
+struct listentry {
+    unsigned long serial;       // Changes whenever the slot starts a new listing (0: unused)
+    unsigned long used;         // When the listing was last used, for eviction
+    dev_t dev;
+    ino_t ino;
+    int wd;                     // inotify watch on the directory (-1: none)
+    int stale;                  // Directory changed since the listing began
+    struct timespec mtime;      // Directory's mtime when the listing began
+    time_t filled;              // When the listing began
+    struct listdata *data;      // Finished listing (NULL while being filled)
+};
+
+struct lister {
+    int dirfd;
+    struct listdata *data;      // Cached listing being served (NULL: read the directory)
+    int entry;                  // Cache slot the listing will be stored in (-1: none)
+    unsigned long serial;       // That slot's serial when the listing began
+    struct listdata *fill;      // Listing so far, to be cached at EOF
+    int fillcap;
+    int pos;                    // Next unformatted entry in dents (next unsent byte of data)
+    int len;                    // Bytes of dents filled by the last getdents64
+    int eof;
+    int linepos;                // Unread part of line is [linepos, linelen)
+    int linelen;
+    time_t now;
+    struct listname users[LIST_NAMES];
+    struct listname groups[LIST_NAMES];
+    char line[LIST_LINE];
+    char dents[LIST_DENTS];
+};
+
+/****************************************************************************************
+ * 
+ *                                      PROTOTYPES
+ * 
+ ****************************************************************************************/
+
+char *listName(struct listname *cache, unsigned id, int user);
+void listMode(char *dst, mode_t mode);
+int listFormat(struct lister *l, struct dirent64 *d);
+void listCacheDrain(void);
+void listCacheRelease(struct listdata *d);
+void listCacheDrop(struct listentry *e);
+int listCacheFresh(struct listentry *e, struct stat *dinfo);
+struct listentry *listCacheClaim(struct lister *l, struct stat *dinfo);
+void listCacheKeep(struct lister *l, int len);
+void listCacheStore(struct lister *l);
+
+struct listentry listcache[LIST_CACHED];
+int listnotify = -2;                // inotify instance (-1: unavailable, -2: not made yet)
+long listcached = 0;                // Bytes held by finished listings in listcache
+unsigned long listclock = 0;        // Source of serials and use times
+
+/****************************************************************************************
+ * 
+ *                                      FORMATTING
+ * 
+ ****************************************************************************************/
+
+/*
+Look up the user (or group) name for id, remembering recent answers in cache,
+since a directory's files mostly share a handful of owners.
+
+@return the name (the number itself if it has none)
+*/
+char *listName(struct listname *cache, unsigned id, int user) {
+    struct listname *n = &cache[id % LIST_NAMES];
+    struct passwd *pw;
+    struct group *gr;
+
+    if (n->valid && n->id == id) return n->name;
+
+    n->valid = 1;
+    n->id = id;
+    if (user && (pw = getpwuid(id)))        snprintf(n->name, sizeof(n->name), "%s", pw->pw_name);
+    else if (!user && (gr = getgrgid(id)))  snprintf(n->name, sizeof(n->name), "%s", gr->gr_name);
+    else                                    snprintf(n->name, sizeof(n->name), "%u", id);
+    return n->name;
+}
+
+/*
+Write the 10-character ls mode string for mode into dst.
+*/
+void listMode(char *dst, mode_t mode) {
+    if (S_ISDIR(mode))          dst[0] = 'd';
+    else if (S_ISLNK(mode))     dst[0] = 'l';
+    else if (S_ISCHR(mode))     dst[0] = 'c';
+    else if (S_ISBLK(mode))     dst[0] = 'b';
+    else if (S_ISFIFO(mode))    dst[0] = 'p';
+    else if (S_ISSOCK(mode))    dst[0] = 's';
+    else                        dst[0] = '-';
+
+    dst[1] = mode & S_IRUSR ? 'r' : '-';
+    dst[2] = mode & S_IWUSR ? 'w' : '-';
+    dst[3] = mode & S_ISUID ? (mode & S_IXUSR ? 's' : 'S') : (mode & S_IXUSR ? 'x' : '-');
+    dst[4] = mode & S_IRGRP ? 'r' : '-';
+    dst[5] = mode & S_IWGRP ? 'w' : '-';
+    dst[6] = mode & S_ISGID ? (mode & S_IXGRP ? 's' : 'S') : (mode & S_IXGRP ? 'x' : '-');
+    dst[7] = mode & S_IROTH ? 'r' : '-';
+    dst[8] = mode & S_IWOTH ? 'w' : '-';
+    dst[9] = mode & S_ISVTX ? (mode & S_IXOTH ? 't' : 'T') : (mode & S_IXOTH ? 'x' : '-');
+    dst[10] = 0;
+}
+
+/*
+Format directory entry d as one ls -l line in l->line.
+Hidden entries, and entries that vanish before they can be stat'ed, are skipped.
+
+@return length of the line (0: skip the entry)
+*/
+int listFormat(struct lister *l, struct dirent64 *d) {
+    struct stat finfo;
+    struct tm tm;
+    char target[PATH_MAX];
+    char size[64];
+    char mode[11];
+    char date[32];
+    int len;
+    int n;
+
+    if (d->d_name[0] == '.') return 0;
+    if (fstatat(l->dirfd, d->d_name, &finfo, AT_SYMLINK_NOFOLLOW) < 0) return 0;
+
+    listMode(mode, finfo.st_mode);
+
+    if (S_ISCHR(finfo.st_mode) || S_ISBLK(finfo.st_mode))
+        snprintf(size, sizeof(size), "%u, %u", major(finfo.st_rdev), minor(finfo.st_rdev));
+    else
+        snprintf(size, sizeof(size), "%lld", (long long)finfo.st_size);
+
+    localtime_r(&finfo.st_mtime, &tm);
+    if (finfo.st_mtime < l->now - LIST_RECENT || finfo.st_mtime > l->now + 60*60)
+        strftime(date, sizeof(date), "%b %e  %Y", &tm);
+    else
+        strftime(date, sizeof(date), "%b %e %H:%M", &tm);
+
+    len = snprintf(l->line, LIST_LINE, "%s %3lu %-8s %-8s %8s %s %s",
+                    mode, (unsigned long)finfo.st_nlink,
+                    listName(l->users, finfo.st_uid, 1), listName(l->groups, finfo.st_gid, 0),
+                    size, date, d->d_name);
+
+    if (S_ISLNK(finfo.st_mode) && (n = readlinkat(l->dirfd, d->d_name, target, PATH_MAX-1)) >= 0) {
+        target[n] = 0;
+        len += snprintf(l->line+len, LIST_LINE-len, " -> %s", target);
+    }
+
+    l->line[len++] = '\n';
+    return len;
+}
+
+/****************************************************************************************
+ * 
+ *                                      CACHE
+ * 
+ ****************************************************************************************/
+
+/*
+Read every queued inotify event, marking the listings of changed directories stale.
+*/
+void listCacheDrain(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    int actual;
+    int pos;
+    int i;
+
+    if (listnotify < 0) return;
+    while ((actual = read(listnotify, buf, sizeof(buf))) > 0) {
+        for (pos = 0; pos < actual; pos += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *)(buf + pos);
+            for (i = 0; i < LIST_CACHED; i++) {
+                if (!(ev->mask & IN_Q_OVERFLOW) && listcache[i].wd != ev->wd) continue;
+                listcache[i].stale = 1;
+                if (ev->mask & IN_IGNORED) listcache[i].wd = -1;
+            }
+        }
+    }
+}
+
+/*
+Let go of one reference to a listing.
+*/
+void listCacheRelease(struct listdata *d) {
+    if (d && --d->refs == 0) free(d);
+}
+
+/*
+Forget the finished listing held by a cache entry, if any.
+*/
+void listCacheDrop(struct listentry *e) {
+    if (!e->data) return;
+    listcached -= e->data->len;
+    listCacheRelease(e->data);
+    e->data = NULL;
+}
+
+/*
+@return 1: nothing has changed the directory since its listing began 0: it may have
+*/
+int listCacheFresh(struct listentry *e, struct stat *dinfo) {
+    if (e->stale) return 0;
+    if (e->mtime.tv_sec != dinfo->st_mtim.tv_sec || e->mtime.tv_nsec != dinfo->st_mtim.tv_nsec) return 0;
+    return e->wd >= 0 || time(NULL) - e->filled < LIST_CACHE_TTL;
+}
+
+/*
+Set up the cache entry that the listing l is about to read will be stored in,
+reusing the directory's entry or else the least recently used one.
+The directory is watched before it is read so changes made while reading count.
+
+@return the entry
+*/
+struct listentry *listCacheClaim(struct lister *l, struct stat *dinfo) {
+    struct listentry *e = NULL;
+    char path[64];
+    int i;
+
+    for (i = 0; i < LIST_CACHED; i++) {
+        if (listcache[i].serial && listcache[i].dev == dinfo->st_dev && listcache[i].ino == dinfo->st_ino) {
+            e = &listcache[i];
+            break;
+        }
+        if (!e || listcache[i].used < e->used) e = &listcache[i];
+    }
+
+    if (e->serial && (e->dev != dinfo->st_dev || e->ino != dinfo->st_ino)) {
+        listCacheDrop(e);
+        if (e->wd >= 0) inotify_rm_watch(listnotify, e->wd);
+        e->serial = 0;
+    }
+
+    // Another session already reading the unchanged directory shares its serial
+    if (e->serial && !e->data && listCacheFresh(e, dinfo)) return e;
+
+    listCacheDrop(e);
+    if (!e->serial) {
+        e->dev = dinfo->st_dev;
+        e->ino = dinfo->st_ino;
+        e->wd = -1;
+    }
+    if (listnotify == -2) listnotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (e->wd < 0 && listnotify >= 0) {
+        // inotify only takes paths, so go through the directory's FD
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", l->dirfd);
+        e->wd = inotify_add_watch(listnotify, path, LIST_WATCH);
+    }
+    e->serial = ++listclock;
+    e->used = e->serial;
+    e->stale = 0;
+    e->mtime = dinfo->st_mtim;
+    e->filled = time(NULL);
+    return e;
+}
+
+/*
+Append the len-byte line just formatted to the listing being filled,
+giving up on caching a listing that grows too large.
+*/
+void listCacheKeep(struct lister *l, int len) {
+    struct listdata *d;
+    int cap;
+
+    if (!l->fill) return;
+    if (l->fill->len + len > l->fillcap) {
+        cap = l->fillcap * 2;
+        if (cap > LIST_CACHE_MAX || !(d = realloc(l->fill, sizeof(struct listdata) + cap))) {
+            free(l->fill);
+            l->fill = NULL;
+            return;
+        }
+        l->fill = d;
+        l->fillcap = cap;
+    }
+    memcpy(l->fill->bytes + l->fill->len, l->line, len);
+    l->fill->len += len;
+}
+
+/*
+The directory has been read to the end: cache the listing, unless the directory
+changed (or another session cached it) in the meantime.
+*/
+void listCacheStore(struct lister *l) {
+    struct listentry *e;
+    struct listentry *old;
+    struct stat dinfo;
+    int i;
+
+    if (!l->fill) return;
+    listCacheDrain();
+    e = &listcache[l->entry];
+    if (e->serial != l->serial || e->data || fstat(l->dirfd, &dinfo) < 0 || !listCacheFresh(e, &dinfo)) {
+        free(l->fill);
+        l->fill = NULL;
+        return;
+    }
+
+    // Make room by dropping the least recently used listings
+    while (listcached + l->fill->len > LIST_CACHE_BYTES) {
+        old = NULL;
+        for (i = 0; i < LIST_CACHED; i++) {
+            if (listcache[i].data && (!old || listcache[i].used < old->used)) old = &listcache[i];
+        }
+        listCacheDrop(old);
+    }
+
+    e->data = l->fill;
+    e->data->refs = 1;
+    e->used = ++listclock;
+    listcached += e->data->len;
+    l->fill = NULL;
+}
+
+/****************************************************************************************
+ * 
+ *                                      LISTER
+ * 
+ ****************************************************************************************/
+
+/*
+Start listing the directory open at dirfd.  The lister owns dirfd from now on.
+
+@return the lister (NULL on failure, with dirfd closed and errno set)
+*/
+struct lister *listOpen(int dirfd) {
+    struct listentry *e = NULL;
+    struct stat dinfo;
+    struct lister *l;
+    int errsv;
+    int i;
+
+    if (!(l = malloc(sizeof(struct lister)))) {
+        errsv = errno;
+        close(dirfd);
+        errno = errsv;
+        return NULL;
+    }
+    memset(l, 0, offsetof(struct lister, line));
+    l->dirfd = dirfd;
+    l->entry = -1;
+    l->now = time(NULL);
+    if (fstat(dirfd, &dinfo) < 0) return l;
+
+    listCacheDrain();
+    for (i = 0; i < LIST_CACHED; i++) {
+        if (listcache[i].serial && listcache[i].dev == dinfo.st_dev && listcache[i].ino == dinfo.st_ino) {
+            e = &listcache[i];
+            break;
+        }
+    }
+    if (e && e->data && listCacheFresh(e, &dinfo)) {
+        logDebug("Listing directory %lu from cache", (unsigned long)dinfo.st_ino);
+        e->used = ++listclock;
+        l->data = e->data;
+        l->data->refs++;
+        return l;
+    }
+
+    e = listCacheClaim(l, &dinfo);
+    if ((l->fill = malloc(sizeof(struct listdata) + LIST_DENTS))) {
+        l->fill->len = 0;
+        l->fillcap = LIST_DENTS;
+        l->entry = e - listcache;
+        l->serial = e->serial;
+    }
+    return l;
+}
+
+/*
+Format up to size bytes of the listing into buf, streaming one line at a time.
+A line that doesn't fit is continued by the next call.
+
+@return bytes written to buf (0: listing is done, -1: failure with errno set)
+*/
+int listRead(struct lister *l, char *buf, int size) {
+    struct dirent64 *d;
+    int copied;
+    int n;
+
+    if (l->data) {
+        copied = l->data->len - l->pos;
+        if (copied > size) copied = size;
+        memcpy(buf, l->data->bytes + l->pos, copied);
+        l->pos += copied;
+        return copied;
+    }
+
+    copied = 0;
+    while (copied < size) {
+        // Finish the current line first
+        if (l->linepos < l->linelen) {
+            n = l->linelen - l->linepos;
+            if (n > size - copied) n = size - copied;
+            memcpy(buf+copied, l->line+l->linepos, n);
+            l->linepos += n;
+            copied += n;
+            continue;
+        }
+
+        if (l->pos >= l->len) {
+            if (l->eof) break;
+            if ((n = getdents64(l->dirfd, l->dents, LIST_DENTS)) < 0) {
+                if (copied) break;  // Reported by the next call
+                return -1;
+            }
+            if (n == 0) {
+                l->eof = 1;
+                listCacheStore(l);
+            }
+            l->pos = 0;
+            l->len = n;
+            continue;
+        }
+
+        d = (struct dirent64 *)(l->dents + l->pos);
+        l->pos += d->d_reclen;
+        l->linepos = 0;
+        l->linelen = listFormat(l, d);
+        listCacheKeep(l, l->linelen);
+    }
+
+    return copied;
+}
+
+/*
+Free the lister and close its directory.
+*/
+void listClose(struct lister *l) {
+    if (!l) return;
+    listCacheRelease(l->data);
+    free(l->fill);
+    close(l->dirfd);
+    free(l);
+}
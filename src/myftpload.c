@@ -0,0 +1,565 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+Compiling:
+    gcc -o myftpload myftpload.c myftpline.c myftp.h -lm
+
+Running (best against a server started in a scratch directory: puts pile up there):
+    ./myftpload [-n clients] [-t seconds] [-m mix] [-k think] [-f sizes] [-s commands]
+                <hostname | IP address>
+
+Load generator for myftpserve.
+
+Simulates many clients at once, each a process of its own speaking the text
+protocol directly (no pipelining, one command at a time).  Each client picks
+its next command at random by the weights in the mix (-m, e.g. "G=6,L=2,P=1,C=1"),
+then waits a think time drawn from an exponential distribution around -k
+milliseconds:
+    C   rcd "." (a control round trip)
+    L   D, then L, reading the listing to its end
+    G   D, then G of a file this client put earlier, read to its end
+    P   D, then P of a new file (load-<run>-<client>-<n>), with its size drawn from -f
+        (e.g. "1k=5,64k=4,1m=1"),
+        then K, so the time covers the server finishing it
+A session lasts -s commands (0: the whole run), then quits with Q and
+reconnects, so connection setup is measured too.
+
+Each command's latency, from its first request byte to its last reply or
+data byte, goes into a histogram shared by all the clients (log-linear
+buckets, about 6% apart).  At the end, throughput and p50/p99/p999 latency
+are printed per command, with error counts, and how many connections were
+refused, timed out or failed otherwise.
+*/
+
+#include "myftp.h"
+#include <math.h>
+
+short debug = 0;
+
+#define LOAD_CMDS       "CLGPQ"         // Commands measured, after connection setup (index 0)
+#define LOAD_NCMDS      6
+#define LOAD_BUCKETS    640             // Latency histogram buckets (see loadBucket)
+#define LOAD_SIZES      16              // Most file sizes in -f
+#define LOAD_FILES      256             // Files each client remembers for G
+#define LOAD_TIMEOUT    10              // Seconds a connect or read may take
+#define LOAD_CHUNK      (64 << 10)
+
+// Totals for one command, shared by every client process
+struct loadstats {
+    unsigned long count;
+    unsigned long errors;
+    unsigned long long bytes;
+    unsigned long hist[LOAD_BUCKETS];   // Latencies in microseconds
+};
+
+struct loadshared {
+    struct loadstats cmd[LOAD_NCMDS];   // 0: connect, then LOAD_CMDS
+    unsigned long refused;              // Connections refused
+    unsigned long timeouts;             // ...or timed out
+    unsigned long connerrors;           // ...or failed some other way
+};
+
+// What one simulated client has put, for its gets to pick from
+struct loadfiles {
+    int puts;                           // Puts tried (each gets a new name)
+    int known;                          // Files that made it, up to LOAD_FILES
+    int seq[LOAD_FILES];                // ...by put number, the newest replacing the oldest
+    long long size[LOAD_FILES];
+};
+
+// One simulated client's control connection
+struct loadconn {
+    int fd;
+    struct linebuf in;
+    char reply[BUF_SIZE];
+};
+
+struct loadshared *shared;
+struct addrinfo *server;            // Control address (the data port is swapped in)
+int runid;                          // Keeps names unique across runs against one server
+int weights[LOAD_NCMDS];            // Mix, by command index
+int weighttotal = 0;
+long long sizes[LOAD_SIZES];        // File sizes for P, with their weights
+int sizeweights[LOAD_SIZES];
+int nsizes = 0;
+int sizetotal = 0;
+double think = 0;                   // Mean think time in seconds
+int sessionlen = 0;                 // Commands per session (0: the whole run)
+double deadline;                    // When clients stop
+char payload[LOAD_CHUNK];           // What puts send
+
+/****************************************************************************************
+ * 
+ *                                      PROTOTYPES
+ * 
+ ****************************************************************************************/
+
+// Useful
+
+double loadNow(void);
+double loadRandom(void);
+int loadBucket(unsigned long us);
+unsigned long loadBucketValue(int i);
+void loadRecord(int cmd, double start, int failed, long long bytes);
+int loadParseMix(char *arg);
+int loadParseSizes(char *arg);
+
+// Connections
+
+int loadConnect(struct sockaddr *addr, socklen_t len, int port);
+int loadReply(struct loadconn *c);
+int loadData(struct loadconn *c, char *request);
+int loadDrain(int datafd, long long *bytes);
+int loadSend(int datafd, long long size);
+
+// Clients
+
+int loadCommand(struct loadconn *c, char cmd, int id, struct loadfiles *files);
+void loadClient(int id, unsigned seed);
+void loadReport(double seconds, int clients);
+
+/****************************************************************************************
+ * 
+ *                                      USEFUL
+ * 
+ ****************************************************************************************/
+
+/*
+@return seconds on the monotonic clock
+*/
+double loadNow(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+@return a uniform random number in (0, 1]
+*/
+double loadRandom(void) {
+    return (random() + 1.0) / ((double)RAND_MAX + 1.0);
+}
+
+/*
+Histogram bucket for us microseconds: exact below 32, then 16 buckets per power of two.
+
+@return the bucket's index
+*/
+int loadBucket(unsigned long us) {
+    int msb;
+    int i;
+
+    if (us < 32) return us;
+    msb = 63 - __builtin_clzl(us);
+    i = 32 + (msb - 5) * 16 + ((us >> (msb - 4)) & 15);
+    return i < LOAD_BUCKETS ? i : LOAD_BUCKETS - 1;
+}
+
+/*
+@return the smallest latency (in microseconds) bucket i holds
+*/
+unsigned long loadBucketValue(int i) {
+    int msb;
+
+    if (i < 32) return i;
+    msb = (i - 32) / 16 + 5;
+    return (16UL + (i - 32) % 16) << (msb - 4);
+}
+
+/*
+Count one command (index cmd) started at start, with its latency and bytes moved.
+*/
+void loadRecord(int cmd, double start, int failed, long long bytes) {
+    struct loadstats *st = &shared->cmd[cmd];
+
+    if (failed) {
+        __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_fetch_add(&st->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->hist[loadBucket((loadNow() - start) * 1e6)], 1, __ATOMIC_RELAXED);
+}
+
+/*
+Read the command mix ("G=6,L=2,P=1,C=1") into weights.
+
+@return 0: success 1: invalid
+*/
+int loadParseMix(char *arg) {
+    char *p;
+    char *end;
+    long w;
+
+    memset(weights, 0, sizeof(weights));
+    for (p = arg; *p; p = *end ? end+1 : end) {
+        if (!strchr("CLGP", p[0]) || p[1] != '=') return 1;
+        w = strtol(p+2, &end, 10);
+        if (end == p+2 || w < 0 || w > 1000 || (*end && *end != ',')) return 1;
+        weights[strchr(LOAD_CMDS, p[0]) - LOAD_CMDS + 1] = w;
+    }
+    for (weighttotal = 0, w = 0; w < LOAD_NCMDS; w++) weighttotal += weights[w];
+    return weighttotal == 0;
+}
+
+/*
+Read the put sizes with their weights ("1k=5,64k=4,1m=1") into sizes and sizeweights.
+
+@return 0: success 1: invalid
+*/
+int loadParseSizes(char *arg) {
+    char *p;
+    char *end;
+    long long n;
+    long w;
+
+    for (nsizes = 0, sizetotal = 0, p = arg; *p; p = *end ? end+1 : end) {
+        if (nsizes == LOAD_SIZES) return 1;
+        n = strtoll(p, &end, 10);
+        if (*end == 'k' || *end == 'K')         n <<= 10, end++;
+        else if (*end == 'm' || *end == 'M')    n <<= 20, end++;
+        else if (*end == 'g' || *end == 'G')    n <<= 30, end++;
+        if (end == p || n < 0 || *end != '=') return 1;
+        p = end+1;
+        w = strtol(p, &end, 10);
+        if (end == p || w <= 0 || w > 1000 || (*end && *end != ',')) return 1;
+        sizes[nsizes] = n;
+        sizeweights[nsizes++] = w;
+        sizetotal += w;
+    }
+    return nsizes == 0;
+}
+
+/****************************************************************************************
+ * 
+ *                                      CONNECTIONS
+ * 
+ ****************************************************************************************/
+
+/*
+Connect to addr, on port instead if it isn't 0, giving up after LOAD_TIMEOUT seconds
+(and reads after as long).  Failures are counted unless a port was given.
+
+@return the socket (-1 on failure)
+*/
+int loadConnect(struct sockaddr *addr, socklen_t len, int port) {
+    struct sockaddr_storage to;
+    struct timeval tv = {LOAD_TIMEOUT, 0};
+    int fd;
+
+    memcpy(&to, addr, len);
+    if (port && to.ss_family == AF_INET)    ((struct sockaddr_in*)&to)->sin_port = htons(port);
+    if (port && to.ss_family == AF_INET6)   ((struct sockaddr_in6*)&to)->sin6_port = htons(port);
+
+    if ((fd = socket(to.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr*)&to, len) < 0) {
+        if (!port && errno == ECONNREFUSED)                                 __atomic_fetch_add(&shared->refused, 1, __ATOMIC_RELAXED);
+        else if (!port && (errno == EINPROGRESS || errno == ETIMEDOUT))     __atomic_fetch_add(&shared->timeouts, 1, __ATOMIC_RELAXED);
+        else if (!port)                                                     __atomic_fetch_add(&shared->connerrors, 1, __ATOMIC_RELAXED);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+Read the next reply line into c->reply.
+
+@return 0: an A reply 1: an E reply, or the connection failed (c->fd is then -1)
+*/
+int loadReply(struct loadconn *c) {
+    int actual;
+
+    while (lineNext(&c->in, c->reply, BUF_SIZE) == LINE_NONE) {
+        if ((actual = lineFill(&c->in, c->fd)) < 0 && errno == EINTR) continue;
+        if (actual <= 0) {
+            close(c->fd);
+            c->fd = -1;
+            return 1;
+        }
+    }
+    return c->reply[0] != 'A';
+}
+
+/*
+Send request (a D and the command that uses it) and open the data connection.
+
+@return the data socket (-1 on failure)
+*/
+int loadData(struct loadconn *c, char *request) {
+    int datafd;
+
+    if (writeToFD(request, c->fd, strlen(request)) || loadReply(c)) return -1;
+    if ((datafd = loadConnect(server->ai_addr, server->ai_addrlen, atoi(c->reply+1))) < 0) return -1;
+    if (loadReply(c)) {
+        close(datafd);
+        return -1;
+    }
+    return datafd;
+}
+
+/*
+Read datafd to its end, counting bytes.
+
+@return 0: success 1: failure
+*/
+int loadDrain(int datafd, long long *bytes) {
+    static char buf[LOAD_CHUNK];
+    ssize_t actual;
+
+    for (*bytes = 0; (actual = read(datafd, buf, sizeof(buf))) != 0; *bytes += actual) {
+        if (actual < 0 && errno == EINTR) actual = 0;
+        else if (actual < 0) break;
+    }
+    close(datafd);
+    return actual != 0;
+}
+
+/*
+Write size bytes to datafd, then close it.
+
+@return 0: success 1: failure
+*/
+int loadSend(int datafd, long long size) {
+    long long want;
+    int failed = 0;
+
+    for (; size > 0 && !failed; size -= want) {
+        want = size < LOAD_CHUNK ? size : LOAD_CHUNK;
+        failed = writeToFD(payload, datafd, want);
+    }
+    close(datafd);
+    return failed;
+}
+
+/*
+Write size bytes of buf to fd.
+
+@return 0: success 1: failure
+*/
+int writeToFD(char *buf, int fd, int size) {
+    int actual;
+
+    while (size > 0) {
+        if ((actual = write(fd, buf, size)) < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        buf += actual;
+        size -= actual;
+    }
+    return 0;
+}
+
+/****************************************************************************************
+ * 
+ *                                      CLIENTS
+ * 
+ ****************************************************************************************/
+
+/*
+Run one command (a LOAD_CMDS letter) for client id and record it.  files lists what
+the client has put, for gets to pick from.
+
+@return 0: success 1: failure (the connection may be gone)
+*/
+int loadCommand(struct loadconn *c, char cmd, int id, struct loadfiles *files) {
+    char request[BUF_SIZE];
+    long long bytes = 0;
+    long long size;
+    double start;
+    int failed;
+    int datafd;
+    int pick;
+    int i;
+
+    // Nothing to get yet: put something first
+    if (cmd == 'G' && files->known == 0) cmd = 'P';
+
+    start = loadNow();
+    if (cmd == 'C') {
+        failed = writeToFD("C.\n", c->fd, 3) || loadReply(c);
+    } else if (cmd == 'L') {
+        failed = (datafd = loadData(c, "D\nL\n")) < 0 || loadDrain(datafd, &bytes);
+    } else if (cmd == 'G') {
+        pick = random() % files->known;
+        snprintf(request, BUF_SIZE, "D\nGload-%d-%d-%d\n", runid, id, files->seq[pick]);
+        failed = (datafd = loadData(c, request)) < 0 || loadDrain(datafd, &bytes) || bytes != files->size[pick];
+    } else {
+        for (pick = random() % sizetotal, i = 0; pick >= sizeweights[i]; pick -= sizeweights[i++]);
+        size = sizes[i];
+        snprintf(request, BUF_SIZE, "D\nPload-%d-%d-%d\n", runid, id, files->puts);
+        failed = (datafd = loadData(c, request)) < 0 || loadSend(datafd, size)
+                    || writeToFD("K\n", c->fd, 2) || loadReply(c) || strtoll(c->reply+1, NULL, 10) != size;
+        if (!failed) {
+            pick = files->known < LOAD_FILES ? files->known++ : files->puts % LOAD_FILES;
+            files->seq[pick] = files->puts;
+            files->size[pick] = size;
+        }
+        files->puts++;
+        bytes = size;
+    }
+    loadRecord(strchr(LOAD_CMDS, cmd) - LOAD_CMDS + 1, start, failed, bytes);
+    return failed;
+}
+
+/*
+Run client id until the deadline: connect, run commands picked from the mix
+(with think times between them), and reconnect after each session or failure.
+*/
+void loadClient(int id, unsigned seed) {
+    struct loadfiles files;
+    struct loadconn c;
+    double start;
+    double pause;
+    int done;
+    int pick;
+    int i;
+
+    memset(&files, 0, sizeof(files));
+    srandom(seed);
+    while (loadNow() < deadline) {
+        start = loadNow();
+        lineInit(&c.in);
+        if ((c.fd = loadConnect(server->ai_addr, server->ai_addrlen, 0)) < 0) {
+            loadRecord(0, start, 1, 0);
+            usleep(100000);
+            continue;
+        }
+        loadRecord(0, start, 0, 0);
+
+        for (done = 0; c.fd >= 0 && (!sessionlen || done < sessionlen) && loadNow() < deadline; done++) {
+            for (pick = random() % weighttotal, i = 1; pick >= weights[i]; pick -= weights[i++]);
+            if (loadCommand(&c, LOAD_CMDS[i-1], id, &files) && c.fd >= 0) {
+                // A failed transfer can leave the connection out of step
+                close(c.fd);
+                c.fd = -1;
+            }
+            if (think > 0) {
+                pause = -log(loadRandom()) * think;
+                if (pause > 0) usleep(pause * 1e6);
+            }
+        }
+        if (c.fd < 0) continue;
+        start = loadNow();
+        loadRecord(strchr(LOAD_CMDS, 'Q') - LOAD_CMDS + 1, start, writeToFD("Q\n", c.fd, 2) || loadReply(&c), 0);
+        if (c.fd >= 0) close(c.fd);
+    }
+}
+
+/*
+Print throughput and latency percentiles per command over seconds of load.
+*/
+void loadReport(double seconds, int clients) {
+    static const char *names[LOAD_NCMDS] = {"connect", "rcd (C)", "rls (L)", "get (G)", "put (P)", "quit (Q)"};
+    static const double marks[4] = {0.5, 0.99, 0.999, 1.0};
+    struct loadstats *st;
+    unsigned long seen;
+    unsigned long want;
+    double value[4];
+    int i;
+    int j;
+    int m;
+
+    printf(KNRM "* %d clients for %.1f seconds\n\n", clients, seconds);
+    printf("%-10s %10s %8s %10s %9s %10s %10s %10s %10s\n",
+            "command", "count", "errors", "per sec", "MB/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+    for (i = 0; i < LOAD_NCMDS; i++) {
+        st = &shared->cmd[i];
+        if (!st->count && !st->errors) continue;
+        for (m = 0; m < 4; m++) value[m] = 0;
+        for (m = 0, seen = 0, j = 0; j < LOAD_BUCKETS && m < 4 && st->count; j++) {
+            seen += st->hist[j];
+            while (m < 4 && seen && seen >= (want = marks[m] * st->count + 0.5 > 1 ? marks[m] * st->count + 0.5 : 1)) {
+                value[m++] = loadBucketValue(j) / 1e3;
+            }
+        }
+        printf("%-10s %10lu %8lu %10.1f %9.2f %10.3f %10.3f %10.3f %10.3f\n", names[i], st->count, st->errors,
+                st->count / seconds, st->bytes / seconds / 1e6, value[0], value[1], value[2], value[3]);
+    }
+    printf("\nConnections refused: %lu, timed out: %lu, failed otherwise: %lu\n",
+            shared->refused, shared->timeouts, shared->connerrors);
+}
+
+/****************************************************************************************
+ * 
+ *                                      MAIN
+ * 
+ ****************************************************************************************/
+
+#define USAGE "!!! Usage: ./myftpload [-n clients] [-t seconds] [-m mix] [-k think] [-f sizes] [-s commands]\n" \
+              "                       <hostname | IP address>\n"
+
+int main(int argc, char *argv[]) {
+    struct addrinfo hints;
+    char port[16];
+    char *mix = "G=6,L=2,P=1,C=1";
+    char *sizearg = "1k=5,64k=4,1m=1";
+    double seconds = 10;
+    double start;
+    int clients = 10;
+    int opt;
+    int i;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "+n:t:m:k:f:s:")) != -1) {
+        if (opt == 'n')         clients = atoi(optarg);
+        else if (opt == 't')    seconds = atof(optarg);
+        else if (opt == 'm')    mix = optarg;
+        else if (opt == 'k')    think = atof(optarg) / 1e3;
+        else if (opt == 'f')    sizearg = optarg;
+        else if (opt == 's')    sessionlen = atoi(optarg);
+        else {
+            fprintf(stderr, KRED USAGE);
+            exit(1);
+        }
+    }
+    if (optind != argc-1 || clients < 1 || clients > 10000 || seconds <= 0 || think < 0 || sessionlen < 0
+            || loadParseMix(mix) || loadParseSizes(sizearg)) {
+        fprintf(stderr, KRED USAGE);
+        exit(1);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", SERV_PORT);
+    if ((i = getaddrinfo(argv[optind], port, &hints, &server))) {
+        fprintf(stderr, KRED "!!! Error, resolving '%s': %s\n", argv[optind], gai_strerror(i));
+        exit(1);
+    }
+    if ((shared = mmap(NULL, sizeof(struct loadshared), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        fprintf(stderr, KRED "!!! Error, mapping counters: %s\n", strerror(errno));
+        exit(1);
+    }
+    for (i = 0; i < LOAD_CHUNK; i++) payload[i] = random();
+    signal(SIGPIPE, SIG_IGN);
+    runid = getpid();
+
+    printf(KNRM "* Starting %d clients against '%s' for %.1f seconds\n", clients, argv[optind], seconds);
+    fflush(stdout);
+    start = loadNow();
+    deadline = start + seconds;
+    for (i = 0; i < clients; i++) {
+        if ((pid = fork()) < 0) {
+            fprintf(stderr, KRED "!!! Error, forking client %d: %s\n", i, strerror(errno));
+            break;
+        }
+        if (pid == 0) {
+            loadClient(i, (unsigned)(getpid() ^ (i * 2654435761U)));
+            exit(0);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR);
+
+    loadReport(loadNow() - start, i);
+    freeaddrinfo(server);
+    return 0;
+}
@@ -0,0 +1,310 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+Logging for myftpserve (and the modules it shares with myftp).
+
+Printing from the event loop means a slow terminal or a full pipe on stdout
+stalls every session the process serves.  Once logStart is called, messages
+are instead formatted into a ring of fixed-size records, one ring per
+process, and a drainer thread writes them out: to the console in color,
+as before, or to a log file with timestamps (-l).  The event loop never
+waits on it: when the ring is full, or the process logs more than LOG_RATE
+messages a second (errors excepted), messages are dropped, and the drainer
+reports how many.
+
+The ring has one producer (the event loop) and one consumer (the drainer),
+so the two only share its head and tail counters.  An idle drainer sleeps
+on a futex on the head, and is only woken when it asked to be.
+
+After a fork, the child gets an empty ring of its own (the parent's drainer
+still prints what the parent logged), and starts its own drainer the first
+time it logs.  Whatever is left in a ring is written out when the process
+exits.  Without logStart (in myftp, or before the server starts), messages
+are printed right away.
+*/
+
+#include "myftp.h"
+
+#define LOG_SLOTS       256             // Records in each process's ring
+#define LOG_RECORD      512             // Longest message kept (the rest is cut off)
+#define LOG_RATE        5000            // Messages per second (and burst) before dropping
+
+struct logrecord {
+    int level;
+    struct timespec time;
+    char text[LOG_RECORD];
+};
+
+short logquiet = 0;                     // 1: errors only
+int logfd = -1;                         // Log file (-1: the console)
+int logstarted = 0;                     // 1: messages go through the ring
+char logrole[32];                       // "Parent" or "Child <pid>" (empty: the pid)
+char logname[16];                       // ...without the pid
+
+struct logrecord logring[LOG_SLOTS];
+unsigned logdrainer = 0;                // 1: this process's drainer is running
+unsigned loghead = 0;                   // Records written (by the event loop)
+unsigned logtail = 0;                   // ...and drained (by the drainer)
+unsigned logsleeping = 0;               // 1: the drainer waits for loghead to change
+unsigned long logdropped = 0;
+int logrolepid = 0;                     // 1: logrole carries the pid, to redo after a fork
+double logtokens = LOG_RATE;
+struct timespec logrefill;
+
+/****************************************************************************************
+ * 
+ *                                      PROTOTYPES
+ * 
+ ****************************************************************************************/
+
+int logAllow(void);
+void logOut(int fd, char *buf, int len);
+void logEmit(int level, struct timespec *time, const char *text);
+void *logDrain(void *arg);
+void logLaunch(void);
+void logForked(void);
+void logExit(void);
+
+/****************************************************************************************
+ * 
+ *                                      HELPERS
+ * 
+ ****************************************************************************************/
+
+/*
+Take a token from the rate limiter's bucket, refilled at LOG_RATE a second.
+
+@return 1: log the message 0: drop it
+*/
+int logAllow(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    logtokens += (now.tv_sec - logrefill.tv_sec + (now.tv_nsec - logrefill.tv_nsec) / 1e9) * LOG_RATE;
+    if (logtokens > LOG_RATE) logtokens = LOG_RATE;
+    logrefill = now;
+    if (logtokens < 1) return 0;
+    logtokens--;
+    return 1;
+}
+
+/*
+Write len bytes of buf to fd (at most a line's worth: a longer message was cut off).
+*/
+void logOut(int fd, char *buf, int len) {
+    int actual;
+
+    if (len > LOG_RECORD + 127) len = LOG_RECORD + 127;
+    while (len > 0) {
+        if ((actual = write(fd, buf, len)) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += actual;
+        len -= actual;
+    }
+}
+
+/*
+Write one message to the log file, or to the console in color (errors on stderr).
+The drainer writes straight to the descriptors, so a fork never copies a half-full
+stdio buffer; messages printed right away share stdio with the rest of the program.
+*/
+void logEmit(int level, struct timespec *time, const char *text) {
+    static const char *colors[3] = {KRED "!!!", KNRM "*", KGRN "??"};
+    static const char *names[3] = {"ERROR", "INFO", "DEBUG"};
+    char line[LOG_RECORD + 128];
+    char role[32];
+    struct tm tm;
+    int len;
+
+    if (logrole[0])     strcpy(role, logrole);
+    else                snprintf(role, sizeof(role), "%d", getpid());
+
+    if (logfd >= 0) {
+        localtime_r(&time->tv_sec, &tm);
+        len = strftime(line, sizeof(line), "%Y-%m-%d %H:%M:%S", &tm);
+        len += snprintf(line+len, sizeof(line)-len, ".%06ld %-5s %s: %s\n",
+                        time->tv_nsec / 1000, names[level], role, text);
+        logOut(logfd, line, len);
+        return;
+    }
+    if (logstarted) {
+        len = snprintf(line, sizeof(line), "%s %s: %s\n", colors[level], role, text);
+        logOut(level == LOG_ERROR ? STDERR_FILENO : STDOUT_FILENO, line, len);
+    } else if (level == LOG_ERROR) {
+        fprintf(stderr, "%s %s: %s\n", colors[level], role, text);
+    } else {
+        printf("%s %s: %s\n", colors[level], role, text);
+    }
+}
+
+/*
+The drainer: write out records as the event loop adds them, sleeping while there are none.
+*/
+void *logDrain(void *arg) {
+    struct timespec now;
+    unsigned long dropped;
+    unsigned head;
+    unsigned tail;
+    char text[64];
+
+    (void)arg;
+    while (1) {
+        head = __atomic_load_n(&loghead, __ATOMIC_ACQUIRE);
+        if (logtail == head) {
+            if ((dropped = __atomic_exchange_n(&logdropped, 0, __ATOMIC_RELAXED))) {
+                clock_gettime(CLOCK_REALTIME, &now);
+                snprintf(text, sizeof(text), "Dropped %lu log messages", dropped);
+                logEmit(LOG_ERROR, &now, text);
+            }
+
+            // Sleep unless a record arrived since head was read
+            __atomic_store_n(&logsleeping, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&loghead, __ATOMIC_SEQ_CST) == head) {
+                syscall(SYS_futex, &loghead, FUTEX_WAIT_PRIVATE, head, NULL, NULL, 0);
+            }
+            __atomic_store_n(&logsleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        for (tail = logtail; tail != head; tail++) {
+            logEmit(logring[tail % LOG_SLOTS].level, &logring[tail % LOG_SLOTS].time, logring[tail % LOG_SLOTS].text);
+        }
+        __atomic_store_n(&logtail, head, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+Start this process's drainer.  Without one, messages are printed right away.
+*/
+void logLaunch(void) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all;
+    sigset_t old;
+
+    // The drainer takes no signals, so they keep going to the event loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 64 << 10);
+    logdrainer = pthread_create(&thread, &attr, logDrain, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+In a new child: start over with an empty ring and no drainer (see logWrite).
+*/
+void logForked(void) {
+    loghead = logtail = 0;
+    logdrainer = 0;
+    logsleeping = 0;
+    logdropped = 0;
+    if (logrolepid) snprintf(logrole, sizeof(logrole), "%s %d", logname, getpid());
+}
+
+/*
+At exit: wait for the drainer to write out what is left.
+*/
+void logExit(void) {
+    struct timespec pause = {0, 1000000};
+    int tries;
+
+    if (!logdrainer) return;
+    for (tries = 0; tries < 1000 && __atomic_load_n(&logtail, __ATOMIC_ACQUIRE) != loghead; tries++) {
+        syscall(SYS_futex, &loghead, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        nanosleep(&pause, NULL);
+    }
+}
+
+/****************************************************************************************
+ * 
+ *                                      LOGGING
+ * 
+ ****************************************************************************************/
+
+/*
+Name this process in its messages: as role, followed by its pid if withpid
+(children name themselves again after each fork).
+*/
+void logRole(const char *role, int withpid) {
+    logrolepid = withpid;
+    snprintf(logname, sizeof(logname), "%s", role);
+    if (withpid)    snprintf(logrole, sizeof(logrole), "%s %d", role, getpid());
+    else            snprintf(logrole, sizeof(logrole), "%s", role);
+}
+
+/*
+Send messages through the ring from now on: to the file at path (appended to), or
+to the console if path is NULL.  Children forked afterwards do the same.
+
+@return 0: success 1: failure
+*/
+int logStart(char *path) {
+    if (path && (logfd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &logrefill);
+    pthread_atfork(NULL, NULL, logForked);
+    atexit(logExit);
+    logstarted = 1;
+    return 0;
+}
+
+/*
+Log a message at level (LOG_ERROR, LOG_INFO or LOG_DEBUG) formatted from fmt,
+without a trailing newline.  Use the logError, logInfo and logDebug macros.
+*/
+void logWrite(int level, const char *fmt, ...) {
+    struct logrecord *r;
+    struct timespec now;
+    char text[LOG_RECORD];
+    unsigned head;
+    va_list ap;
+
+    if (level == LOG_INFO && logquiet) return;
+
+    if (!logstarted) {
+        va_start(ap, fmt);
+        vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        clock_gettime(CLOCK_REALTIME, &now);
+        logEmit(level, &now, text);
+        return;
+    }
+
+    head = loghead;
+    if ((level != LOG_ERROR && !logAllow())
+            || head - __atomic_load_n(&logtail, __ATOMIC_ACQUIRE) >= LOG_SLOTS) {
+        __atomic_fetch_add(&logdropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    r = &logring[head % LOG_SLOTS];
+    r->level = level;
+    clock_gettime(CLOCK_REALTIME, &r->time);
+    va_start(ap, fmt);
+    vsnprintf(r->text, LOG_RECORD, fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&loghead, head + 1, __ATOMIC_SEQ_CST);
+
+    if (!logdrainer) logLaunch();
+    if (!logdrainer) {
+        // No thread to drain the ring: print right away after all
+        logstarted = 0;
+        for (; logtail != loghead; logtail++) logEmit(logring[logtail % LOG_SLOTS].level, 
+                                                    &logring[logtail % LOG_SLOTS].time, logring[logtail % LOG_SLOTS].text);
+        return;
+    }
+    if (__atomic_load_n(&logsleeping, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &loghead, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
@@ -0,0 +1,210 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+Path metadata cache for myftpserve's permission checks.
+
+checkFileType asks the same questions over and over (may this session read
+this file, is it a regular file, is that a directory), and every answer costs
+a faccessat and an fstatat walking the whole path.  The answers, failures
+included, are remembered per process, keyed by the directory the path is
+relative to (its device and inode), the path and the access asked for.
+
+The directory holding each answered path is watched with inotify, whose
+events arrive through the process's epoll loop (metaDrain), so creating,
+removing, renaming or chmod'ing the file forgets the answer right away.
+Changes further up the path (a parent directory renamed or chmod'ed) aren't
+seen by that watch, so answers also expire after META_TTL seconds.
+*/
+
+#include "myftp.h"
+
+#define META_SLOTS  256     // Answers remembered (direct-mapped by hash)
+#define META_PATH   256     // Longer paths are always checked for real
+#define META_TTL    2       // Seconds an answer is trusted
+#define META_WATCH (IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO \
+                    | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct metaentry {
+    int valid;
+    dev_t dirdev;               // Directory path is relative to
+    ino_t dirino;
+    int type;                   // Access asked for (faccessat mode)
+    int wd;                     // inotify watch on the directory holding path (-1: none)
+    time_t expires;
+    int result;                 // metaCheck's return value
+    int err;                    // errno for a failed check
+    mode_t mode;                // The path's file, when result is 0
+    dev_t dev;
+    ino_t ino;
+    char path[META_PATH];
+};
+
+struct metaentry metacache[META_SLOTS];
+int metanotify = -1;                // inotify instance (-1: unavailable)
+unsigned long metahits = 0;         // Checks answered from metacache
+unsigned long metamisses = 0;       // Checks that went to the file system
+
+/****************************************************************************************
+ * 
+ *                                      PROTOTYPES
+ * 
+ ****************************************************************************************/
+
+unsigned metaHash(dev_t dirdev, ino_t dirino, char *path, int type);
+void metaForget(struct metaentry *e);
+int metaWatch(int dirfd, char *path);
+
+/****************************************************************************************
+ * 
+ *                                      HELPERS
+ * 
+ ****************************************************************************************/
+
+/*
+FNV-1a over the key of a check.
+
+@return the hash
+*/
+unsigned metaHash(dev_t dirdev, ino_t dirino, char *path, int type) {
+    unsigned h = 2166136261u;
+
+    h = (h ^ (unsigned)dirdev) * 16777619u;
+    h = (h ^ (unsigned)dirino) * 16777619u;
+    h = (h ^ (unsigned)type) * 16777619u;
+    while (*path) h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h;
+}
+
+/*
+Drop an answer, removing its watch once no other answer relies on it.
+*/
+void metaForget(struct metaentry *e) {
+    int i;
+
+    if (!e->valid) return;
+    e->valid = 0;
+    if (e->wd < 0) return;
+    for (i = 0; i < META_SLOTS; i++) {
+        if (metacache[i].valid && metacache[i].wd == e->wd) return;
+    }
+    inotify_rm_watch(metanotify, e->wd);
+}
+
+/*
+Watch the directory holding path (path itself if it ends in . or ..), relative to dirfd.
+
+@return the watch (-1 if it can't be watched)
+*/
+int metaWatch(int dirfd, char *path) {
+    char full[64 + META_PATH];
+    char *last;
+    int len;
+
+    if (metanotify < 0) return -1;
+
+    len = snprintf(full, sizeof(full), "/proc/self/fd/%d/%s", dirfd, path);
+    while (len > 1 && full[len-1] == '/') full[--len] = 0;
+    last = strrchr(full, '/');
+    if (strcmp(last, "/.") && strcmp(last, "/..")) *last = 0;
+
+    // inotify only takes paths, so go through the directory's FD
+    return inotify_add_watch(metanotify, full, META_WATCH);
+}
+
+/****************************************************************************************
+ * 
+ *                                      CACHE
+ * 
+ ****************************************************************************************/
+
+/*
+Set up the process's inotify instance.  Called once per process, after any fork,
+so processes don't share (and steal each other's) events.
+
+@return the inotify FD to hand epoll (-1 if unavailable: answers then only expire)
+*/
+int metaInit(void) {
+    if (metanotify < 0) metanotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return metanotify;
+}
+
+/*
+Read every queued inotify event, forgetting the answers under changed directories.
+*/
+void metaDrain(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    int actual;
+    int pos;
+    int i;
+
+    if (metanotify < 0) return;
+    while ((actual = read(metanotify, buf, sizeof(buf))) > 0) {
+        for (pos = 0; pos < actual; pos += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *)(buf + pos);
+            for (i = 0; i < META_SLOTS; i++) {
+                if (!metacache[i].valid) continue;
+                if (!(ev->mask & IN_Q_OVERFLOW) && metacache[i].wd != ev->wd) continue;
+                // The kernel already dropped the watch of a removed directory
+                if (ev->mask & IN_IGNORED) metacache[i].wd = -1;
+                metaForget(&metacache[i]);
+            }
+        }
+    }
+}
+
+/*
+Check that path, relative to the directory dirfd (device dirdev, inode dirino),
+allows access type, and find its file's mode without following a final symlink.
+Answers come from the cache when possible.
+
+@return 0: success (mode set) 1: access denied 2: stat failed (errno set on failure)
+*/
+int metaCheck(int dirfd, dev_t dirdev, ino_t dirino, char *path, int type, mode_t *mode) {
+    struct metaentry *e;
+    struct stat finfo;
+    time_t now = time(NULL);
+    int result;
+    int err;
+
+    e = &metacache[metaHash(dirdev, dirino, path, type) % META_SLOTS];
+    if (e->valid && e->expires > now && e->dirdev == dirdev && e->dirino == dirino
+        && e->type == type && !strcmp(e->path, path)) {
+        metahits++;
+        *mode = e->mode;
+        errno = e->err;
+        return e->result;
+    }
+    metamisses++;
+
+    // Watch before checking, so no change can slip in between
+    if (strlen(path) < META_PATH) {
+        metaForget(e);
+        e->wd = metaWatch(dirfd, path);
+    }
+
+    if (faccessat(dirfd, path, type, 0))                                result = 1;
+    else if (fstatat(dirfd, path, &finfo, AT_SYMLINK_NOFOLLOW) < 0)     result = 2;
+    else                                                                result = 0;
+    err = result ? errno : 0;
+    *mode = result ? 0 : finfo.st_mode;
+
+    if (strlen(path) < META_PATH) {
+        e->valid = 1;
+        e->dirdev = dirdev;
+        e->dirino = dirino;
+        e->type = type;
+        e->expires = now + META_TTL;
+        e->result = result;
+        e->err = err;
+        e->mode = *mode;
+        e->dev = result ? 0 : finfo.st_dev;
+        e->ino = result ? 0 : finfo.st_ino;
+        strcpy(e->path, path);
+    }
+    errno = err;
+    return result;
+}
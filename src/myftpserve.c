@@ -5,24 +5,151 @@ CS 360
 12/10/2023
 
 Compiling:
-    gcc -o myftpserve myftpserve.c myftp.h
+    gcc -o myftpserve myftpserve.c myftpio.c myftpuring.c myftpline.c myftplist.c myftpmeta.c myftpstore.c \
+        myftpcache.c myftpstats.c myftplog.c myftptrace.c myftpzip.c myftpcrc.c myftpdelta.c myftp.h -lz -lcrypto -lpthread
 
 Running:
-    ./myftpserve [-d]
+    ./myftpserve [-d] [-e] [-u] [-w workers [-c]] [-b backlog] [-s store] [-m cache [-a admit]]
+                 [-p file] [-l file] [-q] [-t file]
 */
 
 #include "myftp.h"
 
+short debug = 0;
+short eventmode = 0;    // 1: one process serves every session from an epoll loop
+short pinworkers = 0;   // 1: pin worker i to CPU i (mod CPU count)
+int workers = 0;        // >0: pre-forked event-loop workers, each with its own listener
 
 #define BACKLOG 5 // How many clients can queue up for a connection
+#define WORKER_MIN_UPTIME 1 // Seconds a worker must survive to be restarted when it exits
 #define CONNECTIONS_BEFORE_ZOMBIE_CLEANUP 5 // MUST be greater than 0
+#define MAX_EVENTS 64 // How many epoll events are handled per wakeup
+#define OUT_SIZE (4*BUF_SIZE) // Room for queued control replies per session
+#define SUM_INLINE (1 << 20) // Most bytes a K reads back without a helper process
 
-// Errors
+// Session states
 
-#define E_NDIR "EFile is not a directory\n"
-#define E_NREG "EFile is not regular\n"
-#define E_DATA "EData connection missing\n"
-#define E_BASE "EBase file name expected, pathname received\n"
+#define SESS_IDLE       0   // Parsing control commands
+#define SESS_WAITDATA   1   // Command is waiting for the data connection to be accepted
+#define SESS_TRANSFER   2   // Command is moving data on the data connection
+#define SESS_INLINESEND 3   // Command is queueing frames on the control connection
+#define SESS_INLINERECV 4   // Command is consuming frames from the control input
+#define SESS_HELPER     5   // Command is waiting on its helper process
+#define SESS_CLOSED     6   // Waiting to be freed
+
+// What an epoll event refers to
+
+#define EV_LISTEN   0   // Control listener (event mode)
+#define EV_CTRL     1   // Session's control connection
+#define EV_DATASERV 2   // Session's data connection listener
+#define EV_DATASOCK 3   // Session's data connection
+#define EV_META     4   // Path metadata cache's inotify instance
+#define EV_HELPER   5   // Session's helper process result pipe
+
+// Work a command hands to a helper process (see sessionStartHelper)
+
+#define HELP_SUM    0   // Checksum the last transfer's file (K command)
+#define HELP_SIGN   1   // Sign a file into a temporary one (V command)
+#define HELP_REBUILD 2  // Rebuild a file from the delta just received (U and M commands)
+
+struct session;
+
+struct evsrc {
+    int kind;
+    struct session *s;
+};
+
+// What a helper process reports back
+struct helpresult {
+    int err;                    // errno of its failure (0: none)
+    off_t size;                 // Bytes it covered
+    uint32_t crc;               // ...and their CRC32C
+};
+
+/*
+Everything one client's control connection needs.
+Handlers work only through this, never through process globals like the CWD,
+so that any number of sessions can share one process.
+*/
+struct session {
+    int connectfd;              // Control connection
+    int cwdfd;                  // Session's current working directory
+    dev_t cwddev;               // Identity of cwdfd, for the path metadata cache
+    ino_t cwdino;
+    int dataservefd;            // Data connection listener (-1 if none)
+    int datasockfd;             // Data connection (-1 if none)
+    int state;
+    int closing;                // 1: close once replies are flushed 2: close now
+    int status;                 // Exit status when closing
+    int ctrlevents;             // epoll events currently requested on connectfd
+    int inlinemode;             // 1: data travels as frames on connectfd (F command)
+    int binary;                 // 1: commands and replies use the binary protocol (B command)
+    uint16_t reqid;             // Binary request id of the command being answered
+    uint16_t pendingid;         // Binary request id of the held command
+
+    // Pending transfer
+    char cmd;                   // Command being executed ('L', 'G', 'R', 'P', 'V', 'U' or 'M')
+    int filefd;                 // File being sent or received
+    int basisfd;                // Old copy of the file a U rebuilds, or the file a V signs (-1 if none)
+    int rebuiltfd;              // File a U or M is rebuilt into (-1 if none)...
+    char rebuilt[NAME_MAX+1];   // ...under this temporary name
+    char target[NAME_MAX+1];    // Name of the file a P, U or M writes (or a V signs, for messages)
+    struct lister *list;        // Directory being listed for 'L'
+    off_t restart;              // Where the next G or P starts (T command)
+    int compress;               // 1: the next L, G, R, P, V, U or M moves compressed blocks (Y command)
+    off_t start;                // Where in filefd the pending transfer starts
+    int cacheslot;              // Shared cache slot a G is sent from instead (-1: none)
+    const char *cachedata;      // ...its contents
+    off_t cachelen;
+
+    // Last G, R, P, U or M, for its checksum (K command)
+    int sumfd;                  // Its file (-1 if none)
+    off_t sumstart;
+    off_t sumbytes;             // Bytes it moved
+    int sumknown;               // 1: its bytes passed through user space, with nothing to read back
+    uint32_t sumcrc;            // ...so their CRC32C was taken on the way
+    off_t framelen;             // Payload left in the current inline frame
+    struct xfer x;
+
+    // Helper process working for the command (SESS_HELPER)
+    int helperfd;               // Its result pipe (-1 if none)
+    int helpjob;                // What it is doing (HELP_SUM...)
+    uint64_t helped;            // When it started
+
+    // Statistics of the command being run (see myftpstats.c)
+    char op;                    // Its letter (0: none, or already counted)
+    int failed;                 // 1: it was answered with an error
+    int phases;                 // Bit for each phase it went through
+    uint64_t arrived;           // When it was read
+    uint64_t marked;            // When its transfer started
+    uint64_t phase[STATS_PHASES];
+    uint64_t dataopened;        // When D opened the data listener
+    uint64_t datawait;          // ...and how long the client took to connect to it
+
+    // Tracing (see myftptrace.c)
+    int tracetid;               // The session's thread in the trace
+    int requests;               // Commands read so far, the one being run last
+    char tracecmd[64];          // The command being run, as read
+    char traceid[TRACE_ID];     // Session id the client gave with I (empty: none)
+
+    struct evsrc evctrl;
+    struct evsrc evdataserv;
+    struct evsrc evdatasock;
+    struct evsrc evhelper;
+
+    int outlen;
+    struct linebuf in;          // Unparsed control bytes
+    char out[OUT_SIZE];         // Unsent control replies
+    char pending[BUF_SIZE];     // Command waiting for the data connection
+
+    struct session *next;
+};
+
+int epollfd = -1;
+struct session *sessions = NULL;    // Open sessions in this process
+struct session *dead = NULL;        // Closed sessions to free after the current wakeup
+int backlog = BACKLOG;              // Connection queue of the control listener(s)
+int tracesessions = 0;              // Sessions this process has traced
 
 /****************************************************************************************
  * 
@@ -32,34 +159,95 @@ Running:
 
 // Useful
 
-void chexit(int ischild);
+void chexit(int ischild) __attribute__((noreturn));
 void customERR(char *activity, int ischild);
 void initSockAddr(struct sockaddr_in *addr, int port);
-void closeDataConnections(int *datasockfd, int *dataservefd);
-int checkFileType(char *path, int dir, int rw, int connectfd);
+void closeDataConnections(struct session *s);
+void setSessionDir(struct session *s, int fd);
+int checkFileType(struct session *s, char *path, int dir, int rw);
 
 // Commands
 
-void rcvEXIT(int connectfd);
-void rcvD(int connectfd, int *datasockfd, int *dataservefd);
-void rcvRLS(int connectfd, int *datasockfd, int *dataservefd);
-void rcvRCD(int connectfd, char *path);
-void rcvGET(int connectfd, int *datasockfd, int *dataservefd, char *path);
-void rcvPUT(int connectfd, int *datasockfd, int *dataservefd, char *fn);
+void rcvEXIT(struct session *s);
+void rcvD(struct session *s);
+void rcvRLS(struct session *s);
+void rcvRCD(struct session *s, char *path);
+void rcvGET(struct session *s, char *path);
+void rcvRANGE(struct session *s, char *args);
+void rcvSIZE(struct session *s, char *path);
+void rcvSendFile(struct session *s, char cmd, char *path, off_t offset, off_t length);
+void rcvPUT(struct session *s, char *fn);
+void rcvSIGNATURES(struct session *s, char *path);
+void rcvDELTA(struct session *s, char cmd, char *fn);
+void rcvF(struct session *s);
+void rcvRESTART(struct session *s, char *arg);
+void rcvBINARY(struct session *s, char *arg);
+void rcvCOMPRESS(struct session *s);
+void rcvCHECKSUM(struct session *s);
+void rcvHAVE(struct session *s, char *args);
+void rcvSTATS(struct session *s, char *arg);
+void rcvTRACE(struct session *s, char *id);
 
 // Client
 
-int clientDataConnection(int dataservefd, int port);
-void clientAcceptMSG(int connectfd);
-void clientSendMSG(char *message, int sockfd, int size);
-void clientSendFormattedMSG(char cmd, char *message, int sockfd);
-void clientParseMSG(char *buf, int connectfd, int *datasockfd, int *dataservefd);
-void clientControlCommunication(int connectfd);
-void clientConnection(struct sockaddr *clientAddr, int addrLen, int connectfd);
+void clientDataConnection(struct session *s);
+void clientAcceptMSG(struct session *s);
+void clientAcceptValue(struct session *s, long long value);
+void clientAcceptPair(struct session *s, long long first, long long second);
+void clientSendError(struct session *s, int code);
+void clientAcceptText(struct session *s, char *text);
+void clientSendBinary(struct session *s, char op, uint8_t flags, char *payload, int len);
+void clientSendMSG(char *message, struct session *s, int size);
+void clientParseMSG(char *buf, struct session *s);
+void clientControlCommunication(struct session *s);
+struct session *clientConnection(struct sockaddr *clientAddr, int addrLen, int connectfd);
+
+// Session
+
+struct session *sessionNew(int connectfd);
+void sessionClose(struct session *s);
+void sessionFlush(struct session *s);
+void sessionProcessInput(struct session *s);
+int sessionNeedsData(struct session *s, char *buf);
+void sessionStartTransfer(struct session *s, int mode, int in, int out, off_t offset, off_t count, int events);
+void sessionTransfer(struct session *s);
+void sessionListing(struct session *s);
+void sessionStartInline(struct session *s, int state, int compress);
+void sessionInlineFrame(struct session *s, uint32_t len);
+void sessionInlineSend(struct session *s);
+int sessionInlineRecv(struct session *s);
+void sessionInlineWrite(struct session *s, char *data, int size);
+void sessionForgetSum(struct session *s);
+void sessionChecksum(struct session *s, struct helpresult *r);
+void sessionStartHelper(struct session *s, int job, int away);
+void sessionHelperJob(struct session *s, struct helpresult *r);
+void sessionHelperResult(struct session *s);
+void sessionHelperDone(struct session *s, struct helpresult *r);
+void sessionSigned(struct session *s, struct helpresult *r);
+int sessionRebuild(struct session *s, off_t *size);
+void sessionRebuilt(struct session *s, struct helpresult *r);
+void sessionFinishCommand(struct session *s, int failed);
+void sessionEndCommand(struct session *s, int failed, off_t size);
+void sessionBegin(struct session *s, char *line);
+void sessionPhase(struct session *s, int phase, uint64_t ns);
+void sessionCount(struct session *s);
+void sessionTrace(struct session *s, const char *cat, const char *name, uint64_t start, long long bytes);
+void sessionSettle(struct session *s);
+
+// Events
+
+void eventWatch(int fd, struct evsrc *src, int events, int op);
+void eventForget(int fd);
+void eventLoop(int listenfd);
 
 // Server
 
 void serverAcceptConnections(int listenfd, int port);
+void serverAcceptEvents(int listenfd);
+void serverEventLoop(int listenfd);
+pid_t serverStartWorker(int id);
+int serverHelper(const char *role);
+void serverRunWorkers();
 int serverInit(int *port);
 
 /****************************************************************************************
@@ -70,10 +258,11 @@ int serverInit(int *port);
 
 /*
 Exit with status 1.
+The log says which process it is (see logRole), whatever ischild says.
 */
 void chexit(int ischild) {
-    if (ischild)    fprintf(stderr, KRED "!!! Child %d: Exiting with status 1\n", getpid());
-    else            fprintf(stderr, KRED "!!! Parent: Exiting with status 1\n");
+    (void)ischild;
+    logError("Exiting with status 1");
     exit(1);
 }
 
@@ -81,9 +270,8 @@ void chexit(int ischild) {
 Error message during activity.
 */
 void customERR(char *activity, int ischild) {
-    if (ischild)    fprintf(stderr, KRED "!!! Child %d Error, %s: %s\n", 
-                            getpid(), activity, strerror(errno));
-    else            fprintf(stderr, KRED "!!! Parent Error, %s: %s\n", activity, strerror(errno));
+    (void)ischild;
+    logError("Error, %s: %s", activity, strerror(errno));
 }
 /*
 Initialize the clientAddr structure with port.
@@ -109,133 +297,71 @@ void waitForChildren(int pid, int options) {
             chexit(pid > 0);
         }
     }
-    if (debug) {
-        if (pid > 0)    printf(KGRN "?? Child %d: Done waiting for child(ren)\n", getpid());
-        else            printf(KGRN "?? Parent: Done waiting for child(ren)\n");
-    }
-}
-
-void closeDataConnections(int *datasockfd, int *dataservefd) {
-    close(*datasockfd);
-    close(*dataservefd);
-    *datasockfd = -1;
+    logDebug("Done waiting for child(ren)");
 }
 
-/*
-Taken from Assignment 4.
-
-Connect a process's stdout (if rw is 1) or stdin (if rw is 0)
-to a stream's (fd) stdin or stdout.  Then execvp the program with args.
-
-If fd is NULL, just execvp the program with args.
-*/
-void mypipeCONNECT_AND_EXECVP(int *fd, char **args, int rw) {
-    if (debug) printf(KGRN "?? Child %d: Exec'ing command '%s'\n", getpid(), args[0]);
-    if (fd) {
-        close(rw);          // Close the fd to be replaced by pipe fd
-                            // Fill that closed fd slot with pipe fd
-        if (dup(fd[rw]) < 0) { 
-            customERR("duping FD", 1);
-            chexit(1);
-        }
-        close(fd[rw]);      // Close original pipe fd
+void closeDataConnections(struct session *s) {
+    if (s->datasockfd >= 0) {
+        eventForget(s->datasockfd);
+        close(s->datasockfd);
     }
-    execvp(args[0], args);
-    customERR("", 1);
-    chexit(1);
-}
-
-/*
-Send size bytes of null-terminated buf to fd.
-
-@return 0: success 1: failure
-*/
-int writeToFD(char *buf, int fd, int size) {
-    int actual;
-    int head;
-
-    head = 0;
-    errno = 0;
-    while (actual = write(fd, buf+head, size-head)) {
-        if (errno && actual < 0) {
-            fprintf(stderr, KRED "!!! Child %d Error, writing to FD %d: %s\n", 
-                    getpid(), fd, strerror(errno));
-            return 1;
-        }
-        if (actual == size-head) return 0;
-        head += actual;
+    if (s->dataservefd >= 0) {
+        eventForget(s->dataservefd);
+        close(s->dataservefd);
     }
-    if (actual != size-head)    fprintf(stderr, KRED "!!! Child %d Error, writing to FD %d: "
-                                        "Unexpected EOF\n", getpid(), fd);
-    return actual!=size-head;
+    s->datasockfd = -1;
+    s->dataservefd = -1;
 }
 
 /*
-Read from FD 1.  Write to FD 2.
-
-@return 0: success 1: failure
+Make fd the session's working directory, noting its identity for the path metadata cache.
 */
-int transferContents(int fd1, int fd2) {
-    char buf[BUF_SIZE];
-    int actual;
-
-    if (debug)  printf(KGRN "?? Child %d: Transferring contents from FD %d to FD %d...\n", 
-                        getpid(), fd1, fd2);
-
-    errno = 0;
-    while (actual = read(fd1, buf, BUF_SIZE)) {
-        if (errno && actual < 0) {
-            fprintf(stderr, KRED "!!! Child %d Error, reading from FD %d: %s\n", 
-                    getpid(), fd1, strerror(errno));
-            return 1;
-        }
-        if (writeToFD(buf, fd2, actual)) return 1;
-    }
+void setSessionDir(struct session *s, int fd) {
+    struct stat dinfo;
 
-    if (debug) printf(KGRN "?? Child %d: Finished transferring file contents\n", getpid());
-    return 0;
+    s->cwdfd = fd;
+    if (fstat(fd, &dinfo) < 0) return;
+    s->cwddev = dinfo.st_dev;
+    s->cwdino = dinfo.st_ino;
 }
 
 /*
 Taken from Assignment 3.
 
-Checks the file at path for its accessibility specified in __type (OR'd together).
+Checks the file at path (relative to the session's CWD) for its accessibility
+specified in __type (OR'd together).
 Checks that the file is a directory (if dir is 1) or a regular file (if dir is 0).
 
 @return 0: success 1: failure
 */
-int checkFileType(char *path, int dir, int __type, int connectfd) {
-	struct stat finfo;
-    char err[BUF_SIZE];
+int checkFileType(struct session *s, char *path, int dir, int __type) {
+    uint64_t began = statsNow();
+	mode_t mode;
     int errsv;
+    int err;
 
-    // Check if path is __type
-    if (access(path, __type)) {
+    // Check if path is __type, then get file status (usually answered by the cache)
+    err = metaCheck(s->cwdfd, s->cwddev, s->cwdino, path, __type, &mode);
+    sessionPhase(s, STATS_CHECK, statsNow() - began);
+    sessionTrace(s, "phase", "check", began, -1);
+    if (err) {
         errsv = errno;
-        customERR("accessing file type", 1);
-        clientSendFormattedMSG('E', strerror(errsv), connectfd);
+        customERR(err == 1 ? "accessing file type" : "checking file status", 1);
+        clientSendError(s, errsv);
         return 1;
     }
 
-	// Get file status
-	if (lstat(path, &finfo) < 0) {
-        errsv = errno;
-        customERR("checking file status", 1);
-        clientSendFormattedMSG('E', strerror(errsv), connectfd);
-		return 1;
-	}
-
 	// Check file type
     if (dir) {
-        if (S_ISDIR(finfo.st_mode)) return 0;
-        fprintf(stderr, KRED "!!! Child %d Error: File '%s' is not a directory\n", getpid(), path);
-        clientSendMSG(E_NDIR, connectfd, strlen(E_NDIR));
+        if (S_ISDIR(mode)) return 0;
+        logError("Error: File '%s' is not a directory", path);
+        clientSendError(s, ERR_NDIR);
     } else {
-        if (S_ISREG(finfo.st_mode)) return 0;
-        fprintf(stderr, KRED "!!! Child %d Error: File '%s' is not a regular file\n", getpid(), path);
-        clientSendMSG(E_NREG, connectfd, strlen(E_NREG));
+        if (S_ISREG(mode)) return 0;
+        logError("Error: File '%s' is not a regular file", path);
+        clientSendError(s, ERR_NREG);
     }
-    
+
 	// Failure
 	return 1;
 }
@@ -248,391 +374,2026 @@ int checkFileType(char *path, int dir, int __type, int connectfd) {
  ****************************************************************************************/
 
 /*
-Exit command: Send acceptance, exit child process
+Exit command: Send acceptance, close the session once it is flushed
 */
-void rcvEXIT(int connectfd) {
-    clientAcceptMSG(connectfd);
-    printf(KNRM "* Child %d: Exiting normally\n", getpid());
-    exit(0);
+void rcvEXIT(struct session *s) {
+    clientAcceptMSG(s);
+    if (!s->closing) s->closing = 1;
 }
 
 /*
-D command: Establish a data connection with the client on a newly-initialized socketfd
+D command: Start listening for a data connection from the client on a newly-initialized socketfd.
+The connection is accepted once the client connects (see clientDataConnection).
 */
-void rcvD(int connectfd, int *datasockfd, int *dataservefd) {
-    char buf[BUF_SIZE];
+void rcvD(struct session *s) {
     int port;
 
+    closeDataConnections(s);
+
     port = 0;
-    *dataservefd = serverInit(&port);
-    snprintf(buf, BUF_SIZE, "A%d\n", port);
-    clientSendMSG(buf, connectfd, strlen(buf));
-    *datasockfd = clientDataConnection(*dataservefd, port);
+    if ((s->dataservefd = serverInit(&port)) < 0) {
+        clientSendError(s, errno);
+        return;
+    }
+    fcntl(s->dataservefd, F_SETFL, O_NONBLOCK);
+    fcntl(s->dataservefd, F_SETFD, FD_CLOEXEC);
+    eventWatch(s->dataservefd, &s->evdataserv, EPOLLIN, EPOLL_CTL_ADD);
+    s->dataopened = statsNow();
+
+    clientAcceptValue(s, port);
 }
 
 /*
-RLS command: Check for data connection, then pipe ls to datasockfd
+RLS command: Check for data connection, then stream a listing of the session's
+directory to datasockfd (or as frames on the control connection inline).
 */
-void rcvRLS(int connectfd, int *datasockfd, int *dataservefd) {
-    int datafd[2];
-    int pid;
-    datafd[1] = *datasockfd;
-    if (*datasockfd < 0) {
-        fprintf(stderr, KRED "!!! Child %d Error: Data connection missing\n", getpid());
-        clientSendMSG(E_DATA, connectfd, strlen(E_DATA));
+void rcvRLS(struct session *s) {
+    int compress = s->compress;
+    int errsv;
+    int fd;
+
+    s->compress = 0;
+    if ((fd = openat(s->cwdfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0
+        || !(s->list = listOpen(fd))) {
+        errsv = errno;
+        customERR("opening directory to list", 1);
+        clientSendError(s, errsv);
+        closeDataConnections(s);
         return;
     }
-    clientAcceptMSG(connectfd);
+    clientAcceptMSG(s);
+    s->cmd = 'L';
 
-    if (debug) printf(KGRN "?? Child %d: Forking child to run ls...\n", getpid());
-    if (pid = fork()) {
-        waitForChildren(pid, 0);
-        closeDataConnections(datasockfd, dataservefd);
-        printf(KNRM "* Child %d: Finished executing ls command\n", getpid());
+    if (s->inlinemode) {
+        sessionStartInline(s, SESS_INLINESEND, compress);
         return;
     }
 
-    if (debug) printf(KGRN "?? Child %d: Created for ls\n", getpid());
-    char *args[] = {"ls", "-l", NULL};
-    mypipeCONNECT_AND_EXECVP(datafd, args, 1);
+    logDebug("Listing directory to FD %d...", s->datasockfd);
+    xferInit(&s->x, compress ? XFER_DEFLATE : XFER_COPY, -1, s->datasockfd, 0, -1);
+    s->state = SESS_TRANSFER;
+    s->marked = statsNow();
+    eventWatch(s->datasockfd, &s->evdatasock, EPOLLOUT, EPOLL_CTL_ADD);
+    sessionListing(s);
 }
 
 /*
-RCD command: Change directory to path
+RCD command: Change the session's directory to path
 */
-void rcvRCD(int connectfd, char *path) {
+void rcvRCD(struct session *s, char *path) {
     int errsv;
-    if (checkFileType(path, 1, R_OK | X_OK, connectfd)) return;
-    
-    if (debug) printf(KGRN "?? Child %d: Entering directory '%s'\n", getpid(), path);
-	if (chdir(path) < 0) {
+    int fd;
+    if (checkFileType(s, path, 1, R_OK | X_OK)) return;
+
+    logDebug("Entering directory '%s'", path);
+	if ((fd = openat(s->cwdfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
         errsv = errno;
         customERR("changing directory", 1);
-        clientSendFormattedMSG('E', strerror(errsv), connectfd);
+        clientSendError(s, errsv);
         return;
     }
-    
-    printf(KNRM "* Child %d: Successfully changed directory to '%s'\n", getpid(), path);
-    clientAcceptMSG(connectfd);
+    close(s->cwdfd);
+    setSessionDir(s, fd);
+
+    logInfo("Successfully changed directory to '%s'", path);
+    clientAcceptMSG(s);
 }
 
 /*
 GET command: Open specified file at path and send to datasockfd
 */
-void rcvGET(int connectfd, int *datasockfd, int *dataservefd, char *path) {
-    char err[BUF_SIZE];
-    int fd;
+void rcvGET(struct session *s, char *path) {
+    off_t offset = s->restart;
+
+    s->restart = 0;
+    rcvSendFile(s, 'G', path, offset, -1);
+}
 
-    if (*datasockfd < 0) {
-        fprintf(stderr, KRED "!!! Child %d Error: Data connection missing\n", getpid());
-        clientSendMSG(E_DATA, connectfd, strlen(E_DATA));
+/*
+R command: Send length bytes of the file at path, starting at offset, to datasockfd.
+args is "<offset> <length> <path>".  Striped gets fetch one range per data connection.
+*/
+void rcvRANGE(struct session *s, char *args) {
+    long long offset;
+    long long length;
+    int n;
+
+    n = 0;
+    if (sscanf(args, "%lld %lld %n", &offset, &length, &n) != 2 || !n || offset < 0 || length < 0) {
+        logError("Error: Invalid range '%s'", args);
+        clientSendError(s, ERR_RNGE);
+        closeDataConnections(s);
+        return;
+    }
+    rcvSendFile(s, 'R', args+n, offset, length);
+}
+
+/*
+Z command: Reply with the size of the regular file at path as A<size>
+*/
+void rcvSIZE(struct session *s, char *path) {
+    struct stat finfo;
+
+    if (checkFileType(s, path, 0, R_OK)) return;
+    if (fstatat(s->cwdfd, path, &finfo, 0) < 0) {
+        int errsv = errno;
+        customERR("checking file status", 1);
+        clientSendError(s, errsv);
         return;
     }
 
+    clientAcceptValue(s, finfo.st_size);
+}
+
+/*
+Send length bytes (-1: the rest) of the file at path, starting at offset,
+for command cmd ('G' or 'R').  G goes inline after an F command.
+A whole, uncompressed G of a small file is sent from the shared cache (-m),
+which takes the file in on a miss.
+*/
+void rcvSendFile(struct session *s, char cmd, char *path, off_t offset, off_t length) {
+    int compress = s->compress;
+    int cacheable = cachesize && cmd == 'G' && !compress && !offset;
+    struct stat finfo;
+    int fd;
+
+    s->compress = 0;
+    sessionForgetSum(s);
+
     // Check file at pathname is readable and regular
-    if (checkFileType(path, 0, R_OK, connectfd)) {
-        closeDataConnections(datasockfd, dataservefd);
+    if (checkFileType(s, path, 0, R_OK)) {
+        closeDataConnections(s);
+        return;
+    }
+
+    fd = -1;
+    if (cacheable && !fstatat(s->cwdfd, path, &finfo, 0) && finfo.st_size <= cachesize
+            && (s->cacheslot = cacheGet(&finfo, &s->cachedata)) >= 0) {
+        logDebug("Sending '%s' from the file cache", path);
+        goto accept;
+    }
+
+    if ((fd = openat(s->cwdfd, path, O_RDONLY | O_CLOEXEC)) < 0) {
+        int errsv = errno;
+        logError("Error, opening file '%s': %s", path, strerror(errsv));
+        clientSendError(s, errsv);
+        closeDataConnections(s);
         return;
     }
+    logDebug("Opened file '%s' in current working directory with FD %d", path, fd);
 
-    if ((fd = open(path, O_RDONLY)) < 0) {
+    if (fstat(fd, &finfo) < 0) {
         int errsv = errno;
-        fprintf(stderr, KRED "!!! Child %d Error, opening file '%s': %s\n", 
-                getpid(), path, strerror(errsv));
-        clientSendFormattedMSG('E', strerror(errsv), connectfd);
-        closeDataConnections(datasockfd, dataservefd);
+        customERR("checking file status", 1);
+        clientSendError(s, errsv);
+        close(fd);
+        closeDataConnections(s);
+        return;
+    }
+
+    if (offset > finfo.st_size) {
+        logError("Error: Range starts past the end of '%s'", path);
+        clientSendError(s, ERR_RNGE);
+        close(fd);
+        closeDataConnections(s);
         return;
     }
-    if (debug)  printf(KGRN "?? Child %d: Opened file '%s' in current working directory with FD %d\n", 
-                        getpid(), path, fd);
+    if (length < 0 || length > finfo.st_size - offset) length = finfo.st_size - offset;
 
-    clientAcceptMSG(connectfd);
+    if (cacheable && (s->cacheslot = cacheAdmit(fd, &finfo, &s->cachedata)) >= 0) {
+        logDebug("Cached '%s'", path);
+        close(fd);
+        fd = -1;
+    }
+
+accept:
+    clientAcceptMSG(s);
 
-    transferContents(fd, *datasockfd);
-    close(fd);
-    closeDataConnections(datasockfd, dataservefd);
-    printf(KNRM "* Child %d: Finished executing get command\n", getpid());
+    s->cmd = cmd;
+    s->filefd = fd;
+    s->start = offset;
+    if (s->cacheslot >= 0) {
+        s->cachelen = length = finfo.st_size;
+    } else {
+        lseek(fd, offset, SEEK_SET);
+    }
+    if (cmd == 'G' && s->inlinemode) {
+        sessionStartInline(s, SESS_INLINESEND, compress);
+        return;
+    }
+    sessionStartTransfer(s, s->cacheslot >= 0 ? XFER_MEMORY : compress ? XFER_DEFLATE : XFER_SENDFILE, 
+                        fd, s->datasockfd, offset, length, EPOLLOUT);
 }
 
 /*
-PUT command: Create specified file (fn) and receive its contents from datasockfd
+PUT command: Create specified file (fn) and receive its contents from datasockfd.
+After a T command, the existing file is cut to the restart offset and continued from there
+(on a copy of its own, if it shares the store's copy of its content).
 */
-void rcvPUT(int connectfd, int *datasockfd, int *dataservefd, char *fn) {
-    char err[BUF_SIZE];
+void rcvPUT(struct session *s, char *fn) {
+    struct stat finfo;
+    off_t offset = s->restart;
+    int compress = s->compress;
     int fd;
 
-    if (*datasockfd < 0) {
-        fprintf(stderr, KRED "!!! Child %d Error: Data connection missing\n", getpid());
-        clientSendMSG(E_DATA, connectfd, strlen(E_DATA));
-        return;
-    }
+    s->restart = 0;
+    s->compress = 0;
+    sessionForgetSum(s);
 
     // Check CWD is writable
-    if (checkFileType(".", 1, W_OK, connectfd)) {
-        closeDataConnections(datasockfd, dataservefd);
+    if (checkFileType(s, ".", 1, W_OK)) {
+        closeDataConnections(s);
         return;
     }
-    
+
     // Make sure fn is a filename, not a path
     if (strchr(fn, '/')) {
-        fprintf(stderr, KRED "!!! Child %d Error: Base file name expected; pathname '%s' received\n",
-                getpid(), fn);
-        clientSendMSG(E_BASE, connectfd, strlen(E_BASE));
-        closeDataConnections(datasockfd, dataservefd);
+        logError("Error: Base file name expected; pathname '%s' received", fn);
+        clientSendError(s, ERR_BASE);
+        closeDataConnections(s);
         return;
     }
-    
-    if ((fd = open(fn, O_RDWR | O_CREAT | O_EXCL, S_IRWXU | S_IRGRP | S_IROTH)) < 0) {
+
+    if (offset) {
+        // Read access too: a K after the resume reads the appended bytes back to sum them
+        if (checkFileType(s, fn, 0, R_OK | W_OK)) {
+            closeDataConnections(s);
+            return;
+        }
+        fd = openat(s->cwdfd, fn, O_RDWR | O_CLOEXEC);
+    } else {
+        fd = openat(s->cwdfd, fn, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRWXU | S_IRGRP | S_IROTH);
+    }
+    if (fd < 0) {
         int errsv = errno;
-        fprintf(stderr, KRED "!!! Child %d Error, creating file '%s': %s\n", 
-                getpid(), fn, strerror(errsv));
-        clientSendFormattedMSG('E', strerror(errsv), connectfd);
-        closeDataConnections(datasockfd, dataservefd);
+        logError("Error, creating file '%s': %s", fn, strerror(errsv));
+        clientSendError(s, errsv);
+        closeDataConnections(s);
         return;
     }
-    if (debug)  printf(KGRN "?? Child %d: Created file '%s' in current working directory with FD %d\n", 
-                        getpid(), fn, fd);
+    logDebug("Opened file '%s' in current working directory with FD %d", fn, fd);
+
+    // Commands already queued behind this one must not see the file as missing
+    metaDrain();
+
+    if (offset) {
+        if (fstat(fd, &finfo) < 0 || finfo.st_size < offset) {
+            logError("Error: Cannot resume '%s' at byte %lld", fn, (long long)offset);
+            clientSendError(s, ERR_RNGE);
+            close(fd);
+            closeDataConnections(s);
+            return;
+        }
+        if ((storefd >= 0 && (fd = storeUnshare(s->cwdfd, fn, fd, offset)) < 0)
+                || ftruncate(fd, offset) < 0 || lseek(fd, offset, SEEK_SET) < 0) {
+            int errsv = errno;
+            customERR("resuming file", 1);
+            clientSendError(s, errsv);
+            if (fd >= 0) close(fd);
+            closeDataConnections(s);
+            return;
+        }
+        logInfo("Resuming '%s' at byte %lld", fn, (long long)offset);
+    }
 
-    clientAcceptMSG(connectfd);
+    clientAcceptMSG(s);
 
-    if (transferContents(*datasockfd, fd)) chexit(1);
-    close(fd);
-    closeDataConnections(datasockfd, dataservefd);
-    printf(KNRM "* Child %d: Finished executing put command\n", getpid());
+    s->cmd = 'P';
+    s->filefd = fd;
+    strcpy(s->target, fn);
+    s->start = offset;
+    if (s->inlinemode) {
+        sessionStartInline(s, SESS_INLINERECV, compress);
+        return;
+    }
+    sessionStartTransfer(s, compress ? XFER_INFLATE : XFER_SPLICE, s->datasockfd, fd, 0, -1, EPOLLIN);
 }
 
-/****************************************************************************************
- * 
- *                                      CLIENT
- * 
- ****************************************************************************************/
-
 /*
-Establish a data connection on datasockfd.
+V command: Send the block signatures of the file at path (see myftpdelta.c),
+so the client can put its copy as a delta against it (U command).
+The signatures are built into a temporary file first, by a helper process
+(see sessionSigned), then sent like a G.
+*/
+void rcvSIGNATURES(struct session *s, char *path) {
+    int compress = s->compress;
+    int fd;
+    int sigfd;
+
+    s->compress = 0;
+    if (checkFileType(s, path, 0, R_OK)) {
+        closeDataConnections(s);
+        return;
+    }
+
+    sigfd = -1;
+    if ((fd = openat(s->cwdfd, path, O_RDONLY | O_CLOEXEC)) < 0 || (sigfd = deltaTemp(s->cwdfd, ".")) < 0) {
+        int errsv = errno;
+        logError("Error, signing file '%s': %s", path, strerror(errsv));
+        clientSendError(s, errsv);
+        if (fd >= 0) close(fd);
+        closeDataConnections(s);
+        return;
+    }
+
+    // Held for sessionSigned, like the files
+    s->compress = compress;
+    s->cmd = 'V';
+    s->basisfd = fd;
+    s->filefd = sigfd;
+    snprintf(s->target, sizeof(s->target), "%s", path);
+    sessionStartHelper(s, HELP_SIGN, 1);
+}
 
-@return client's fd
+/*
+U command: Receive a delta (see myftpdelta.c) against the existing file fn, like a P.
+Once it has all arrived, the file is rebuilt into a new file that replaces it
+(see sessionRebuild), so the old copy stays whole until then.
+M command (cmd): Receive a new file fn as literals and chunks of the store (see myftpstore.c),
+assembled the same way.
 */
-int clientDataConnection(int dataservefd, int port) {
-    struct sockaddr_in dataAddr;
-    int len;
-    int connectfd;
+void rcvDELTA(struct session *s, char cmd, char *fn) {
+    int compress = s->compress;
+    int basis = -1;
+    int fd;
 
-    initSockAddr(&dataAddr, port);
-    len = sizeof(dataAddr);
-    
-    if (debug)  printf(KGRN "?? Child %d: Listening for data connection on FD %d...\n", 
-                        getpid(), dataservefd);
+    s->restart = 0;
+    s->compress = 0;
+    sessionForgetSum(s);
 
-    // Accept incoming client connections
-    if ((connectfd = accept(dataservefd, (struct sockaddr*)&dataAddr, &len)) < 0) {
-        customERR("accepting data connection", 1);
-        chexit(1);
+    // Check CWD is writable, and fn is a readable file in it
+    if (checkFileType(s, ".", 1, W_OK)) {
+        closeDataConnections(s);
+        return;
+    }
+    if (strchr(fn, '/') || strlen(fn) > NAME_MAX) {
+        logError("Error: Base file name expected; pathname '%s' received", fn);
+        clientSendError(s, ERR_BASE);
+        closeDataConnections(s);
+        return;
+    }
+    if (cmd == 'M' && storefd < 0) {
+        logError("Error: No store to put '%s' through", fn);
+        clientSendError(s, EOPNOTSUPP);
+        closeDataConnections(s);
+        return;
+    }
+    if (cmd == 'M' && !faccessat(s->cwdfd, fn, F_OK, AT_SYMLINK_NOFOLLOW)) {
+        logError("Error, creating file '%s': %s", fn, strerror(EEXIST));
+        clientSendError(s, EEXIST);
+        closeDataConnections(s);
+        return;
+    }
+    if (cmd == 'U' && checkFileType(s, fn, 0, R_OK)) {
+        closeDataConnections(s);
+        return;
+    }
+
+    fd = -1;
+    if ((cmd == 'U' && (basis = openat(s->cwdfd, fn, O_RDONLY | O_CLOEXEC)) < 0) 
+            || (fd = deltaTemp(s->cwdfd, ".")) < 0) {
+        int errsv = errno;
+        logError("Error, opening file '%s' for a delta: %s", fn, strerror(errsv));
+        clientSendError(s, errsv);
+        if (basis >= 0) close(basis);
+        closeDataConnections(s);
+        return;
     }
+    logDebug("Receiving a delta for '%s' into FD %d", fn, fd);
+
+    clientAcceptMSG(s);
 
-    printf(KNRM "* Child %d: Data connection established\n", getpid());
-    return connectfd;
+    s->cmd = cmd;
+    s->filefd = fd;
+    s->basisfd = basis;
+    strcpy(s->target, fn);
+    s->start = 0;
+    if (s->inlinemode) {
+        sessionStartInline(s, SESS_INLINERECV, compress);
+        return;
+    }
+    sessionStartTransfer(s, compress ? XFER_INFLATE : XFER_SPLICE, s->datasockfd, fd, 0, -1, EPOLLIN);
 }
 
 /*
-Send an A message to client.
+F command: From now on, L, G and P move their data inline on the control connection
+as frames (see myftp.h) instead of on a data connection, saving the D round trip.
 */
-void clientAcceptMSG(int connectfd) {
-    clientSendMSG("A\n", connectfd, 2);
+void rcvF(struct session *s) {
+    closeDataConnections(s);
+    s->inlinemode = 1;
+    logInfo("Sending data inline on the control connection");
+    clientAcceptMSG(s);
 }
 
 /*
-Send client size bytes of null-terminated message.
-Make sure size cuts off the null terminator of message.
+T command: The next G or P starts at byte offset arg instead of 0, like FTP's REST.
+A resumed P continues the existing file rather than creating a new one.
+*/
+void rcvRESTART(struct session *s, char *arg) {
+    char *end;
+    long long offset;
+
+    errno = 0;
+    offset = strtoll(arg, &end, 10);
+    if (errno || end == arg || *end || offset < 0) {
+        logError("Error: Invalid restart offset '%s'", arg);
+        clientSendError(s, ERR_RNGE);
+        return;
+    }
+    s->restart = offset;
+    clientAcceptMSG(s);
+}
+
+/*
+B command: Switch the session to the binary protocol (see myftp.h), at the highest
+version both sides speak (arg is the client's).  The reply is the last text message.
 */
-void clientSendMSG(char *message, int sockfd, int size) {
+void rcvBINARY(struct session *s, char *arg) {
     char buf[BUF_SIZE];
-    if (writeToFD(message, sockfd, size)) chexit(1);
-    strncpy(buf, message, size-1);
-    buf[size-1] = 0;
-    if (debug) printf(KGRN "?? Child %d: Successfully sent response '%s'\n", getpid(), buf);
+    int version;
+
+    version = atoi(arg);
+    if (s->binary || version < 1) {
+        logError("Error: Cannot switch to binary protocol '%s'", arg);
+        clientSendError(s, ERR_CMD);
+        return;
+    }
+    if (version > BIN_VERSION) version = BIN_VERSION;
+
+    snprintf(buf, BUF_SIZE, "A%d\n", version);
+    clientSendMSG(buf, s, strlen(buf));
+    s->binary = 1;
+    logInfo("Speaking binary protocol version %d", version);
 }
 
 /*
-Send cmd response to client with message (null-terminated).
+Y command: The next L, G, R, P, V, U or M moves its data as compressed blocks (see myftp.h),
+on the data connection or inline.
 */
-void clientSendFormattedMSG(char cmd, char *message, int sockfd) {
-    char tosend[BUF_SIZE+2];
-    snprintf(tosend, BUF_SIZE+2, "%c%s\n", cmd, message);
-    clientSendMSG(tosend, sockfd, strlen(tosend));
+void rcvCOMPRESS(struct session *s) {
+    s->compress = 1;
+    logDebug("Compressing the next transfer");
+    clientAcceptMSG(s);
 }
 
 /*
-Parse client's null-terminated message (in buf).
+K command: Reply with how many bytes the last G, R or P moved and their CRC32C,
+as A<bytes> <crc> (for a U or M, the whole rebuilt file).  Unless they were summed
+on the way, they are read back from the file, by a helper process if there are
+many.  A G, R, P, U or M that was turned down counts as moving nothing.
 */
-void clientParseMSG(char *buf, int connectfd, int *datasockfd, int *dataservefd) {
-    printf(KNRM "* Child %d: Received client command '%s'\n", getpid(), buf);
+void rcvCHECKSUM(struct session *s) {
+    struct helpresult r = {0, s->sumbytes, s->sumcrc};
 
-    if (buf[0] == 'Q') {
-        rcvEXIT(connectfd);
-    } else if (buf[0] == 'C') {
-        rcvRCD(connectfd, buf+1);
-    } else if (buf[0] == 'D') {
-        rcvD(connectfd, datasockfd, dataservefd);
-    } else if (buf[0] == 'L') {
-        rcvRLS(connectfd, datasockfd, dataservefd);
-    } else if (buf[0] == 'G') {
-        rcvGET(connectfd, datasockfd, dataservefd, buf+1);
-    } else if (buf[0] == 'P') {
-        rcvPUT(connectfd, datasockfd, dataservefd, buf+1);
-    } else {
-        fprintf(stderr, KRED "!!! Child %d Error: invalid client command '%s'\n", 
-                getpid(), buf);
-        clientSendMSG("EInvalid command\n", connectfd, strlen("EInvalid command\n"));
+    if (!s->sumknown && s->sumfd >= 0) {
+        sessionStartHelper(s, HELP_SUM, s->sumbytes > SUM_INLINE);
+        return;
     }
+    sessionChecksum(s, &r);
 }
 
 /*
-Server listens for client control commands and then parses them.
+H command: Reply with which of the chunks named in args (hex SHA-256 hashes, separated
+by spaces) the store holds, as A followed by a 1 or a 0 for each.
 */
-void clientControlCommunication(int connectfd) {
-    char buf[BUF_SIZE];
-    int datasockfd;
-    int dataservefd;
-    int actual;
-    int head;
-    
-    if (debug)  printf(KGRN "?? Child %d: Listening for client commands on FD %d...\n", 
-                        getpid(), connectfd);
-
-    datasockfd = -1;
-    dataservefd = -1;
-    head = 0;
-    errno = 0;
-    while (actual = read(connectfd, buf+head, BUF_SIZE-head-1)){
-        if (errno && actual < 0) {
-            fprintf(stderr, KRED "!!! Child %d Error, reading from FD %d: %s\n", 
-                    getpid(), connectfd, strerror(errno));
-            chexit(1);
-        }
-        
-        buf[head+actual] = 0;
-        if (actual == BUF_SIZE-head-1 || strchr(buf, '\n')) {
-            buf[head+actual-1] = 0;
-            clientParseMSG(buf, connectfd, &datasockfd, &dataservefd);
-            head = 0;
-            continue;
+void rcvHAVE(struct session *s, char *args) {
+    unsigned char hash[CHUNK_HASH];
+    char answer[CHUNK_QUERY+1];
+    char *save;
+    char *tok;
+    int n = 0;
+
+    if (storefd < 0) {
+        logError("Error: No store to look chunks up in");
+        clientSendError(s, EOPNOTSUPP);
+        return;
+    }
+    for (tok = strtok_r(args, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        if (n == CHUNK_QUERY || storeParse(tok, hash)) {
+            logError("Error: Invalid chunk list");
+            clientSendError(s, ERR_CMD);
+            return;
         }
-        head += actual;
+        answer[n++] = storeHas(hash) ? '1' : '0';
     }
-
-    fprintf(stderr, KRED "!!! Child %d Error, reading client message: "
-                    "Control socket closed unexpectedly\n", getpid());
-    chexit(1);
+    answer[n] = 0;
+    logDebug("The store holds chunks '%s'", answer);
+    clientAcceptText(s, answer);
 }
 
 /*
-Establish and identify a new client control connection.
+S command: Send a report of the server's statistics (see myftpstats.c), summed over
+every process, like a G: a table, or in Prometheus's text format if arg is "prom".
 */
-void clientConnection(struct sockaddr *clientAddr, int addrLen, int connectfd) {
-    char hostName[NI_MAXHOST];
-    int err;
+void rcvSTATS(struct session *s, char *arg) {
+    int compress = s->compress;
+    int fd;
 
-    err = getnameinfo(clientAddr, 
-                        addrLen,
-                        hostName,
-                        sizeof(hostName),
-                        NULL,
-                        0,
-                        NI_NUMERICSERV);
-    if (err) {
-        fprintf(stderr, KRED "!!! Child %d Error, getting client host name: %s\n", 
-                getpid(), gai_strerror(err));
-        chexit(1);
+    s->compress = 0;
+    if (*arg && strcmp(arg, "prom")) {
+        logError("Error: Unknown statistics format '%s'", arg);
+        clientSendError(s, ERR_CMD);
+        closeDataConnections(s);
+        return;
+    }
+    if ((fd = memfd_create("myftp-stats", MFD_CLOEXEC)) < 0 || statsReport(fd, *arg != 0) 
+            || lseek(fd, 0, SEEK_SET) < 0) {
+        int errsv = errno;
+        customERR("reporting statistics", 1);
+        clientSendError(s, errsv);
+        if (fd >= 0) close(fd);
+        closeDataConnections(s);
+        return;
+    }
+
+    clientAcceptMSG(s);
+
+    s->cmd = 'S';
+    s->filefd = fd;
+    if (s->inlinemode) {
+        sessionStartInline(s, SESS_INLINESEND, compress);
+        return;
     }
+    sessionStartTransfer(s, compress ? XFER_DEFLATE : XFER_SENDFILE, fd, s->datasockfd, 0, -1, EPOLLOUT);
+}
 
-    printf(KNRM "* Child %d: Connection accepted from host '%s'\n", getpid(), hostName);
-    clientControlCommunication(connectfd);
+/*
+I command: Trace the session's commands under id, the client's name for the session
+(see myftptrace.c).  Accepted whether or not this server traces.
+*/
+void rcvTRACE(struct session *s, char *id) {
+    snprintf(s->traceid, TRACE_ID, "%s", id);
+    traceThread(s->tracetid, "session %s", s->traceid);
+    clientAcceptMSG(s);
 }
 
 /****************************************************************************************
  * 
- *                                      SERVER
+ *                                      CLIENT
  * 
  ****************************************************************************************/
 
 /*
-Taken from Assignment 8.
-
-Accept incoming client connections.
-Every CONNECTIONS_BEFORE_ZOMBIE_CLEANUP connections, clear zombies.
+Accept the client's data connection on the session's data listener.
+Runs the command that was waiting for it, if any.
 */
-void serverAcceptConnections(int listenfd, int port) {
-    struct sockaddr_in clientAddr;
-    int numConnections;
+void clientDataConnection(struct session *s) {
+    struct sockaddr_in dataAddr;
+    socklen_t len;
     int connectfd;
-    int len;
-
-    numConnections = 0;
-    
-    // Initialize client address
-    initSockAddr(&clientAddr, port);
-    len = sizeof(clientAddr);
-
-    while (1) {
-        if (debug) printf(KGRN "?? Parent: Listening for clients...\n");
-
-        // Accept incoming client connections
-        if ((connectfd = accept(listenfd, (struct sockaddr*)&clientAddr, &len)) < 0) {
-            perror(KRED "!!! Parent Error, accepting connection");
-            chexit(0);
-        }
 
-        numConnections++;
+    len = sizeof(dataAddr);
 
-        if (fork()) {
-            close(connectfd);
+    logDebug("Accepting data connection on FD %d...", s->dataservefd);
 
-            // Clean up zombies
-            if (numConnections % CONNECTIONS_BEFORE_ZOMBIE_CLEANUP == 0) {
-                if (debug) printf(KGRN "?? Parent: Clearing zombies...\n");
-                waitForChildren(-1, WNOHANG);
-            }
-            continue;
-        }
+    // Accept incoming client connections
+    if ((connectfd = accept4(s->dataservefd, (struct sockaddr*)&dataAddr, &len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+        customERR("accepting data connection", 1);
+        s->closing = 2;
+        s->status = 1;
+        return;
+    }
 
-        printf(KNRM "* Child %d: Started\n", getpid());
-        clientConnection((struct sockaddr*)&clientAddr, len, connectfd);
-        printf(KRED "!!! Child %d Error: Exiting abnormally\n", getpid());
-        chexit(1);
+    // Listener is single-use
+    eventForget(s->dataservefd);
+    close(s->dataservefd);
+    s->dataservefd = -1;
+    s->datasockfd = connectfd;
+    s->datawait = statsNow() - s->dataopened;
+
+    logInfo("Data connection established");
+
+    if (s->state == SESS_WAITDATA) {
+        sessionTrace(s, "phase", "wait for data connection", s->arrived, -1);
+        s->state = SESS_IDLE;
+        s->reqid = s->pendingid;
+        clientParseMSG(s->pending, s);
+        sessionCount(s);
     }
 }
 
 /*
-Taken from Assignment 8.
+Send an A message to client.
+*/
+void clientAcceptMSG(struct session *s) {
+    if (s->binary)  clientSendBinary(s, 'A', 0, NULL, 0);
+    else            clientSendMSG("A\n", s, 2);
+}
 
-Initialize a new server on given port.
-Child will pass port 0; on return, port will contain the ephemeral port used.
+/*
+Send an A message carrying value (a port or a size) to client.
+*/
+void clientAcceptValue(struct session *s, long long value) {
+    char buf[BUF_SIZE];
+    uint64_t be;
+
+    if (s->binary) {
+        be = htobe64(value);
+        clientSendBinary(s, 'A', 0, (char*)&be, sizeof(be));
+        return;
+    }
+    snprintf(buf, BUF_SIZE, "A%lld\n", value);
+    clientSendMSG(buf, s, strlen(buf));
+}
+
+/*
+Send an A message carrying two values (a count and a checksum) to client.
+*/
+void clientAcceptPair(struct session *s, long long first, long long second) {
+    char buf[BUF_SIZE];
+    uint64_t be[2];
+
+    if (s->binary) {
+        be[0] = htobe64(first);
+        be[1] = htobe64(second);
+        clientSendBinary(s, 'A', 0, (char*)be, sizeof(be));
+        return;
+    }
+    snprintf(buf, BUF_SIZE, "A%lld %lld\n", first, second);
+    clientSendMSG(buf, s, strlen(buf));
+}
+
+/*
+Send an A message carrying text (shorter than BUF_SIZE-2) to client.
+*/
+void clientAcceptText(struct session *s, char *text) {
+    char buf[BUF_SIZE];
+
+    if (s->binary) {
+        clientSendBinary(s, 'A', BIN_TEXT, text, strlen(text));
+        return;
+    }
+    snprintf(buf, BUF_SIZE, "A%s\n", text);
+    clientSendMSG(buf, s, strlen(buf));
+}
+
+/*
+Send an E message for code (an errno value or one of the ERR_ codes) to client.
+*/
+void clientSendError(struct session *s, int code) {
+    char buf[BUF_SIZE];
+    uint32_t be;
+
+    s->failed = 1;
+    if (s->binary) {
+        be = htonl(code);
+        clientSendBinary(s, 'E', 0, (char*)&be, sizeof(be));
+        return;
+    }
+    snprintf(buf, BUF_SIZE, "E%s\n", errorText(code));
+    clientSendMSG(buf, s, strlen(buf));
+}
+
+/*
+Send a binary protocol reply answering the session's current command.
+*/
+void clientSendBinary(struct session *s, char op, uint8_t flags, char *payload, int len) {
+    char buf[BUF_SIZE];
+
+    logDebug("Replying %c to request %u", op, s->reqid);
+    clientSendMSG(buf, s, binEncode(buf, op, flags, s->reqid, payload, len));
+}
+
+/*
+Queue size bytes of null-terminated message for the client and try to send it.
+Make sure size cuts off the null terminator of message.
+*/
+void clientSendMSG(char *message, struct session *s, int size) {
+    if (s->outlen + size > OUT_SIZE) {
+        logError("Error, replying on FD %d: Client is not reading", s->connectfd);
+        s->closing = 2;
+        s->status = 1;
+        return;
+    }
+    memcpy(s->out+s->outlen, message, size);
+    s->outlen += size;
+    sessionFlush(s);
+    logDebug("Successfully sent response '%.*s'", size-1, message);
+}
+
+/*
+Parse client's null-terminated message (in buf).
+*/
+void clientParseMSG(char *buf, struct session *s) {
+    logInfo("Received client command '%s'", buf);
+
+    if (buf[0] == 'Q') {
+        rcvEXIT(s);
+    } else if (buf[0] == 'C') {
+        rcvRCD(s, buf+1);
+    } else if (buf[0] == 'D') {
+        rcvD(s);
+    } else if (buf[0] == 'L') {
+        if (sessionNeedsData(s, buf)) return;
+        rcvRLS(s);
+    } else if (buf[0] == 'G') {
+        if (sessionNeedsData(s, buf)) return;
+        rcvGET(s, buf+1);
+    } else if (buf[0] == 'R') {
+        if (sessionNeedsData(s, buf)) return;
+        rcvRANGE(s, buf+1);
+    } else if (buf[0] == 'V') {
+        if (sessionNeedsData(s, buf)) return;
+        rcvSIGNATURES(s, buf+1);
+    } else if (buf[0] == 'Z') {
+        rcvSIZE(s, buf+1);
+    } else if (buf[0] == 'P' || buf[0] == 'U' || buf[0] == 'M') {
+        if (sessionNeedsData(s, buf)) return;
+        if (buf[0] == 'P')  rcvPUT(s, buf+1);
+        else                rcvDELTA(s, buf[0], buf+1);
+
+        // The client sends inline frames without waiting for A, so skip them if rejected
+        if (s->inlinemode && s->state == SESS_IDLE) {
+            s->filefd = -1;
+            sessionStartInline(s, SESS_INLINERECV, 0);
+        }
+    } else if (buf[0] == 'F') {
+        rcvF(s);
+    } else if (buf[0] == 'T') {
+        rcvRESTART(s, buf+1);
+    } else if (buf[0] == 'B') {
+        rcvBINARY(s, buf+1);
+    } else if (buf[0] == 'Y') {
+        rcvCOMPRESS(s);
+    } else if (buf[0] == 'K') {
+        rcvCHECKSUM(s);
+    } else if (buf[0] == 'H') {
+        rcvHAVE(s, buf+1);
+    } else if (buf[0] == 'S') {
+        if (sessionNeedsData(s, buf)) return;
+        rcvSTATS(s, buf+1);
+    } else if (buf[0] == 'I') {
+        rcvTRACE(s, buf+1);
+    } else {
+        logError("Error: invalid client command '%s'", buf);
+        clientSendError(s, ERR_CMD);
+    }
+}
+
+/*
+Read whatever the client has sent on the control connection.
+It is parsed once the event has been handled (see eventLoop).
+*/
+void clientControlCommunication(struct session *s) {
+    int actual;
+
+    // The ring is full until commands (or inline frames) are taken off it
+    if (!lineRoom(&s->in)) return;
+
+    errno = 0;
+    actual = lineFill(&s->in, s->connectfd);
+    if (actual < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+        logError("Error, reading from FD %d: %s", s->connectfd, strerror(errno));
+        s->closing = 2;
+        s->status = 1;
+        return;
+    }
+    statsBytes(actual, 0);
+    if (actual == 0) {
+        logError("Error, reading client message: Control socket closed unexpectedly");
+        s->closing = 2;
+        s->status = 1;
+        return;
+    }
+}
+
+/*
+Establish and identify a new client control connection.
+
+@return the client's session
+*/
+struct session *clientConnection(struct sockaddr *clientAddr, int addrLen, int connectfd) {
+    char hostName[NI_MAXHOST];
+    int err;
+
+    // Name lookups would stall every other session in event mode
+    err = getnameinfo(clientAddr, 
+                        addrLen,
+                        hostName,
+                        sizeof(hostName),
+                        NULL,
+                        0,
+                        NI_NUMERICSERV | (eventmode ? NI_NUMERICHOST : 0));
+    if (err) {
+        logError("Error, getting client host name: %s", gai_strerror(err));
+        if (!eventmode) chexit(1);
+        strcpy(hostName, "unknown");
+    }
+
+    logInfo("Connection accepted from host '%s'", hostName);
+    return sessionNew(connectfd);
+}
+
+/****************************************************************************************
+ * 
+ *                                      SESSION
+ * 
+ ****************************************************************************************/
+
+/*
+Create a session for a new control connection, starting in the process's CWD.
+
+@return the session (NULL on failure)
+*/
+struct session *sessionNew(int connectfd) {
+    struct session *s;
+
+    if (!(s = malloc(sizeof(struct session)))) {
+        customERR("allocating session", 1);
+        close(connectfd);
+        return NULL;
+    }
+    memset(s, 0, sizeof(struct session));
+    s->connectfd = connectfd;
+    s->dataservefd = -1;
+    s->datasockfd = -1;
+    s->filefd = -1;
+    s->basisfd = -1;
+    s->rebuiltfd = -1;
+    s->sumfd = -1;
+    s->helperfd = -1;
+    s->cacheslot = -1;
+    s->state = SESS_IDLE;
+    xferInit(&s->x, XFER_COPY, -1, -1, 0, 0);
+    lineInit(&s->in);
+    s->evctrl = (struct evsrc){EV_CTRL, s};
+    s->evdataserv = (struct evsrc){EV_DATASERV, s};
+    s->evdatasock = (struct evsrc){EV_DATASOCK, s};
+    s->evhelper = (struct evsrc){EV_HELPER, s};
+
+    if ((s->cwdfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        customERR("opening working directory", 1);
+        close(connectfd);
+        free(s);
+        return NULL;
+    }
+    setSessionDir(s, s->cwdfd);
+
+    fcntl(connectfd, F_SETFL, O_NONBLOCK);
+    fcntl(connectfd, F_SETFD, FD_CLOEXEC);
+
+    // A pipelined batch gets several small replies in a row; with Nagle, each one
+    // after the first would wait for the client's delayed ACK (about 40ms)
+    if (setsockopt(connectfd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) < 0) {
+        customERR("disabling Nagle on control connection", 1);
+    }
+    s->ctrlevents = EPOLLIN;
+    eventWatch(connectfd, &s->evctrl, s->ctrlevents, EPOLL_CTL_ADD);
+
+    s->next = sessions;
+    sessions = s;
+    statsSession(1);
+    if (tracefd >= 0) {
+        s->tracetid = ++tracesessions;
+        traceThread(s->tracetid, "connection %d", s->tracetid);
+    }
+
+    logDebug("Listening for client commands on FD %d...", connectfd);
+    return s;
+}
+
+/*
+Tear down a session.  Outside of event mode the process only serves this one
+session, so it exits with the session's status instead.
+*/
+void sessionClose(struct session *s) {
+    struct cachestats stats;
+    struct session **p;
+
+    logDebug("Metadata cache so far: %lu hits, %lu misses", metahits, metamisses);
+    if (debug && !cacheStats(&stats)) {
+        logDebug("File cache so far: %lu hits, %lu misses, %lu admitted, %lu evicted", 
+                    stats.hits, stats.misses, stats.admits, stats.evictions);
+    }
+    // Other processes can't evict a slot this one is still sending from
+    if (s->cacheslot >= 0) cacheRelease(s->cacheslot);
+    s->cacheslot = -1;
+
+    // A command cut off by the close failed
+    if (s->op) statsCommand(s->op, 1, s->phase, 0);
+    if (s->op) sessionTrace(s, "command", s->tracecmd, s->arrived, -1);
+    s->op = 0;
+    statsSession(-1);
+    if (!eventmode) {
+        if (s->status) chexit(1);
+        logInfo("Exiting normally");
+        exit(0);
+    }
+
+    closeDataConnections(s);
+    if (s->x.waitfd >= 0) eventForget(s->x.waitfd);
+    xferClose(&s->x);
+    if (s->filefd >= 0) close(s->filefd);
+    if (s->basisfd >= 0) close(s->basisfd);
+    if (s->rebuiltfd >= 0) close(s->rebuiltfd);
+    if (s->helperfd >= 0) {
+        eventForget(s->helperfd);
+        close(s->helperfd);
+    }
+    sessionForgetSum(s);
+    listClose(s->list);
+    eventForget(s->connectfd);
+    close(s->connectfd);
+    close(s->cwdfd);
+    s->state = SESS_CLOSED;
+
+    for (p = &sessions; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    s->next = dead;
+    dead = s;
+
+    if (s->status)  logError("Session on FD %d closed abnormally", s->connectfd);
+    else            logInfo("Session on FD %d closed normally", s->connectfd);
+}
+
+/*
+Write as many queued control replies as the socket will take.
+*/
+void sessionFlush(struct session *s) {
+    int actual;
+    int head;
+
+    head = 0;
+    while (head < s->outlen) {
+        actual = write(s->connectfd, s->out+head, s->outlen-head);
+        if (actual < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            logError("Error, writing to FD %d: %s", s->connectfd, strerror(errno));
+            s->closing = 2;
+            s->status = 1;
+            break;
+        }
+        head += actual;
+    }
+    memmove(s->out, s->out+head, s->outlen-head);
+    s->outlen -= head;
+    statsBytes(0, head);
+}
+
+/*
+Parse every complete command line (or binary message) in the session's input,
+in order, until one of them has to wait for I/O.
+Frames of an inline PUT are consumed where they appear between commands.
+*/
+void sessionProcessInput(struct session *s) {
+    char line[BUF_SIZE];
+    struct binhdr h;
+    int len;
+
+    while (!s->closing) {
+        if (s->state == SESS_INLINERECV) {
+            if (!sessionInlineRecv(s)) return;
+            continue;
+        }
+        if (s->state != SESS_IDLE || s->outlen > OUT_SIZE-BUF_SIZE-2) return;
+
+        if (s->binary) {
+            // Rebuilt as a command line: the opcode from the header, then the payload
+            if ((len = binNext(&s->in, &h, line+1, BUF_SIZE-2)) == LINE_NONE) return;
+            if (len == LINE_LONG) {
+                logError("Error: Binary message of %u bytes is too long", h.len);
+                s->closing = 2;
+                s->status = 1;
+                return;
+            }
+            line[0] = h.op;
+            s->reqid = h.id;
+        } else {
+            if ((len = lineNext(&s->in, line, BUF_SIZE)) == LINE_NONE) return;
+            if (len == LINE_LONG) {
+                logError("Error: Command longer than %d bytes dropped", BUF_SIZE-1);
+                clientSendError(s, ERR_LONG);
+                s->requests++;
+                continue;
+            }
+        }
+
+        sessionBegin(s, line);
+        clientParseMSG(line, s);
+        sessionCount(s);
+    }
+}
+
+/*
+Data commands need an accepted data connection (only R does after an F command).
+If the client was given a port but hasn't connected yet, hold the command until it does.
+
+@return 0: run the command now 1: command held or rejected
+*/
+int sessionNeedsData(struct session *s, char *buf) {
+    if (s->inlinemode && buf[0] != 'R') return 0;
+    if (s->datasockfd >= 0) {
+        sessionPhase(s, STATS_ACCEPT, s->datawait);
+        return 0;
+    }
+
+    if (s->dataservefd >= 0) {
+        logDebug("Holding '%s' for the data connection", buf);
+        strcpy(s->pending, buf);
+        s->pendingid = s->reqid;
+        s->state = SESS_WAITDATA;
+        return 1;
+    }
+
+    logError("Error: Data connection missing");
+    clientSendError(s, ERR_DATA);
+    return 1;
+}
+
+/*
+Begin moving count bytes from in (starting at offset for sendfile) to out on the data connection.
+events is what to wait for on the data connection when it would block.
+*/
+void sessionStartTransfer(struct session *s, int mode, int in, int out, off_t offset, off_t count, int events) {
+    logDebug("Transferring contents from FD %d to FD %d...", in, out);
+    xferInit(&s->x, mode, in, out, offset, count);
+    s->x.mem = s->cachedata;
+    s->state = SESS_TRANSFER;
+    s->marked = statsNow();
+    if (s->x.waitfd >= 0)   eventWatch(s->x.waitfd, &s->evdatasock, s->x.waitevents, EPOLL_CTL_ADD);
+    else                    eventWatch(s->datasockfd, &s->evdatasock, events, EPOLL_CTL_ADD);
+    sessionTransfer(s);
+}
+
+/*
+Move as much of the pending transfer as possible without blocking.
+*/
+void sessionTransfer(struct session *s) {
+    int err;
+
+    if ((err = xferRun(&s->x)) == XFER_AGAIN) return;
+    if (err == XFER_FAIL) {
+        logError("Error, transferring FD %d to FD %d: %s", s->x.in, s->x.out, strerror(errno));
+    }
+    sessionFinishCommand(s, err == XFER_FAIL);
+}
+
+/*
+Write the pending listing to the data connection until it would block,
+formatting more of the directory into the transfer buffer as it drains.
+A compressed listing is packed a block at a time instead, ending with the
+block that ends the stream.
+*/
+void sessionListing(struct session *s) {
+    struct xfer *x = &s->x;
+    struct zipper *zp = x->zip;
+    char *out = zp ? zp->block : x->buf;
+    int actual;
+
+    if (x->mode == XFER_DEFLATE && !zp) {
+        customERR("compressing listing", 1);
+        sessionFinishCommand(s, 1);
+        return;
+    }
+
+    while (1) {
+        if (x->head == x->tail) {
+            if (zp && zp->ended) {
+                sessionFinishCommand(s, 0);
+                return;
+            }
+            actual = listRead(s->list, zp ? zp->raw : x->buf, zp ? ZIP_CHUNK : BUF_SIZE);
+            if (actual < 0 || (actual == 0 && !zp)) {
+                if (actual < 0) customERR("listing directory", 1);
+                sessionFinishCommand(s, actual < 0);
+                return;
+            }
+            x->head = 0;
+            x->tail = zp ? zipPack(zp, zp->raw, actual, zp->block) : actual;
+        }
+
+        if ((actual = write(x->out, out+x->head, x->tail-x->head)) < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            customERR("sending listing", 1);
+            sessionFinishCommand(s, 1);
+            return;
+        }
+        x->head += actual;
+        x->moved += actual;
+    }
+}
+
+/*
+Begin an inline transfer of s->filefd (or the cached file) on the control connection (F command).
+SESS_INLINESEND queues the file (or the listing for 'L') as frames behind the A reply.
+SESS_INLINERECV writes the frames following the command to the file, or skips them
+if filefd is -1.  With compress, the frames carry compressed blocks.
+*/
+void sessionStartInline(struct session *s, int state, int compress) {
+    int mode = XFER_COPY;
+
+    logDebug("Transferring FD %d inline on FD %d...", s->filefd, s->connectfd);
+    if (compress) mode = state == SESS_INLINESEND ? XFER_DEFLATE : XFER_INFLATE;
+    if (s->cachedata) {
+        xferInit(&s->x, XFER_MEMORY, -1, s->connectfd, 0, s->cachelen);
+        s->x.mem = s->cachedata;
+    } else {
+        xferInit(&s->x, mode, s->filefd, s->connectfd, 0, -1);
+    }
+    s->framelen = 0;
+    s->state = state;
+    s->marked = statsNow();
+    if (state == SESS_INLINERECV) return;
+    sessionInlineSend(s);
+}
+
+/*
+Queue a payload-less frame header (FRAME_END or FRAME_ABORT).
+*/
+void sessionInlineFrame(struct session *s, uint32_t len) {
+    len = htonl(len);
+    clientSendMSG((char*)&len, s, FRAME_HDR);
+}
+
+/*
+Read the inline source into frames behind the queued replies while there is room,
+finishing the command with an empty frame at EOF.  When compressing, each frame
+carries one block, and the block that ends the stream goes before the empty frame.
+*/
+void sessionInlineSend(struct session *s) {
+    struct zipper *zp = s->x.zip;
+    uint32_t len;
+    char *dst;
+    int actual;
+    int room;
+
+    if (s->x.mode == XFER_DEFLATE && !zp) {
+        customERR("compressing inline data", 1);
+        sessionInlineFrame(s, FRAME_ABORT);
+        sessionFinishCommand(s, 1);
+        return;
+    }
+
+    while (s->state == SESS_INLINESEND && !s->closing) {
+        room = OUT_SIZE - s->outlen - FRAME_HDR;
+        if (room < BUF_SIZE) {
+            // Resumed by EPOLLOUT on the control connection
+            return;
+        }
+        if (room > FRAME_MAX) room = FRAME_MAX;
+        if (zp && zp->ended) {
+            sessionInlineFrame(s, FRAME_END);
+            sessionFinishCommand(s, 0);
+            return;
+        }
+
+        // A block may grow by its header, and not at all beyond that
+        dst = zp ? zp->raw : s->out+s->outlen+FRAME_HDR;
+        if (zp) room -= ZIP_HDR;
+
+        if (s->cmd == 'L')      actual = listRead(s->list, dst, room);
+        else if (s->x.mem)      actual = xferTake(&s->x, dst, room);
+        else                    actual = read(s->x.in, dst, room);
+        if (actual < 0) {
+            if (errno == EINTR) continue;
+            customERR("reading inline data", 1);
+            sessionInlineFrame(s, FRAME_ABORT);
+            sessionFinishCommand(s, 1);
+            return;
+        }
+        if (actual == 0 && !zp) {
+            sessionInlineFrame(s, FRAME_END);
+            sessionFinishCommand(s, 0);
+            return;
+        }
+
+        s->x.moved += actual;
+        s->x.crc = crcUpdate(s->x.crc, dst, actual);
+        if (zp) actual = zipPack(zp, zp->raw, actual, s->out+s->outlen+FRAME_HDR);
+        len = htonl(actual);
+        memcpy(s->out+s->outlen, &len, FRAME_HDR);
+        s->outlen += FRAME_HDR + actual;
+        sessionFlush(s);
+    }
+}
+
+/*
+Consume the inline PUT frames at the front of the session's input,
+writing their payload to s->filefd (skipped if -1).
+Compressed payloads are unpacked a block at a time on the way, and the put
+only succeeds if the stream's last block arrived.
+
+@return 0: waiting for more input 1: transfer finished
+*/
+int sessionInlineRecv(struct session *s) {
+    struct zipper *zp = s->x.zip;
+    int unpack = s->x.mode == XFER_INFLATE && s->filefd >= 0;
+    uint32_t len;
+    char *data;
+    char *dst;
+    int failed;
+    int size;
+    int done;
+    int n;
+
+    done = 0;
+    failed = 0;
+    while (!done && !s->closing) {
+        if (s->framelen == 0) {
+            if (lineUsed(&s->in) < FRAME_HDR) break;
+            lineTake(&s->in, (char*)&len, FRAME_HDR);
+            len = ntohl(len);
+
+            if (len == FRAME_END || len == FRAME_ABORT) {
+                if (len == FRAME_ABORT) {
+                    logError("Error: Client abandoned put");
+                    s->cmd = 0;
+                }
+                failed = len == FRAME_END && unpack && !(zp && zp->ended);
+                done = 1;
+            } else if (len > FRAME_MAX) {
+                logError("Error: Inline frame of %u bytes is too long", len);
+                s->closing = 2;
+                s->status = 1;
+            }
+            s->framelen = len;
+            continue;
+        }
+
+        if ((size = linePeek(&s->in, &data)) == 0) break;
+        if (size > s->framelen) size = s->framelen;
+
+        if (unpack && zp && !zp->ended) {
+            // Only as much as the current block needs, so each whole block is written out
+            if (size > (n = zipNeed(zp, &dst))) size = n;
+            memcpy(dst, data, size);
+            if ((n = zipGot(zp, size, &data)) == ZIP_BAD) {
+                logError("Error: Corrupt compressed block in put");
+                s->closing = 2;
+                s->status = 1;
+            }
+            if (n > 0) sessionInlineWrite(s, data, n);
+        } else if (!unpack) {
+            sessionInlineWrite(s, data, size);
+        }
+        lineDrop(&s->in, size);
+        s->framelen -= size;
+    }
+
+    if (done) sessionFinishCommand(s, failed);
+    return done;
+}
+
+/*
+Write size bytes of an inline put to s->filefd (if any), closing the session on failure.
+*/
+void sessionInlineWrite(struct session *s, char *data, int size) {
+    int written;
+    int actual;
+
+    for (written = 0; s->filefd >= 0 && written < size; written += actual) {
+        if ((actual = write(s->filefd, data+written, size-written)) >= 0) continue;
+        actual = 0;
+        if (errno == EINTR) continue;
+        customERR("writing inline data", 1);
+        s->closing = 2;
+        s->status = 1;
+        return;
+    }
+    s->x.moved += size;
+    s->x.crc = crcUpdate(s->x.crc, data, size);
+}
+
+/*
+Drop the last transfer's file, kept for its checksum.
+*/
+void sessionForgetSum(struct session *s) {
+    if (s->sumfd >= 0) close(s->sumfd);
+    s->sumfd = -1;
+    s->sumstart = 0;
+    s->sumbytes = 0;
+    s->sumknown = 0;
+    s->sumcrc = 0;
+}
+
+/*
+Answer a K with the checksum in r (see rcvCHECKSUM), and drop what it covered.
+*/
+void sessionChecksum(struct session *s, struct helpresult *r) {
+    if (r->err) {
+        logError("Error: Cannot checksum the last %lld bytes moved", (long long)s->sumbytes);
+        clientSendError(s, r->err);
+    } else {
+        logDebug("Last transfer moved %lld bytes with CRC32C %08x", (long long)s->sumbytes, r->crc);
+        clientAcceptPair(s, s->sumbytes, r->crc);
+    }
+    sessionForgetSum(s);
+}
+
+/*
+Run job (HELP_SUM...) for the command in a helper process, so the rest of the sessions
+in this process aren't held up while it works.  The session waits in SESS_HELPER until
+the result comes back on a pipe (see sessionHelperResult).  The job runs here instead
+if it isn't worth sending away (away is 0), if this process only serves this session,
+or if no helper can be started.
+*/
+void sessionStartHelper(struct session *s, int job, int away) {
+    struct helpresult r;
+    int fds[2];
+    int pid = -1;
+
+    s->helpjob = job;
+    s->state = SESS_HELPER;
+    s->helped = statsNow();
+    if (away && eventmode && !pipe2(fds, O_CLOEXEC) && (pid = serverHelper("Helper")) < 0) {
+        customERR("starting helper", 1);
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    if (!pid) {
+        close(fds[0]);
+        sessionHelperJob(s, &r);
+        while (write(fds[1], &r, sizeof(r)) < 0 && errno == EINTR);
+        exit(0);
+    }
+    if (pid > 0) {
+        close(fds[1]);
+        s->helperfd = fds[0];
+        eventWatch(s->helperfd, &s->evhelper, EPOLLIN, EPOLL_CTL_ADD);
+        logDebug("Helper started for session on FD %d", s->connectfd);
+        return;
+    }
+    sessionHelperJob(s, &r);
+    sessionHelperDone(s, &r);
+}
+
+/*
+Do the session's helper job, from the helper process (or in place), into r.
+*/
+void sessionHelperJob(struct session *s, struct helpresult *r) {
+    memset(r, 0, sizeof(struct helpresult));
+    errno = 0;
+    if (s->helpjob == HELP_SUM) {
+        r->size = s->sumbytes;
+        if (crcFile(s->sumfd, s->sumstart, s->sumbytes, &r->crc)) r->err = errno ? errno : ERR_RNGE;
+    } else if (s->helpjob == HELP_SIGN) {
+        if (deltaSignatures(s->basisfd, s->filefd) || (r->size = lseek(s->filefd, 0, SEEK_END)) < 0) {
+            r->err = errno ? errno : EIO;
+        }
+    } else if (s->helpjob == HELP_REBUILD) {
+        if (sessionRebuild(s, &r->size) || crcFile(s->rebuiltfd, 0, r->size, &r->crc)) r->err = errno ? errno : EIO;
+    }
+}
+
+/*
+Take the helper's result off its pipe, now that it has written it (or died without,
+which fails the job), and carry on with the command.
+*/
+void sessionHelperResult(struct session *s) {
+    struct helpresult r;
+    ssize_t actual;
+
+    while ((actual = read(s->helperfd, &r, sizeof(r))) < 0 && errno == EINTR);
+    if (actual != sizeof(r)) {
+        logError("Error: Helper for session on FD %d quit without a result", s->connectfd);
+        memset(&r, 0, sizeof(r));
+        r.err = ECHILD;
+    }
+    eventForget(s->helperfd);
+    close(s->helperfd);
+    s->helperfd = -1;
+    sessionHelperDone(s, &r);
+}
+
+/*
+Carry on with the command once its helper job is done, with the job's result in r.
+*/
+void sessionHelperDone(struct session *s, struct helpresult *r) {
+    sessionTrace(s, "phase", "helper", s->helped, r->size);
+    s->state = SESS_IDLE;
+    if (s->helpjob == HELP_SUM)         sessionChecksum(s, r);
+    else if (s->helpjob == HELP_SIGN)   sessionSigned(s, r);
+    else                                sessionRebuilt(s, r);
+    sessionCount(s);
+}
+
+/*
+Send the signatures a V built (see rcvSIGNATURES), r->size bytes of them.
+*/
+void sessionSigned(struct session *s, struct helpresult *r) {
+    int compress = s->compress;
+
+    s->compress = 0;
+    close(s->basisfd);
+    s->basisfd = -1;
+    if (r->err || lseek(s->filefd, 0, SEEK_SET) < 0) {
+        int errsv = r->err ? r->err : errno;
+        logError("Error, signing file '%s': %s", s->target, strerror(errsv));
+        clientSendError(s, errsv);
+        close(s->filefd);
+        s->filefd = -1;
+        s->cmd = 0;
+        closeDataConnections(s);
+        return;
+    }
+    logDebug("Signed file '%s' in %lld bytes", s->target, (long long)r->size);
+
+    clientAcceptMSG(s);
+
+    if (s->inlinemode) {
+        sessionStartInline(s, SESS_INLINESEND, compress);
+        return;
+    }
+    sessionStartTransfer(s, compress ? XFER_DEFLATE : XFER_SENDFILE, s->filefd, s->datasockfd, 0, -1, EPOLLOUT);
+}
+
+/*
+Rebuild the file a U command replaces (s->target) from its old copy and the delta
+just received into s->filefd, from the session's helper.  The new file is written
+to s->rebuiltfd, under a temporary name, and renamed over the old one with the old
+one's permissions, so readers only ever see one copy or the other.  Its size goes
+in size.  An M command's file is assembled from the store the same way, with a P's
+permissions, and must still not exist when it is renamed into place.
+
+@return 0: success 1: failure (errno set)
+*/
+int sessionRebuild(struct session *s, off_t *size) {
+    struct stat finfo;
+    int failed;
+    int errsv;
+
+    if (s->cmd == 'M') {
+        failed = storeApply(s->filefd, s->rebuiltfd, size) || fchmod(s->rebuiltfd, S_IRWXU | S_IRGRP | S_IROTH) < 0
+                || renameat2(s->cwdfd, s->rebuilt, s->cwdfd, s->target, RENAME_NOREPLACE) < 0;
+    } else {
+        failed = deltaApply(s->basisfd, s->filefd, s->rebuiltfd, size) || fstat(s->basisfd, &finfo) < 0 
+                || fchmod(s->rebuiltfd, finfo.st_mode & 07777) < 0 
+                || renameat(s->cwdfd, s->rebuilt, s->cwdfd, s->target) < 0;
+    }
+    if (failed) {
+        errsv = errno;
+        unlinkat(s->cwdfd, s->rebuilt, 0);
+        errno = errsv;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Put the file a U or M rebuilt (see sessionRebuild), summed on the way, in the
+delta's place, and finish the command.
+*/
+void sessionRebuilt(struct session *s, struct helpresult *r) {
+    if (r->err) {
+        logError("Error, rebuilding '%s' from its delta: %s", s->target, strerror(r->err));
+        // In case the helper died before it could clean up
+        unlinkat(s->cwdfd, s->rebuilt, 0);
+        close(s->rebuiltfd);
+        s->rebuiltfd = -1;
+        sessionEndCommand(s, 1, 0);
+        return;
+    }
+
+    // Commands already queued behind this one must see the new file
+    metaDrain();
+    close(s->filefd);
+    s->filefd = s->rebuiltfd;
+    s->rebuiltfd = -1;
+    s->sumknown = 1;
+    s->sumcrc = r->crc;
+    sessionEndCommand(s, 0, r->size);
+}
+
+/*
+Clean up after the pending transfer.  A U or M then has its file rebuilt by a
+helper process (see sessionRebuild) before the command ends.
+*/
+void sessionFinishCommand(struct session *s, int failed) {
+    static unsigned rebuilds = 0;
+    off_t moved = s->x.moved;
+
+    // Inline data was already counted on the control connection
+    if (s->state == SESS_TRANSFER && s->cmd && strchr("PUM", s->cmd))  statsBytes(moved, 0);
+    else if (s->state == SESS_TRANSFER)                                 statsBytes(0, moved);
+
+    if (s->x.waitfd >= 0) eventForget(s->x.waitfd);
+    xferClose(&s->x);
+    sessionTrace(s, "phase", "transfer", s->marked, moved);
+    sessionPhase(s, STATS_TRANSFER, statsNow() - s->marked);
+
+    if ((s->cmd == 'U' || s->cmd == 'M') && s->filefd >= 0 && !failed) {
+        // Nothing more comes on the data connection, and epoll would keep reporting its EOF
+        closeDataConnections(s);
+        snprintf(s->rebuilt, sizeof(s->rebuilt), ".myftp-%d-%u", getpid(), rebuilds++);
+        if ((s->rebuiltfd = openat(s->cwdfd, s->rebuilt, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 
+                                    S_IRUSR | S_IWUSR)) >= 0) {
+            sessionStartHelper(s, HELP_REBUILD, 1);
+            return;
+        }
+        customERR("creating rebuilt file", 1);
+        failed = 1;
+    }
+    sessionEndCommand(s, failed, 0);
+}
+
+/*
+End the command so the session can go back to parsing commands, once its transfer
+(and for a U or M, the rebuild of its size bytes) is done.
+A G, R or P whose bytes passed through user space was summed on the way, and a U
+or M as it was rebuilt; otherwise the file that was sent or received stays open
+until its checksum is asked for (K command) or the next one replaces it.
+With a store, a file that was put is filed in it by a helper process (see storeSaveLater).
+*/
+void sessionEndCommand(struct session *s, int failed, off_t size) {
+    off_t moved = s->x.moved;
+    int summed = s->x.summed && s->cmd && strchr("GRP", s->cmd) && (s->filefd >= 0 || s->cacheslot >= 0);
+
+    if (s->basisfd >= 0) close(s->basisfd);
+    s->basisfd = -1;
+    if (storefd >= 0 && s->filefd >= 0 && !failed && s->cmd && strchr("PUM", s->cmd) 
+            && storeSaveLater(s->cwdfd, s->target, s->filefd)) {
+        logError("Error, storing '%s': %s", s->target, strerror(errno));
+    }
+    if (s->cacheslot >= 0) {
+        cacheRelease(s->cacheslot);
+        s->cacheslot = -1;
+        s->cachedata = NULL;
+    }
+    if (summed) {
+        s->sumknown = 1;
+        s->sumcrc = s->x.crc;
+    }
+    if ((summed || s->filefd >= 0) && s->cmd && strchr("GRPUM", s->cmd)) {
+        s->sumstart = s->start;
+        s->sumbytes = s->cmd == 'U' || s->cmd == 'M' ? size : moved;
+        if (!s->sumknown) s->sumfd = s->filefd;
+        else if (s->filefd >= 0) close(s->filefd);
+    } else if (s->filefd >= 0) {
+        close(s->filefd);
+    }
+    s->filefd = -1;
+    s->framelen = 0;
+    listClose(s->list);
+    s->list = NULL;
+    closeDataConnections(s);
+    s->state = SESS_IDLE;
+    s->failed |= failed;
+    sessionCount(s);
+
+    if (s->cmd == 'G') {
+        logInfo("Finished executing get command (%lld bytes sent)", (long long)moved);
+    } else if (s->cmd == 'R') {
+        logInfo("Finished executing range command (%lld bytes sent)", (long long)moved);
+    } else if (s->cmd == 'V') {
+        logInfo("Finished executing signature command (%lld bytes sent)", (long long)moved);
+    } else if (s->cmd == 'P' || s->cmd == 'U' || s->cmd == 'M') {
+        // A partial upload (or a delta that can't be applied) is useless to the client
+        if (failed) {
+            s->closing = 2;
+            s->status = 1;
+            return;
+        }
+        if (s->cmd == 'U') {
+            logInfo("Finished executing delta put command (%lld bytes received, %lld rebuilt)", 
+                    (long long)moved, (long long)size);
+        } else if (s->cmd == 'M') {
+            logInfo("Finished executing chunked put command (%lld bytes received, %lld assembled)", 
+                    (long long)moved, (long long)size);
+        } else {
+            logInfo("Finished executing put command (%lld bytes received)", (long long)moved);
+        }
+    } else if (s->cmd == 'L') {
+        logInfo("Finished executing ls command");
+    } else if (s->cmd == 'S') {
+        logInfo("Finished executing statistics command (%lld bytes sent)", (long long)moved);
+    }
+    s->cmd = 0;
+}
+
+/*
+Start timing the command line, just read from the client.
+*/
+void sessionBegin(struct session *s, char *line) {
+    s->op = line[0];
+    s->requests++;
+    if (tracefd >= 0) snprintf(s->tracecmd, sizeof(s->tracecmd), "%s", line);
+    s->failed = 0;
+    s->phases = 0;
+    memset(s->phase, 0, sizeof(s->phase));
+    s->arrived = statsNow();
+}
+
+/*
+Add ns nanoseconds to the current command's time in phase.
+*/
+void sessionPhase(struct session *s, int phase, uint64_t ns) {
+    s->phase[phase] += ns;
+    s->phases |= 1 << phase;
+}
+
+/*
+Count the current command in the server's statistics once it is done
+(not held for its data connection or still moving data).
+*/
+void sessionCount(struct session *s) {
+    if (!s->op || s->state != SESS_IDLE) return;
+    sessionPhase(s, STATS_TOTAL, statsNow() - s->arrived);
+    statsCommand(s->op, s->failed, s->phase, s->phases);
+    sessionTrace(s, "command", s->tracecmd, s->arrived, -1);
+    s->op = 0;
+}
+
+/*
+Trace the span name (of category cat, see myftptrace.c) from start until now as part
+of the current command, along with bytes if there are any (-1 if not).
+*/
+void sessionTrace(struct session *s, const char *cat, const char *name, uint64_t start, long long bytes) {
+    if (tracefd < 0) return;
+    traceSpan(s->tracetid, cat, name, start, s->traceid, s->requests, bytes);
+}
+
+/*
+After handling an event: close the session if it is done, otherwise make sure
+epoll is watching the control connection for exactly what the session needs.
+*/
+void sessionSettle(struct session *s) {
+    int events;
+
+    if (s->state == SESS_CLOSED) return;
+    if (s->closing == 2 || (s->closing == 1 && s->outlen == 0)) {
+        sessionClose(s);
+        return;
+    }
+
+    events = 0;
+    if (lineRoom(&s->in)) events |= EPOLLIN;
+    if (s->outlen) events |= EPOLLOUT;
+    if (events != s->ctrlevents) {
+        eventWatch(s->connectfd, &s->evctrl, events, EPOLL_CTL_MOD);
+        s->ctrlevents = events;
+    }
+}
+
+/****************************************************************************************
+ * 
+ *                                      EVENTS
+ * 
+ ****************************************************************************************/
+
+/*
+Add (or modify, with op) fd in the process's epoll set, reporting to src.
+*/
+void eventWatch(int fd, struct evsrc *src, int events, int op) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(epollfd, op, fd, &ev) < 0) {
+        customERR("watching FD", eventmode == 0);
+        chexit(eventmode == 0);
+    }
+}
+
+/*
+Remove fd from the epoll set before it is closed.  The registration belongs to the
+open socket, not the FD, so a copy in a helper process (see serverHelper) would
+otherwise keep it reporting events under a number that may since be reused.
+*/
+void eventForget(int fd) {
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+Dispatch epoll events to their sessions until the process exits.
+listenfd is the control listener in event mode, -1 for a single forked session.
+*/
+void eventLoop(int listenfd) {
+    struct epoll_event events[MAX_EVENTS];
+    struct evsrc *src;
+    static struct evsrc evmeta = {EV_META, NULL};
+    struct session *s;
+    int metafd;
+    int n;
+    int i;
+
+    // Every process watches paths for its own metadata cache
+    if ((metafd = metaInit()) >= 0) eventWatch(metafd, &evmeta, EPOLLIN, EPOLL_CTL_ADD);
+
+    while (1) {
+        if ((n = epoll_wait(epollfd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR) continue;
+            customERR("waiting for events", eventmode == 0);
+            chexit(eventmode == 0);
+        }
+
+        for (i = 0; i < n; i++) {
+            src = events[i].data.ptr;
+            if (src->kind == EV_LISTEN) {
+                serverAcceptEvents(listenfd);
+                continue;
+            }
+            if (src->kind == EV_META) {
+                metaDrain();
+                continue;
+            }
+
+            s = src->s;
+            if (s->state == SESS_CLOSED) continue;
+
+            if (src->kind == EV_CTRL) {
+                if (events[i].events & EPOLLOUT) {
+                    sessionFlush(s);
+                    if (s->state == SESS_INLINESEND) sessionInlineSend(s);
+                }
+                if (events[i].events & EPOLLIN) {
+                    clientControlCommunication(s);
+                } else if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    s->closing = 2;
+                    s->status = 1;
+                }
+            } else if (src->kind == EV_DATASERV) {
+                clientDataConnection(s);
+            } else if (src->kind == EV_DATASOCK) {
+                if (s->state == SESS_INLINESEND)    sessionInlineSend(s);
+                else if (s->cmd == 'L')             sessionListing(s);
+                else                                sessionTransfer(s);
+            } else if (src->kind == EV_HELPER) {
+                sessionHelperResult(s);
+            }
+            sessionProcessInput(s);
+            sessionSettle(s);
+        }
+
+        // Nothing from this wakeup refers to closed sessions anymore
+        while (dead) {
+            s = dead;
+            dead = dead->next;
+            free(s);
+        }
+    }
+}
+
+/****************************************************************************************
+ * 
+ *                                      SERVER
+ * 
+ ****************************************************************************************/
+
+/*
+Taken from Assignment 8.
+
+Accept incoming client connections.
+Every CONNECTIONS_BEFORE_ZOMBIE_CLEANUP connections, clear zombies.
+Each connection gets its own child, which runs the session's event loop on its own.
+*/
+void serverAcceptConnections(int listenfd, int port) {
+    struct sockaddr_in clientAddr;
+    int numConnections;
+    int connectfd;
+    int len;
+
+    numConnections = 0;
+
+    // Initialize client address
+    initSockAddr(&clientAddr, port);
+    len = sizeof(clientAddr);
+
+    while (1) {
+        logDebug("Listening for clients...");
+
+        // Accept incoming client connections
+        if ((connectfd = accept(listenfd, (struct sockaddr*)&clientAddr, &len)) < 0) {
+            customERR("accepting connection", 0);
+            chexit(0);
+        }
+
+        numConnections++;
+
+        if (fork()) {
+            close(connectfd);
+
+            // Clean up zombies
+            if (numConnections % CONNECTIONS_BEFORE_ZOMBIE_CLEANUP == 0) {
+                logDebug("Clearing zombies...");
+                waitForChildren(-1, WNOHANG);
+            }
+            continue;
+        }
+
+        logRole("Child", 1);
+        logInfo("Started");
+        close(listenfd);
+        if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            customERR("creating epoll instance", 1);
+            chexit(1);
+        }
+        if (!clientConnection((struct sockaddr*)&clientAddr, len, connectfd)) chexit(1);
+        eventLoop(-1);
+        logError("Error: Exiting abnormally");
+        chexit(1);
+    }
+}
+
+/*
+Event mode: accept every pending client connection and give each one a session.
+*/
+void serverAcceptEvents(int listenfd) {
+    struct sockaddr_in clientAddr;
+    socklen_t len;
+    int connectfd;
+
+    while (1) {
+        len = sizeof(clientAddr);
+        if ((connectfd = accept4(listenfd, (struct sockaddr*)&clientAddr, &len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            customERR("accepting connection", 0);
+            return;
+        }
+        clientConnection((struct sockaddr*)&clientAddr, len, connectfd);
+    }
+}
+
+/*
+Event mode: serve every session from this one process.
+*/
+void serverEventLoop(int listenfd) {
+    static struct evsrc evlisten = {EV_LISTEN, NULL};
+
+    if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        customERR("creating epoll instance", 0);
+        chexit(0);
+    }
+    fcntl(listenfd, F_SETFL, O_NONBLOCK);
+    fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+    eventWatch(listenfd, &evlisten, EPOLLIN, EPOLL_CTL_ADD);
+
+    logInfo("Serving sessions from an event loop");
+    eventLoop(listenfd);
+}
+
+/*
+Fork worker number id.  The worker pins itself to a CPU if asked, opens its own
+SO_REUSEPORT listener on the control port, and serves sessions from its event loop,
+so the kernel spreads incoming connections across workers.
+
+@return worker's pid (parent only)
+*/
+pid_t serverStartWorker(int id) {
+    cpu_set_t cpus;
+    pid_t pid;
+    int listenfd;
+    int port;
+    int cpu;
+
+    if ((pid = fork()) < 0) {
+        customERR("forking worker", 0);
+        chexit(0);
+    }
+    if (pid) return pid;
+
+    logRole("Child", 1);
+    // Workers go away with the parent instead of holding the port
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    eventmode = 1;
+    statsSlot(id);
+    logInfo("Worker %d started", id);
+
+    if (pinworkers) {
+        cpu = id % sysconf(_SC_NPROCESSORS_ONLN);
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)  customERR("pinning worker", 1);
+        else                                                logDebug("Worker %d pinned to CPU %d", id, cpu);
+    }
+
+    port = SERV_PORT;
+    listenfd = serverInit(&port);
+    serverEventLoop(listenfd);
+    logError("Error: Exiting abnormally");
+    chexit(1);
+}
+
+/*
+Fork a helper process to do slow work for this one, logging as role, with nothing
+left for this process to reap: the helper is the child's own child, and the child
+exits at once.  The helper closes the sockets it inherited, which would otherwise
+keep clients' connections (and the listening port) open after the server is done
+with them, and exits when its work is done.
+
+@return 0: in the helper 1: in the caller -1: failure (no helper was started)
+*/
+int serverHelper(const char *role) {
+    struct dirent *entry;
+    struct stat finfo;
+    DIR *fds;
+    pid_t pid;
+    int status;
+    int fd;
+
+    if ((pid = fork()) < 0) return -1;
+    if (pid) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            errno = EAGAIN;
+            return -1;
+        }
+        return 1;
+    }
+
+    if ((pid = fork())) _exit(pid < 0);
+    logRole(role, 1);
+    if ((fds = opendir("/proc/self/fd"))) {
+        while ((entry = readdir(fds))) {
+            fd = atoi(entry->d_name);
+            if (fd > 2 && fd != dirfd(fds) && !fstat(fd, &finfo) && S_ISSOCK(finfo.st_mode)) close(fd);
+        }
+        closedir(fds);
+    }
+    return 0;
+}
+
+/*
+Start the worker pool, then restart any worker that exits.
+A worker that dies right after starting is not restarted, since it would just die again.
+*/
+void serverRunWorkers() {
+    time_t *started;
+    pid_t *pids;
+    pid_t pid;
+    int status;
+    int i;
+
+    if (!(pids = calloc(workers, sizeof(pid_t))) || !(started = calloc(workers, sizeof(time_t)))) {
+        customERR("allocating worker table", 0);
+        chexit(0);
+    }
+
+    logInfo("Starting %d workers", workers);
+    for (i = 0; i < workers; i++) {
+        started[i] = time(NULL);
+        pids[i] = serverStartWorker(i);
+    }
+
+    while (1) {
+        if ((pid = wait(&status)) < 0) {
+            if (errno == EINTR) continue;
+            customERR("waiting for workers", 0);
+            chexit(0);
+        }
+
+        for (i = 0; i < workers && pids[i] != pid; i++);
+        if (i == workers) continue;
+
+        logError("Error: Worker %d (pid %d) exited", i, pid);
+        if (time(NULL) - started[i] < WORKER_MIN_UPTIME) {
+            logError("Error: Worker %d failed on startup", i);
+            chexit(0);
+        }
+        started[i] = time(NULL);
+        pids[i] = serverStartWorker(i);
+    }
+}
+
+/*
+Taken from Assignment 8.
+
+Initialize a new server on given port.
+Child will pass port 0; on return, port will contain the ephemeral port used.
 Server will pass port SERV_PORT.
+Failing to set up a child's (data connection) server is not fatal.
 
-@return server's fd
+@return server's fd (-1 for child errors)
 */
 int serverInit(int *port) {
     struct sockaddr_in servAddr;
     int listenfd;
     int len;
+    int errsv;
     int ischild = !(*port);
 
     // Create socket
     if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         customERR("creating socket", ischild);
+        if (ischild) return -1;
         chexit(ischild);
     }
 
-    if (debug) {
-        if (ischild)    printf(KGRN "?? Child %d: Socket created with descriptor %d\n", 
-                                getpid(), listenfd);
-        else            printf(KGRN "?? Parent: Socket created with descriptor %d\n", listenfd);
-    }
+    logDebug("Socket created with descriptor %d", listenfd);
 
     // Clear socket if server is killed
     if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
         customERR("setting socket options", ischild);
-        chexit(ischild);
+        goto failure;
+    }
+
+    // Every worker binds its own listener to the control port
+    if (!ischild && workers && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0) {
+        customERR("setting socket options", ischild);
+        goto failure;
     }
 
     // Initialize server address
@@ -643,7 +2404,7 @@ int serverInit(int *port) {
     // Bind socket to server address
     if (bind(listenfd, (struct sockaddr*)&servAddr, len) < 0) {
         customERR("binding", ischild);
-        chexit(ischild);
+        goto failure;
     }
 
     // Get port number if port was 0 initially
@@ -652,30 +2413,30 @@ int serverInit(int *port) {
 
         if (getsockname(listenfd, (struct sockaddr*)&servAddr, &len) < 0) {
             customERR("getting socket name", ischild);
-            chexit(ischild);
+            goto failure;
         }
 
         *port = ntohs(servAddr.sin_port);
     }
 
-    if (debug) {
-        if (ischild)    printf(KGRN "?? Child %d: Socket bound to port %d\n", getpid(), *port);
-        else            printf(KGRN "?? Parent: Socket bound to port %d\n", *port);
-    }
+    logDebug("Socket bound to port %d", *port);
 
-    // Listen with a max queue of BACKLOG connection requests
-    if (listen(listenfd, BACKLOG) < 0) {
+    // Listen with a max queue of BACKLOG (data) or backlog (control) connection requests
+    if (listen(listenfd, ischild ? BACKLOG : backlog) < 0) {
         customERR("creating socket", ischild);
-        chexit(ischild);
-    }
-    
-    if (debug) {
-        if (ischild)    printf(KGRN "?? Child %d: Listening with connection queue of %d\n", 
-                                getpid(), BACKLOG);
-        else            printf(KGRN "?? Parent: Listening with connection queue of %d\n", BACKLOG);
+        goto failure;
     }
 
+    logDebug("Listening with connection queue of %d", ischild ? BACKLOG : backlog);
+
     return listenfd;
+
+failure:
+    if (!ischild) chexit(ischild);
+    errsv = errno;
+    close(listenfd);
+    errno = errsv;
+    return -1;
 }
 
 /****************************************************************************************
@@ -684,38 +2445,166 @@ int serverInit(int *port) {
  * 
  ****************************************************************************************/
 
+#define USAGE "!!! Usage: ./myftpserve [-d] [-e] [-u] [-w workers [-c]] [-b backlog] [-s store]\n" \
+              "                     [-m cache [-a admit]] [-p file] [-l file] [-q] [-t file]\n"
+
 /*
-Checks for proper arguments.
-Debug flag "-d" is optional.
+Parse a positive integer option argument, or exit with usage.
+*/
+int mainParseCount(char opt, char *arg) {
+    char *end;
+    long n;
+
+    errno = 0;
+    n = strtol(arg, &end, 10);
+    if (errno || *end || n <= 0 || n > 65535) {
+        fprintf(stderr, KRED "!!! Error: Option -%c expects a positive number, got '%s'\n", opt, arg);
+        fprintf(stderr, KRED USAGE);
+        exit(1);
+    }
+    return n;
+}
+
+/*
+Parse a positive size option argument, which may end in k, m or g, or exit with usage.
 */
-void mainParseArgs(int argc, char const **argv) {
-    // Check for correct number of args
-    if (argc > 2) {
-        fprintf(stderr, KRED "!!! Usage: ./myftpserve [-d]\n");
+off_t mainParseSize(char opt, char *arg, off_t max) {
+    char *end;
+    long long n;
+
+    errno = 0;
+    n = strtoll(arg, &end, 10);
+    if (*end == 'k' || *end == 'K')         n <<= 10, end++;
+    else if (*end == 'm' || *end == 'M')    n <<= 20, end++;
+    else if (*end == 'g' || *end == 'G')    n <<= 30, end++;
+    if (errno || *end || n <= 0 || n > max) {
+        fprintf(stderr, KRED "!!! Error: Option -%c expects a positive size up to %lld, got '%s'\n", 
+                opt, (long long)max, arg);
+        fprintf(stderr, KRED USAGE);
         exit(1);
     }
+    return n;
+}
 
-    // Init debug
-    if (argc == 2) {
-        if (strcmp(argv[1], "-d")) {
-            fprintf(stderr, KRED "!!! Error: Encountered unknown token '%s'\n", argv[1]);
-            fprintf(stderr, KRED "!!! Usage: ./myftpserve [-d]\n");
+/*
+Checks for proper arguments.
+Debug flag "-d" and event mode flag "-e" are optional.
+"-u" moves file data with io_uring when the kernel supports it.
+"-w" pre-forks workers (optionally pinned to CPUs with "-c"); "-b" sets the listen backlog.
+"-s" files every put in the deduplicating store at the given directory (see myftpstore.c).
+"-m" shares a cache of that many bytes of small files between all processes, holding
+files of up to "-a" bytes (see myftpcache.c).
+"-p" keeps a Prometheus report of the server's statistics at the given file (see myftpstats.c).
+"-l" appends the log to the given file instead of printing it; "-q" logs errors only (see myftplog.c).
+"-t" traces the phases of every command into the given file (see myftptrace.c).
+*/
+void mainParseArgs(int argc, char * const *argv) {
+    off_t capacity = 0;
+    off_t admit = CACHE_ADMIT;
+    char *statspath = NULL;
+    char *logpath = NULL;
+    char *tracepath = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "deuw:cb:s:m:a:p:l:qt:")) != -1) {
+        if (opt == 'd') {
+            debug = 1;
+        } else if (opt == 'e') {
+            eventmode = 1;
+        } else if (opt == 'u') {
+            xferuring = 1;
+        } else if (opt == 'w') {
+            workers = mainParseCount(opt, optarg);
+        } else if (opt == 'c') {
+            pinworkers = 1;
+        } else if (opt == 'b') {
+            backlog = mainParseCount(opt, optarg);
+        } else if (opt == 'm') {
+            capacity = mainParseSize(opt, optarg, 1LL << 40);
+        } else if (opt == 'a') {
+            admit = mainParseSize(opt, optarg, 1LL << 30);
+        } else if (opt == 'p') {
+            statspath = optarg;
+        } else if (opt == 'l') {
+            logpath = optarg;
+        } else if (opt == 'q') {
+            logquiet = 1;
+        } else if (opt == 't') {
+            tracepath = optarg;
+        } else if (opt == 's') {
+            if (storeInit(optarg)) {
+                fprintf(stderr, KRED "!!! Error, opening store '%s': %s\n", optarg, strerror(errno));
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, KRED USAGE);
             exit(1);
         }
-        printf(KGRN "?? Parent: Debug output enabled\n");
-        debug = 1;
     }
+
+    // Check for leftover args
+    if (optind < argc) {
+        fprintf(stderr, KRED "!!! Error: Encountered unknown token '%s'\n", argv[optind]);
+        fprintf(stderr, KRED USAGE);
+        exit(1);
+    }
+    if (pinworkers && !workers) {
+        fprintf(stderr, KRED "!!! Error: -c only applies to workers (-w)\n");
+        fprintf(stderr, KRED USAGE);
+        exit(1);
+    }
+
+    // From here on, messages go through the log's ring (and children's through their own)
+    logRole("Parent", 0);
+    if (logStart(logpath)) {
+        fprintf(stderr, KRED "!!! Error, opening log '%s': %s\n", logpath, strerror(errno));
+        exit(1);
+    }
+    if (tracepath && traceStart(tracepath, "myftpserve")) {
+        fprintf(stderr, KRED "!!! Error, opening trace '%s': %s\n", tracepath, strerror(errno));
+        exit(1);
+    }
+
+    if (admit != CACHE_ADMIT && !capacity) {
+        fprintf(stderr, KRED "!!! Error: -a only applies to the file cache (-m)\n");
+        fprintf(stderr, KRED USAGE);
+        exit(1);
+    }
+    if (capacity && cacheInit(capacity, admit)) {
+        fprintf(stderr, KRED "!!! Error, mapping the file cache: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    // Workers count in a slot each, everything else in one
+    if (statsInit(workers ? workers : 1)) {
+        fprintf(stderr, KRED "!!! Error, mapping statistics: %s\n", strerror(errno));
+        if (statspath) exit(1);
+    }
+    if (statspath && statsDump(statspath)) {
+        fprintf(stderr, KRED "!!! Error, reporting statistics to '%s': %s\n", statspath, strerror(errno));
+        exit(1);
+    }
+
+    logDebug("Debug output enabled");
+    if (capacity) logInfo("Caching files of up to %lld bytes in %lld bytes", (long long)admit, (long long)capacity);
+    if (storefd >= 0) logInfo("Deduplicating puts through the store");
 }
 
-int main(int argc, char const *argv[]) {
+int main(int argc, char *argv[]) {
     int port;
     int listenfd;
     mainParseArgs(argc, argv);
 
+    // Dead clients show up as write errors on their own session instead
+    signal(SIGPIPE, SIG_IGN);
+
+    if (workers) serverRunWorkers();   // Does not return
+
     port = SERV_PORT;
     listenfd = serverInit(&port);
-    serverAcceptConnections(listenfd, port);
+    if (eventmode)  serverEventLoop(listenfd);
+    else            serverAcceptConnections(listenfd, port);
 
-    fprintf(stderr, KRED "!!! Parent Error: Exiting abnormally\n");
+    logError("Error: Exiting abnormally");
     return 1;
 }
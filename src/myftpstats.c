@@ -0,0 +1,338 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+Server statistics (S command, -p), shared by all of myftpserve's processes.
+
+Counters live in one shared anonymous mapping, made before the server forks,
+with a slot per worker (-w), or a single slot that every forked child or the
+event loop (-e) uses.  Each slot counts the sessions open and ever opened,
+the bytes read and written on control and data connections, and for each
+command letter, how many ran, how many failed and a latency histogram per
+phase:
+    check       permission and file type checks (checkFileType)
+    accept      waiting for the data connection, from D until it is accepted
+    transfer    moving the data (for a U or M, rebuilding the file too)
+    total       from the command's arrival until its last byte moved
+A phase is only recorded for the commands that go through it.
+
+Counters are only ever added to with atomic instructions, so no process ever
+waits for another.  Readers sum every slot as they go; a report may catch a
+command half counted, which a later one makes up for.
+
+The histograms are log-linear, like HdrHistogram's: latencies under 32
+microseconds have a bucket each, and every power of two above that is split
+into 16 buckets, so a percentile is never more than about 6% off.
+*/
+
+#include "myftp.h"
+
+#define STATS_OPS       "QCDLGRZVPUMFTBYKHSI?"   // Command letters ('?': anything else)
+#define STATS_NOPS      (sizeof(STATS_OPS)-1)
+#define STATS_BUCKETS   544                     // Up to 2^37 microseconds (38 hours)
+
+struct statsop {
+    unsigned long count;
+    unsigned long errors;
+    unsigned long long sum[STATS_PHASES];       // Nanoseconds
+    unsigned long hist[STATS_PHASES][STATS_BUCKETS];
+};
+
+struct statsslot {
+    long sessions;                  // Open now (opened minus closed)
+    unsigned long opened;
+    unsigned long long bytesin;
+    unsigned long long bytesout;
+    struct statsop op[STATS_NOPS];
+};
+
+static const char *statsphases[STATS_PHASES] = {"check", "accept", "transfer", "total"};
+
+struct statsslot *stats = NULL;     // The shared mapping (NULL: no statistics)
+struct statsslot *statsmine;        // This process's slot
+int statsslots = 0;
+
+/****************************************************************************************
+ * 
+ *                                      PROTOTYPES
+ * 
+ ****************************************************************************************/
+
+int statsBucket(unsigned long us);
+unsigned long statsBucketValue(int i);
+void statsSum(struct statsslot *total);
+double statsPercentile(struct statsop *op, int phase, unsigned long count, double mark);
+
+/****************************************************************************************
+ * 
+ *                                      HELPERS
+ * 
+ ****************************************************************************************/
+
+/*
+@return the histogram bucket for us microseconds
+*/
+int statsBucket(unsigned long us) {
+    int msb;
+    int i;
+
+    if (us < 32) return us;
+    msb = 63 - __builtin_clzl(us);
+    i = 32 + (msb - 5) * 16 + ((us >> (msb - 4)) & 15);
+    return i < STATS_BUCKETS ? i : STATS_BUCKETS - 1;
+}
+
+/*
+@return the smallest latency (in microseconds) bucket i holds
+*/
+unsigned long statsBucketValue(int i) {
+    int msb;
+
+    if (i < 32) return i;
+    msb = (i - 32) / 16 + 5;
+    return (16UL + (i - 32) % 16) << (msb - 4);
+}
+
+/*
+Add up every process's slot into total.
+*/
+void statsSum(struct statsslot *total) {
+    unsigned long *src;
+    unsigned long *dst;
+    size_t n;
+    size_t i;
+    int slot;
+
+    memset(total, 0, sizeof(struct statsslot));
+    for (slot = 0; slot < statsslots; slot++) {
+        total->sessions += __atomic_load_n(&stats[slot].sessions, __ATOMIC_RELAXED);
+        total->opened += __atomic_load_n(&stats[slot].opened, __ATOMIC_RELAXED);
+        total->bytesin += __atomic_load_n(&stats[slot].bytesin, __ATOMIC_RELAXED);
+        total->bytesout += __atomic_load_n(&stats[slot].bytesout, __ATOMIC_RELAXED);
+
+        // The per-command counters are all unsigned longs (or the same size)
+        src = (unsigned long*)stats[slot].op;
+        dst = (unsigned long*)total->op;
+        n = sizeof(total->op) / (sizeof(unsigned long));
+        for (i = 0; i < n; i++) dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/*
+@return the latency (in seconds) under which mark (0 to 1) of op's count commands fell in phase
+*/
+double statsPercentile(struct statsop *op, int phase, unsigned long count, double mark) {
+    unsigned long want;
+    unsigned long seen;
+    int i;
+
+    want = mark * count + 0.5;
+    if (want < 1) want = 1;
+    for (seen = 0, i = 0; i < STATS_BUCKETS; i++) {
+        if ((seen += op->hist[phase][i]) >= want) return statsBucketValue(i) / 1e6;
+    }
+    return 0;
+}
+
+/****************************************************************************************
+ * 
+ *                                      STATISTICS
+ * 
+ ****************************************************************************************/
+
+/*
+Map the counters, with a slot for each of slots processes, shared with every
+process forked afterwards.  Until statsSlot says otherwise, a process uses slot 0.
+
+@return 0: success 1: failure
+*/
+int statsInit(int slots) {
+    if ((stats = mmap(NULL, sizeof(struct statsslot) * slots, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
+        stats = NULL;
+        return 1;
+    }
+    statsslots = slots;
+    statsmine = stats;
+    return 0;
+}
+
+/*
+Count this process's commands in slot i (a worker's number) from now on.
+*/
+void statsSlot(int i) {
+    if (stats && i < statsslots) statsmine = &stats[i];
+}
+
+/*
+@return nanoseconds on the monotonic clock
+*/
+uint64_t statsNow(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+Count a session opening (delta 1) or closing (delta -1).
+*/
+void statsSession(int delta) {
+    if (!stats) return;
+    __atomic_fetch_add(&statsmine->sessions, delta, __ATOMIC_RELAXED);
+    if (delta > 0) __atomic_fetch_add(&statsmine->opened, 1, __ATOMIC_RELAXED);
+}
+
+/*
+Count bytes read (in) and written (out) on a client's connections.
+*/
+void statsBytes(off_t in, off_t out) {
+    if (!stats) return;
+    if (in) __atomic_fetch_add(&statsmine->bytesin, in, __ATOMIC_RELAXED);
+    if (out) __atomic_fetch_add(&statsmine->bytesout, out, __ATOMIC_RELAXED);
+}
+
+/*
+Count one command (letter op), with the nanoseconds it spent in each phase
+whose bit is set in phases.
+*/
+void statsCommand(char op, int failed, uint64_t *ns, int phases) {
+    struct statsop *st;
+    const char *p;
+    int i;
+
+    if (!stats) return;
+    p = op ? strchr(STATS_OPS, op) : NULL;
+    st = &statsmine->op[p ? (size_t)(p - STATS_OPS) : STATS_NOPS-1];
+
+    __atomic_fetch_add(failed ? &st->errors : &st->count, 1, __ATOMIC_RELAXED);
+    if (failed) return;
+    for (i = 0; i < STATS_PHASES; i++) {
+        if (!(phases & (1 << i))) continue;
+        __atomic_fetch_add(&st->sum[i], ns[i], __ATOMIC_RELAXED);
+        __atomic_fetch_add(&st->hist[i][statsBucket(ns[i] / 1000)], 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+Write a report of every process's counters to fd: a table for people, or with
+prometheus, Prometheus's text format (a summary per command and phase).
+Latencies only cover commands that succeeded.
+
+@return 0: success 1: failure (no statistics)
+*/
+int statsReport(int fd, int prometheus) {
+    static const double marks[3] = {0.5, 0.99, 0.999};
+    struct cachestats cs;
+    struct statsslot *total;
+    struct statsop *op;
+    unsigned long count;
+    size_t i;
+    int j;
+    int m;
+
+    if (!stats) {
+        errno = EOPNOTSUPP;
+        return 1;
+    }
+    if (!(total = malloc(sizeof(struct statsslot)))) return 1;
+    statsSum(total);
+
+    if (prometheus) {
+        dprintf(fd, "# HELP myftp_sessions Open client sessions\n# TYPE myftp_sessions gauge\n"
+                    "myftp_sessions %ld\n", total->sessions);
+        dprintf(fd, "# HELP myftp_sessions_opened_total Client sessions opened\n"
+                    "# TYPE myftp_sessions_opened_total counter\nmyftp_sessions_opened_total %lu\n", total->opened);
+        dprintf(fd, "# HELP myftp_bytes_total Bytes moved on client connections\n# TYPE myftp_bytes_total counter\n"
+                    "myftp_bytes_total{direction=\"in\"} %llu\nmyftp_bytes_total{direction=\"out\"} %llu\n",
+                    total->bytesin, total->bytesout);
+        dprintf(fd, "# HELP myftp_commands_total Commands run\n# TYPE myftp_commands_total counter\n");
+        for (i = 0; i < STATS_NOPS; i++) {
+            op = &total->op[i];
+            if (!op->count && !op->errors) continue;
+            dprintf(fd, "myftp_commands_total{op=\"%c\",result=\"ok\"} %lu\n", STATS_OPS[i], op->count);
+            dprintf(fd, "myftp_commands_total{op=\"%c\",result=\"error\"} %lu\n", STATS_OPS[i], op->errors);
+        }
+        dprintf(fd, "# HELP myftp_command_seconds Latency of successful commands by phase\n"
+                    "# TYPE myftp_command_seconds summary\n");
+        for (i = 0; i < STATS_NOPS; i++) {
+            op = &total->op[i];
+            for (j = 0; j < STATS_PHASES; j++) {
+                for (count = 0, m = 0; m < STATS_BUCKETS; m++) count += op->hist[j][m];
+                if (!count) continue;
+                for (m = 0; m < 3; m++) {
+                    dprintf(fd, "myftp_command_seconds{op=\"%c\",phase=\"%s\",quantile=\"%g\"} %.6f\n",
+                            STATS_OPS[i], statsphases[j], marks[m], statsPercentile(op, j, count, marks[m]));
+                }
+                dprintf(fd, "myftp_command_seconds_sum{op=\"%c\",phase=\"%s\"} %.9f\n",
+                        STATS_OPS[i], statsphases[j], op->sum[j] / 1e9);
+                dprintf(fd, "myftp_command_seconds_count{op=\"%c\",phase=\"%s\"} %lu\n",
+                        STATS_OPS[i], statsphases[j], count);
+            }
+        }
+        if (!cacheStats(&cs)) {
+            dprintf(fd, "# HELP myftp_cache_events_total File cache lookups and changes\n"
+                        "# TYPE myftp_cache_events_total counter\n");
+            dprintf(fd, "myftp_cache_events_total{event=\"hit\"} %lu\nmyftp_cache_events_total{event=\"miss\"} %lu\n"
+                        "myftp_cache_events_total{event=\"admit\"} %lu\nmyftp_cache_events_total{event=\"evict\"} %lu\n",
+                        cs.hits, cs.misses, cs.admits, cs.evictions);
+        }
+    } else {
+        dprintf(fd, "Sessions: %ld open, %lu opened\nBytes: %llu in, %llu out\n\n",
+                total->sessions, total->opened, total->bytesin, total->bytesout);
+        dprintf(fd, "%-3s %-9s %10s %8s %10s %10s %10s %10s\n",
+                "cmd", "phase", "count", "errors", "mean ms", "p50 ms", "p99 ms", "p999 ms");
+        for (i = 0; i < STATS_NOPS; i++) {
+            op = &total->op[i];
+            if (!op->count && !op->errors) continue;
+            dprintf(fd, "%-3c %-9s %10lu %8lu\n", STATS_OPS[i], "", op->count, op->errors);
+            for (j = 0; j < STATS_PHASES; j++) {
+                for (count = 0, m = 0; m < STATS_BUCKETS; m++) count += op->hist[j][m];
+                if (!count) continue;
+                dprintf(fd, "%-3s %-9s %10lu %8s %10.3f %10.3f %10.3f %10.3f\n", "", statsphases[j], count, "",
+                        op->sum[j] / 1e6 / count, statsPercentile(op, j, count, 0.5) * 1e3,
+                        statsPercentile(op, j, count, 0.99) * 1e3, statsPercentile(op, j, count, 0.999) * 1e3);
+            }
+        }
+        if (!cacheStats(&cs)) {
+            dprintf(fd, "\nFile cache: %lu hits, %lu misses, %lu admitted, %lu evicted\n",
+                    cs.hits, cs.misses, cs.admits, cs.evictions);
+        }
+    }
+
+    free(total);
+    return 0;
+}
+
+/*
+Fork a process that rewrites the Prometheus report at path every STATS_DUMP seconds
+(through a temporary file renamed over it, so readers never see half a report),
+for as long as the server runs.
+
+@return 0: success 1: failure
+*/
+int statsDump(char *path) {
+    char tmp[PATH_MAX];
+    pid_t pid;
+    int fd;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return 1;
+    }
+    if ((pid = fork()) < 0) return 1;
+    if (pid) return 0;
+
+    logRole("Child", 1);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    while (1) {
+        if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0
+                || statsReport(fd, 1) || close(fd) < 0 || rename(tmp, path) < 0) {
+            logError("Error, writing statistics to '%s': %s", path, strerror(errno));
+            if (fd >= 0) close(fd);
+        }
+        sleep(STATS_DUMP);
+    }
+}
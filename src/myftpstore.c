@@ -0,0 +1,392 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+Deduplicating store behind myftpserve's puts (-s).
+
+Every file a P, U or M finishes is filed in <store>/files under the SHA-256 of
+its chunks' hashes (see deltaChunk), which names its content.  A file whose
+content the store already has is swapped for the stored copy: a reflink
+(FICLONE) where the filesystem can share extents, or else a hard link, so the
+data is only on disk once.  New content is hard linked into the store as it
+is (copied, if the store is on another filesystem).
+
+Each chunk of a stored file gets an entry, <store>/chunks/<first two hex
+digits>/<hash>, saying which stored file holds it and where.  H answers from
+those entries, and M assembles files from them (storeApply), so chunks the
+store holds don't have to cross the network again, whichever file they came in.
+
+Chunking and hashing a large file takes a while, so the server files each put
+from a helper process (storeSaveLater) and goes on serving its sessions.  The
+helper holds a lock on the file while it works.
+
+Stored files must never change, so a resumed put (T) on a file that is hard
+linked gets a private copy first (storeUnshare), once any helper still filing
+it is done.  Nothing is ever removed from the store.
+*/
+
+#include "myftp.h"
+#include <sys/ioctl.h>
+#include <linux/fs.h>   // FICLONE
+#include <openssl/sha.h>
+
+#define STORE_ENTRY 128 // Longest chunk entry: "<file hash> <offset> <length>\n"
+
+int storefd = -1;       // The store's directory (-1: no store)
+int storefiles = -1;    // ...and its files and chunks directories
+int storechunks = -1;
+
+/****************************************************************************************
+ * 
+ *                                      PROTOTYPES
+ * 
+ ****************************************************************************************/
+
+int storeLookup(const unsigned char *hash, char *id, off_t *offset, off_t *length);
+int storeIndex(struct chunk *c, char *id);
+int storeLink(int dirfd, char *name, int fd, char *id);
+int storeCopy(int fd, char *id);
+
+/****************************************************************************************
+ * 
+ *                                      HELPERS
+ * 
+ ****************************************************************************************/
+
+/*
+Find the stored file holding the chunk hash: its name into id (2*CHUNK_HASH+1 bytes)
+and where in it the chunk lies.
+
+@return 0: found 1: not in the store
+*/
+int storeLookup(const unsigned char *hash, char *id, off_t *offset, off_t *length) {
+    char name[2*CHUNK_HASH+4];
+    char entry[STORE_ENTRY];
+    long long off;
+    long long len;
+    int actual;
+    int fd;
+
+    deltaHex(hash, name+3);
+    memcpy(name, name+3, 2);
+    name[2] = '/';
+    if ((fd = openat(storechunks, name, O_RDONLY | O_CLOEXEC)) < 0) return 1;
+    actual = read(fd, entry, STORE_ENTRY-1);
+    close(fd);
+
+    // An entry still being written reads as missing
+    if (actual <= 0) return 1;
+    entry[actual] = 0;
+    if (sscanf(entry, "%64s %lld %lld", id, &off, &len) != 3 || strlen(id) != 2*CHUNK_HASH) return 1;
+    *offset = off;
+    *length = len;
+    return 0;
+}
+
+/*
+Record that the chunk c lies in the stored file id, unless an entry for it exists already.
+
+@return 0: success 1: failure
+*/
+int storeIndex(struct chunk *c, char *id) {
+    char name[2*CHUNK_HASH+4];
+    char entry[STORE_ENTRY];
+    int len;
+    int fd;
+
+    deltaHex(c->hash, name+3);
+    memcpy(name, name+3, 2);
+    name[2] = 0;
+    if (mkdirat(storechunks, name, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) < 0 && errno != EEXIST) return 1;
+    name[2] = '/';
+
+    if ((fd = openat(storechunks, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        return errno != EEXIST;
+    }
+    len = snprintf(entry, STORE_ENTRY, "%s %lld %lld\n", id, (long long)c->offset, (long long)c->length);
+    if (write(fd, entry, len) != len) {
+        unlinkat(storechunks, name, 0);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+Make the file name (relative to dirfd, open as fd) share the stored copy id of its content.
+A reflink keeps it a file of its own; a hard link (only with the same permissions)
+replaces it with the stored copy under a temporary name, then a rename.
+
+@return 0: success 1: failure
+*/
+int storeLink(int dirfd, char *name, int fd, char *id) {
+    static unsigned count = 0;
+    char tmp[NAME_MAX+1];
+    struct stat finfo;
+    struct stat sinfo;
+    int src;
+
+    if ((src = openat(storefiles, id, O_RDONLY | O_CLOEXEC)) < 0) return 1;
+    if (!ioctl(fd, FICLONE, src)) {
+        close(src);
+        logInfo("Reflinked '%s' to the stored copy of its content", name);
+        return 0;
+    }
+    if (fstat(fd, &finfo) < 0 || fstat(src, &sinfo) < 0) {
+        close(src);
+        return 1;
+    }
+    close(src);
+    if ((finfo.st_mode & 07777) != (sinfo.st_mode & 07777)) return 0;
+
+    snprintf(tmp, sizeof(tmp), ".myftp-store-%d-%u", getpid(), count++);
+    if (linkat(storefiles, id, dirfd, tmp, 0) < 0) return 1;
+    if (renameat(dirfd, tmp, dirfd, name) < 0) {
+        unlinkat(dirfd, tmp, 0);
+        return 1;
+    }
+    logInfo("Linked '%s' to the stored copy of its content", name);
+    return 0;
+}
+
+/*
+Copy the file at fd into the store as id (when it can't be linked in).
+
+@return 0: success 1: failure
+*/
+int storeCopy(int fd, char *id) {
+    char tmp[2*CHUNK_HASH+32];
+    struct stat finfo;
+    int out;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", id, getpid());
+    if (fstat(fd, &finfo) < 0) return 1;
+    if ((out = openat(storefiles, tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, finfo.st_mode & 07777)) < 0) return 1;
+    if ((ioctl(out, FICLONE, fd) < 0 && deltaCopy(fd, 0, out, finfo.st_size))
+            || renameat2(storefiles, tmp, storefiles, id, RENAME_NOREPLACE) < 0) {
+        unlinkat(storefiles, tmp, 0);
+        close(out);
+        return errno != EEXIST;
+    }
+    close(out);
+    return 0;
+}
+
+/****************************************************************************************
+ * 
+ *                                      STORE
+ * 
+ ****************************************************************************************/
+
+/*
+Open (creating if needed) the store at path for this process.
+
+@return 0: success 1: failure
+*/
+int storeInit(char *path) {
+    mode_t mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+
+    if (mkdir(path, mode) < 0 && errno != EEXIST) return 1;
+    if ((storefd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) return 1;
+    if ((mkdirat(storefd, "files", mode) < 0 && errno != EEXIST)
+            || (mkdirat(storefd, "chunks", mode) < 0 && errno != EEXIST)
+            || (storefiles = openat(storefd, "files", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0
+            || (storechunks = openat(storefd, "chunks", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        close(storefd);
+        storefd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Read the CHUNK_HASH byte hash written as hex into hash.
+
+@return 0: success 1: failure (not a hash)
+*/
+int storeParse(char *hex, unsigned char *hash) {
+    unsigned v;
+    int i;
+
+    if (strlen(hex) != 2*CHUNK_HASH) return 1;
+    for (i = 0; i < CHUNK_HASH; i++) {
+        if (!isxdigit(hex[2*i]) || !isxdigit(hex[2*i+1]) || sscanf(hex + 2*i, "%2x", &v) != 1) return 1;
+        hash[i] = v;
+    }
+    return 0;
+}
+
+/*
+@return 1: the store holds the chunk hash 0: it doesn't
+*/
+int storeHas(const unsigned char *hash) {
+    char id[2*CHUNK_HASH+1];
+    off_t offset;
+    off_t length;
+
+    return !storeLookup(hash, id, &offset, &length);
+}
+
+/*
+Assemble a file put through the store into out (empty, at its start) from the stream
+at the start of delta: literals, and chunks of stored files (see myftpdelta.c).
+size is set to the assembled file's size.
+
+@return 0: success 1: failure (errno EPROTO: the stream is malformed, or names a chunk
+        the store doesn't have)
+*/
+int storeApply(int delta, int out, off_t *size) {
+    unsigned char rec[1+CHUNK_HASH];
+    char id[2*CHUNK_HASH+1];
+    uint32_t none;
+    uint32_t len;
+    uint64_t end;
+    off_t offset;
+    off_t at;
+    off_t length;
+    int fd;
+
+    *size = 0;
+    if (pread(delta, &none, 4, 0) != 4 || none) goto bad;
+
+    for (offset = 4; pread(delta, rec, 1, offset) == 1; ) {
+        if (rec[0] == 'L') {
+            if (pread(delta, &len, 4, offset+1) != 4) goto bad;
+            len = ntohl(len);
+            if (deltaCopy(delta, offset+5, out, len)) return 1;
+            offset += 5 + len;
+            *size += len;
+        } else if (rec[0] == 'H') {
+            if (pread(delta, rec+1, CHUNK_HASH, offset+1) != CHUNK_HASH || storeLookup(rec+1, id, &at, &length)) goto bad;
+            if ((fd = openat(storefiles, id, O_RDONLY | O_CLOEXEC)) < 0) return 1;
+            if (deltaCopy(fd, at, out, length)) {
+                close(fd);
+                return 1;
+            }
+            close(fd);
+            offset += 1 + CHUNK_HASH;
+            *size += length;
+        } else if (rec[0] == 'E') {
+            if (pread(delta, &end, 8, offset+1) != 8 || be64toh(end) != (uint64_t)*size) goto bad;
+            return 0;
+        } else {
+            goto bad;
+        }
+    }
+
+bad:
+    errno = EPROTO;
+    return 1;
+}
+
+/*
+File the just-finished file name (relative to dirfd, open as fd) in the store: link it
+to the stored copy of its content if there is one, otherwise add it and index its chunks.
+
+@return 0: success 1: failure (the file itself is left as it was)
+*/
+int storeSave(int dirfd, char *name, int fd) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    unsigned char *hashes;
+    char id[2*CHUNK_HASH+1];
+    struct chunk *chunks;
+    struct stat finfo;
+    struct stat sinfo;
+    int fresh;
+    int count;
+    int i;
+
+    // Empty files aren't worth it
+    if (fstat(fd, &finfo) < 0) return 1;
+    if (!finfo.st_size) return 0;
+    if (!(chunks = deltaChunkFile(fd, &count))) return 1;
+    if (!(hashes = malloc((size_t)count * CHUNK_HASH))) {
+        free(chunks);
+        return 1;
+    }
+    for (i = 0; i < count; i++) memcpy(hashes + (size_t)i * CHUNK_HASH, chunks[i].hash, CHUNK_HASH);
+    SHA256(hashes, (size_t)count * CHUNK_HASH, digest);
+    deltaHex(digest, id);
+    free(hashes);
+
+    if (!fstatat(storefiles, id, &sinfo, 0)) {
+        free(chunks);
+        if (sinfo.st_dev == finfo.st_dev && sinfo.st_ino == finfo.st_ino) return 0;
+        if (sinfo.st_size != finfo.st_size) return 1;
+        return storeLink(dirfd, name, fd, id);
+    }
+
+    // New content: the file itself becomes the stored copy
+    if (linkat(dirfd, name, storefiles, id, 0) < 0 && errno != EEXIST && storeCopy(fd, id)) {
+        free(chunks);
+        return 1;
+    }
+    for (fresh = 0, i = 0; i < count; i++) {
+        if (!storeHas(chunks[i].hash) && !storeIndex(&chunks[i], id)) fresh++;
+    }
+    logInfo("Stored '%s' (%d of its %d chunks new)", name, fresh, count);
+    free(chunks);
+    return 0;
+}
+
+/*
+storeSave the just-finished file name (relative to dirfd, open as fd) from a helper
+process, so the caller's sessions don't wait on it.  The helper locks the file first
+(see storeUnshare) and reports its own errors.
+
+@return 0: success 1: failure (no helper was started)
+*/
+int storeSaveLater(int dirfd, char *name, int fd) {
+    char path[32];
+    int own;
+    int pid;
+
+    // An open file of its own, so the lock goes away with the helper
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    if ((own = open(path, O_RDWR | O_CLOEXEC)) < 0) return 1;
+    if (flock(own, LOCK_EX) < 0 || (pid = serverHelper("Store")) < 0) {
+        close(own);
+        return 1;
+    }
+
+    if (!pid) {
+        if (storeSave(dirfd, name, own)) logError("Error, storing '%s': %s", name, strerror(errno));
+        exit(0);
+    }
+    close(own);
+    return 0;
+}
+
+/*
+Give the file name (relative to dirfd, open as fd) a copy of its first offset bytes
+of its own, if it is hard linked (to the store), so a resumed put can't change the
+stored copy.  fd is closed if it is replaced.
+
+@return the FD to continue writing at offset (-1 on failure)
+*/
+int storeUnshare(int dirfd, char *name, int fd, off_t offset) {
+    static unsigned count = 0;
+    char tmp[NAME_MAX+1];
+    struct stat finfo;
+    int out;
+
+    // A helper may still be filing it (see storeSaveLater)
+    flock(fd, LOCK_EX);
+    flock(fd, LOCK_UN);
+    if (fstat(fd, &finfo) < 0) return -1;
+    if (finfo.st_nlink < 2) return fd;
+
+    snprintf(tmp, sizeof(tmp), ".myftp-unshare-%d-%u", getpid(), count++);
+    if ((out = openat(dirfd, tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, finfo.st_mode & 07777)) < 0) return -1;
+    if (deltaCopy(fd, 0, out, offset) || renameat(dirfd, tmp, dirfd, name) < 0) {
+        unlinkat(dirfd, tmp, 0);
+        close(out);
+        return -1;
+    }
+    logDebug("Unshared '%s' from the store to resume it", name);
+    close(fd);
+    return out;
+}
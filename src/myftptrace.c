@@ -0,0 +1,184 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+Per-command phase tracing for myftp and myftpserve (-t), as Chrome trace-event JSON.
+
+Each traced process appends complete ("X") events to the trace file, one line
+apiece, in the JSON array format that chrome://tracing and ui.perfetto.dev load
+(the closing bracket is optional there, so nothing has to happen at exit).  Every
+line goes out in a single write to a file opened with O_APPEND, so the children
+and workers of a server, or a client and a server on the same host, can share
+one file without interleaving.
+
+Spans are timed with CLOCK_MONOTONIC (like the server's statistics) and stamped
+with the wall clock, so the timelines of a client and a server on different
+hosts line up as well as their clocks do.  Each span carries the session id the
+client announced with an I command and the number of the command on its
+connection (counted the same way by both sides), so a client's G and the
+server's can be found side by side.
+*/
+
+#include "myftp.h"
+
+#define TRACE_NAME      256             // Longest span name kept (escaped)
+
+int tracefd = -1;                       // The trace file (-1: not tracing)
+char tracename[32];                     // Program named in the trace
+pid_t tracepid = 0;                     // Process whose name was last written
+int64_t traceoffset;                    // Wall clock minus CLOCK_MONOTONIC (ns)
+
+/****************************************************************************************
+ * 
+ *                                      PROTOTYPES
+ * 
+ ****************************************************************************************/
+
+int traceEscape(char *dst, const char *src, int size);
+void traceWrite(char *line, int len);
+void traceProcess(void);
+
+/****************************************************************************************
+ * 
+ *                                      HELPERS
+ * 
+ ****************************************************************************************/
+
+/*
+Copy src into dst (of size bytes) as the inside of a JSON string, cutting it short if need be.
+
+@return the length of dst
+*/
+int traceEscape(char *dst, const char *src, int size) {
+    int len = 0;
+
+    for (; *src && len < size-7; src++) {
+        if (*src == '"' || *src == '\\') {
+            dst[len++] = '\\';
+            dst[len++] = *src;
+        } else if ((unsigned char)*src < 0x20) {
+            len += snprintf(dst+len, size-len, "\\u%04x", *src);
+        } else {
+            dst[len++] = *src;
+        }
+    }
+    dst[len] = 0;
+    return len;
+}
+
+/*
+Append len bytes of line to the trace in one write (naming this process first if it hasn't been).
+*/
+void traceWrite(char *line, int len) {
+    if (getpid() != tracepid) traceProcess();
+    while (write(tracefd, line, len) < 0 && errno == EINTR);
+}
+
+/*
+Name this process in the trace: the program, and the role it logs as (see logRole).
+*/
+void traceProcess(void) {
+    char line[128];
+    int len;
+
+    tracepid = getpid();
+    len = snprintf(line, sizeof(line), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                    "\"args\":{\"name\":\"%s%s%s\"}},\n", tracepid, tracename, logrole[0] ? " " : "", logrole);
+    while (write(tracefd, line, len) < 0 && errno == EINTR);
+}
+
+/****************************************************************************************
+ * 
+ *                                      TRACING
+ * 
+ ****************************************************************************************/
+
+/*
+Start tracing into the file at path (appended to, and started if empty) as name.
+Children forked afterwards trace into it too.
+
+@return 0: success 1: failure
+*/
+int traceStart(char *path, char *name) {
+    struct timespec wall;
+    struct timespec mono;
+    struct stat finfo;
+
+    if ((tracefd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        return 1;
+    }
+
+    // Whoever finds the file empty opens the array
+    flock(tracefd, LOCK_EX);
+    if (fstat(tracefd, &finfo) == 0 && finfo.st_size == 0) while (write(tracefd, "[\n", 2) < 0 && errno == EINTR);
+    flock(tracefd, LOCK_UN);
+
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    traceoffset = (int64_t)(wall.tv_sec - mono.tv_sec) * 1000000000 + (wall.tv_nsec - mono.tv_nsec);
+    snprintf(tracename, sizeof(tracename), "%s", name);
+    return 0;
+}
+
+/*
+@return the time in CLOCK_MONOTONIC nanoseconds (0: not tracing)
+*/
+uint64_t traceNow(void) {
+    struct timespec now;
+
+    if (tracefd < 0) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+Name thread tid of this process in the trace, formatted from fmt.
+*/
+void traceThread(int tid, const char *fmt, ...) {
+    char name[TRACE_NAME];
+    char escaped[TRACE_NAME];
+    char line[TRACE_NAME + 128];
+    va_list ap;
+
+    if (tracefd < 0) return;
+    va_start(ap, fmt);
+    vsnprintf(name, sizeof(name), fmt, ap);
+    va_end(ap);
+    traceEscape(escaped, name, sizeof(escaped));
+    traceWrite(line, snprintf(line, sizeof(line), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                                "\"args\":{\"name\":\"%s\"}},\n", getpid(), tid, escaped));
+}
+
+/*
+Record the span name (of category cat) that began at start (see traceNow) and ends now,
+on thread tid.  session and req (the command's number on its connection) are added
+when given (NULL, or below 1, if not), and so are bytes (below 0 if none).
+*/
+void traceSpan(int tid, const char *cat, const char *name, uint64_t start,
+                const char *session, int req, long long bytes) {
+    char escaped[TRACE_NAME];
+    char line[3*TRACE_NAME];
+    uint64_t end;
+    int len;
+
+    if (tracefd < 0 || !start) return;
+    end = traceNow();
+    traceEscape(escaped, name, sizeof(escaped));
+    len = snprintf(line, sizeof(line), "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":%d,\"tid\":%d,\"args\":{", escaped, cat, (int64_t)(start + traceoffset) / 1e3,
+                    (end - start) / 1e3, getpid(), tid);
+
+    // The session id is the client's own, so it is escaped too
+    if (session && session[0]) {
+        traceEscape(escaped, session, 64);
+        len += snprintf(line+len, sizeof(line)-len, "\"session\":\"%s\",", escaped);
+    }
+    if (req > 0)    len += snprintf(line+len, sizeof(line)-len, "\"req\":%d,", req);
+    if (bytes >= 0) len += snprintf(line+len, sizeof(line)-len, "\"bytes\":%lld,", bytes);
+    if (line[len-1] == ',') len--;
+    len += snprintf(line+len, sizeof(line)-len, "}},\n");
+    traceWrite(line, len);
+}
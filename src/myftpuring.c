@@ -0,0 +1,579 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+io_uring transfer backend shared by myftp and myftpserve.
+
+Keeps URING_SLOTS chunks of a transfer in flight at once, in registered
+buffers, so the disk and the network work at the same time instead of taking
+turns.  Talks to the kernel through the raw syscalls; no liburing needed.
+
+file -> socket: reads run ahead on every free slot, and the socket is fed
+    strictly in file order, one write at a time.
+socket -> file: each chunk is a linked pair, a MSG_WAITALL recv followed by a
+    write to its offset in the file.  Only one recv is outstanding, so the
+    stream stays in order, but earlier chunks' file writes keep going
+    underneath it.
+*/
+
+#include "myftp.h"
+
+#define URING_FREE      0   // Slot states
+#define URING_READING   1
+#define URING_READY     2
+#define URING_WRITING   3
+#define URING_LINKED    4   // recv -> write pair in flight
+
+#define OP_READ     0   // What a completion is for, stored in user_data with the slot
+#define OP_WRITE    1
+
+#define URING_CLOSE_TRIES 10 // 10ms waits for cancelled requests before giving up on them
+
+struct uringslot {
+    int state;
+    long seq;           // Chunk number (file -> socket)
+    off_t offset;       // Where the chunk lives in the file
+    int len;            // Bytes of data in the slot
+    int done;           // Bytes of the slot already written out
+    int recvdone;       // Linked pair bookkeeping (socket -> file)
+    int writedone;
+};
+
+struct uring {
+    int fd;
+    int tofile;                 // 1: socket -> file 0: file -> socket
+    int fixed;                  // Buffers registered with the kernel
+    int nowait;                 // Return XFER_AGAIN instead of waiting for completions
+    int eof;
+    int failed;                 // errno of the first failure
+    int queued;                 // SQEs not yet submitted
+    int inflight;               // SQEs without a completion yet
+    int writing;                // A socket write is in flight (file -> socket)
+    int receiving;              // A recv is in flight (socket -> file)
+    long issued;                // Chunks handed out (file -> socket)
+    long nextsend;              // Next chunk to go out on the socket
+    long eofseq;                // Chunks after this one are past EOF
+    off_t fileoff;              // Next file offset to read or write
+
+    unsigned *sqhead;
+    unsigned *sqtail;
+    unsigned *sqmask;
+    unsigned *sqarray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqhead;
+    unsigned *cqtail;
+    unsigned *cqmask;
+    struct io_uring_cqe *cqes;
+    void *sqring;
+    void *cqring;
+    size_t sqringsz;
+    size_t cqringsz;
+    size_t sqessz;
+
+    char *bufs;
+    struct uringslot slot[URING_SLOTS];
+};
+
+/****************************************************************************************
+ *
+ *                                      PROTOTYPES
+ *
+ ****************************************************************************************/
+
+int uringSetup(struct uring *r);
+struct io_uring_sqe *uringSQE(struct uring *r, int op, int slot);
+int uringSubmit(struct uring *r, int wait);
+void uringIssueRead(struct xfer *x, int i);
+void uringQueueRead(struct xfer *x, int i);
+void uringQueueWrite(struct xfer *x, int i);
+void uringFill(struct xfer *x);
+void uringWriteDone(struct xfer *x, int i, int res);
+void uringComplete(struct xfer *x, struct io_uring_cqe *cqe);
+int uringReap(struct xfer *x);
+
+/****************************************************************************************
+ *
+ *                                      RING
+ *
+ ****************************************************************************************/
+
+/*
+Create the ring, map its queues and register the slot buffers.
+
+@return 0: success 1: failure
+*/
+int uringSetup(struct uring *r) {
+    struct io_uring_params p;
+    struct iovec iov[URING_SLOTS];
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = syscall(SYS_io_uring_setup, 2*URING_SLOTS, &p)) < 0) return 1;
+    fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+
+    r->sqringsz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    r->cqringsz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqringsz > r->sqringsz) r->sqringsz = r->cqringsz;
+        r->cqringsz = 0;
+    }
+    r->sqessz = p.sq_entries*sizeof(struct io_uring_sqe);
+
+    r->sqring = mmap(NULL, r->sqringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        r->fd, IORING_OFF_SQ_RING);
+    if (r->sqring == MAP_FAILED) return 1;
+    if (r->cqringsz) {
+        r->cqring = mmap(NULL, r->cqringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            r->fd, IORING_OFF_CQ_RING);
+        if (r->cqring == MAP_FAILED) return 1;
+    } else {
+        r->cqring = r->sqring;
+    }
+    r->sqes = mmap(NULL, r->sqessz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) return 1;
+
+    r->sqhead = r->sqring + p.sq_off.head;
+    r->sqtail = r->sqring + p.sq_off.tail;
+    r->sqmask = r->sqring + p.sq_off.ring_mask;
+    r->sqarray = r->sqring + p.sq_off.array;
+    r->cqhead = r->cqring + p.cq_off.head;
+    r->cqtail = r->cqring + p.cq_off.tail;
+    r->cqmask = r->cqring + p.cq_off.ring_mask;
+    r->cqes = r->cqring + p.cq_off.cqes;
+
+    if (!(r->bufs = aligned_alloc(4096, URING_SLOTS*URING_CHUNK))) return 1;
+
+    // Registered buffers skip per-I/O page pinning; plain buffers still work if this fails
+    for (i = 0; i < URING_SLOTS; i++) {
+        iov[i].iov_base = r->bufs + i*URING_CHUNK;
+        iov[i].iov_len = URING_CHUNK;
+    }
+    r->fixed = syscall(SYS_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, URING_SLOTS) == 0;
+    if (debug && !r->fixed) logDebug("Registering io_uring buffers failed (%s)", strerror(errno));
+    return 0;
+}
+
+/*
+Claim the next submission queue entry, tagged with op and slot.
+The ring has twice as many entries as slots, and each slot has at most two
+requests outstanding, so the queue never overflows.
+*/
+struct io_uring_sqe *uringSQE(struct uring *r, int op, int slot) {
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+    unsigned index;
+
+    tail = *r->sqtail;
+    index = tail & *r->sqmask;
+    sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = (slot << 1) | op;
+    r->sqarray[index] = index;
+    __atomic_store_n(r->sqtail, tail+1, __ATOMIC_RELEASE);
+    r->queued++;
+    r->inflight++;
+    return sqe;
+}
+
+/*
+Hand queued entries to the kernel, optionally waiting for at least one completion.
+
+@return 0: success 1: failure
+*/
+int uringSubmit(struct uring *r, int wait) {
+    int actual;
+
+    while (r->queued || wait) {
+        actual = syscall(SYS_io_uring_enter, r->fd, r->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                            NULL, 0);
+        if (actual < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        r->queued -= actual;
+        wait = 0;
+    }
+    return 0;
+}
+
+/****************************************************************************************
+ *
+ *                                      TRANSFER
+ *
+ ****************************************************************************************/
+
+/*
+Queue slot i's read (file -> socket) or linked recv -> write pair (socket -> file),
+using the chunk already assigned to the slot.
+*/
+void uringIssueRead(struct xfer *x, int i) {
+    struct uring *r = x->ring;
+    struct uringslot *sl = &r->slot[i];
+    struct io_uring_sqe *sqe;
+    char *buf = r->bufs + i*URING_CHUNK;
+
+    sl->done = 0;
+    sl->recvdone = 0;
+    sl->writedone = 0;
+
+    if (!r->tofile) {
+        sqe = uringSQE(r, OP_READ, i);
+        sqe->opcode = r->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = x->in;
+        sqe->addr = (unsigned long)buf;
+        sqe->len = sl->len;
+        sqe->off = sl->offset;
+        sqe->buf_index = i;
+        sl->state = URING_READING;
+        return;
+    }
+
+    sqe = uringSQE(r, OP_READ, i);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = x->in;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = sl->len;
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->flags = IOSQE_IO_LINK;     // Write below only runs if the whole chunk arrived
+
+    sqe = uringSQE(r, OP_WRITE, i);
+    sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = x->out;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = sl->len;
+    sqe->off = sl->offset;
+    sqe->buf_index = i;
+    sl->state = URING_LINKED;
+    r->receiving = 1;
+}
+
+/*
+Assign the next chunk of the transfer to free slot i and queue its read.
+*/
+void uringQueueRead(struct xfer *x, int i) {
+    struct uring *r = x->ring;
+    struct uringslot *sl = &r->slot[i];
+
+    sl->len = URING_CHUNK;
+    if (x->remaining >= 0 && x->remaining < sl->len) sl->len = x->remaining;
+    sl->offset = r->fileoff;
+    sl->seq = r->issued++;
+    if (x->remaining > 0) x->remaining -= sl->len;
+
+    // socket -> file learns how far to advance when the recv completes
+    if (!r->tofile) r->fileoff += sl->len;
+    uringIssueRead(x, i);
+}
+
+/*
+Queue a write of the unwritten part of slot i to out.
+*/
+void uringQueueWrite(struct xfer *x, int i) {
+    struct uring *r = x->ring;
+    struct uringslot *sl = &r->slot[i];
+    struct io_uring_sqe *sqe;
+
+    sqe = uringSQE(r, OP_WRITE, i);
+    sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = x->out;
+    sqe->addr = (unsigned long)(r->bufs + i*URING_CHUNK + sl->done);
+    sqe->len = sl->len - sl->done;
+    sqe->off = r->tofile ? sl->offset + sl->done : 0;
+    sqe->buf_index = i;
+    sl->state = URING_WRITING;
+    if (!r->tofile) r->writing = 1;
+}
+
+/*
+Keep every free slot busy, and the socket fed in order.
+*/
+void uringFill(struct xfer *x) {
+    struct uring *r = x->ring;
+    int i;
+
+    if (r->failed) return;
+
+    for (i = 0; i < URING_SLOTS; i++) {
+        if (r->slot[i].state != URING_READY) continue;
+
+        // Read ahead past a short read: the file ended before this chunk
+        if (r->slot[i].seq > r->eofseq) {
+            r->slot[i].state = URING_FREE;
+            continue;
+        }
+        // Next chunk in line for the socket
+        if (!r->writing && r->slot[i].seq == r->nextsend) uringQueueWrite(x, i);
+    }
+
+    for (i = 0; i < URING_SLOTS && !r->eof && x->remaining != 0; i++) {
+        if (r->slot[i].state != URING_FREE) continue;
+        if (r->tofile && r->receiving) break;
+        uringQueueRead(x, i);
+    }
+}
+
+/*
+Finish a write completion for slot i: write the rest if it came up short.
+*/
+void uringWriteDone(struct xfer *x, int i, int res) {
+    struct uring *r = x->ring;
+    struct uringslot *sl = &r->slot[i];
+
+    if (!r->tofile) r->writing = 0;
+    if (res == -EINTR || res == -EAGAIN) res = 0;
+    if (res < 0) {
+        r->failed = -res;
+        sl->state = URING_FREE;
+        return;
+    }
+    sl->done += res;
+    x->moved += res;
+    if (sl->done < sl->len) {
+        uringQueueWrite(x, i);
+        return;
+    }
+    sl->state = URING_FREE;
+    if (!r->tofile) r->nextsend++;
+}
+
+/*
+Account for one completion.
+*/
+void uringComplete(struct xfer *x, struct io_uring_cqe *cqe) {
+    struct uring *r = x->ring;
+    struct uringslot *sl;
+    int op = cqe->user_data & 1;
+    int i = cqe->user_data >> 1;
+    int res = cqe->res;
+
+    sl = &r->slot[i];
+    r->inflight--;
+
+    // File -> socket
+    if (!r->tofile) {
+        if (op == OP_WRITE) {
+            uringWriteDone(x, i, res);
+            return;
+        }
+        if (res == -EINTR || res == -EAGAIN) {
+            uringIssueRead(x, i);
+            return;
+        }
+        if (res < 0) {
+            r->failed = -res;
+            sl->state = URING_FREE;
+            return;
+        }
+
+        // Short read: the file ended (or shrank) in this chunk
+        if (res < sl->len) {
+            r->eof = 1;
+            if (sl->seq < r->eofseq) r->eofseq = sl->seq;
+        }
+        sl->len = res;
+        sl->state = URING_READY;
+        if (res == 0) {
+            sl->state = URING_FREE;
+            if (sl->seq == r->nextsend) r->nextsend++;
+        }
+        return;
+    }
+
+    // Socket -> file, standalone write of a short chunk
+    if (sl->state == URING_WRITING) {
+        uringWriteDone(x, i, res);
+        return;
+    }
+
+    // Socket -> file, linked pair: wait for both halves
+    if (op == OP_READ) {
+        r->receiving = 0;
+        if (res == -EINTR || res == -EAGAIN) {
+            sl->recvdone = -1;
+        } else {
+            if (res < 0) {
+                r->failed = -res;
+                res = 0;
+            }
+            if (res == 0 && !r->failed) r->eof = 1;
+            if (x->remaining >= 0) x->remaining += sl->len - res;
+            sl->len = res;
+            sl->recvdone = 1;
+            r->fileoff = sl->offset + res;
+        }
+    } else {
+        // Cancelled when the recv came up short; written below instead
+        if (res > 0) {
+            sl->done = res;
+            x->moved += res;
+        } else if (res < 0 && res != -ECANCELED && res != -EINTR && res != -EAGAIN) {
+            r->failed = -res;
+        }
+        sl->writedone = 1;
+    }
+    if (!sl->recvdone || !sl->writedone) return;
+
+    if (sl->recvdone < 0) {
+        // recv needs another go at the same chunk
+        uringIssueRead(x, i);
+        return;
+    }
+    if (sl->done < sl->len && !r->failed) {
+        uringQueueWrite(x, i);
+        return;
+    }
+    sl->state = URING_FREE;
+}
+
+/*
+Process every completion the kernel has posted.
+
+@return how many were processed
+*/
+int uringReap(struct xfer *x) {
+    struct uring *r = x->ring;
+    unsigned head;
+    unsigned tail;
+    int n;
+
+    n = 0;
+    head = *r->cqhead;
+    tail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        uringComplete(x, &r->cqes[head & *r->cqmask]);
+        head++;
+        n++;
+    }
+    __atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/****************************************************************************************
+ *
+ *                                      XFER INTERFACE
+ *
+ ****************************************************************************************/
+
+/*
+Switch x (initialized for file -> socket with XFER_SENDFILE or socket -> file with
+XFER_SPLICE) over to io_uring.  x keeps its mode if a ring can't be set up.
+When it succeeds, x->waitfd is the ring's FD, which turns readable when completions arrive.
+
+@return 0: using io_uring 1: not
+*/
+int uringInit(struct xfer *x) {
+    struct uring *r;
+    int sockfd;
+    int flags;
+
+    if (!(r = calloc(1, sizeof(struct uring)))) return 1;
+    r->fd = -1;
+    r->tofile = x->mode == XFER_SPLICE;
+    r->fileoff = r->tofile ? lseek(x->out, 0, SEEK_CUR) : x->offset;
+    r->eofseq = -1UL >> 1;
+    if (r->fileoff < 0) r->fileoff = 0;
+
+    if (uringSetup(r)) {
+        logDebug("io_uring unavailable (%s), keeping default transfer", strerror(errno));
+        x->ring = r;
+        uringClose(x);
+        return 1;
+    }
+
+    // The ring does the waiting; the socket itself must block inside the kernel
+    sockfd = r->tofile ? x->in : x->out;
+    flags = fcntl(sockfd, F_GETFL);
+    r->nowait = (flags & O_NONBLOCK) != 0;
+    if (r->nowait) fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK);
+
+    xferClose(x);
+    x->ring = r;
+    x->mode = XFER_URING;
+    x->waitfd = r->fd;
+    x->waitevents = EPOLLIN;
+    logDebug("Using io_uring (%d slots of %d bytes%s)",
+                URING_SLOTS, URING_CHUNK, r->fixed ? ", registered" : "");
+    return 0;
+}
+
+/*
+Move data until done, or (on non-blocking transfers) until waiting is all that's left.
+
+@return same as xferRun
+*/
+int uringRun(struct xfer *x) {
+    struct uring *r = x->ring;
+    int busy;
+    int i;
+
+    while (1) {
+        uringReap(x);
+        xferTune(x);
+        uringFill(x);
+
+        busy = 0;
+        for (i = 0; i < URING_SLOTS; i++) if (r->slot[i].state != URING_FREE) busy = 1;
+
+        if (!busy) {
+            if (r->failed) {
+                errno = r->failed;
+                return XFER_FAIL;
+            }
+            if (r->eof || x->remaining == 0) return XFER_DONE;
+        }
+
+        if (uringSubmit(r, !r->nowait && busy)) return XFER_FAIL;
+        if (r->nowait && busy) {
+            // Anything that completed while submitting is handled now; the rest wakes epoll
+            if (*r->cqhead == __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)) return XFER_AGAIN;
+        }
+    }
+}
+
+/*
+Tear the ring down.
+Requests still in flight (after a failure) are cancelled and waited for first,
+since the kernel may still be using the slot buffers.  If that isn't possible
+the buffers are leaked rather than freed under the kernel.
+*/
+void uringClose(struct xfer *x) {
+    struct uring *r = x->ring;
+    struct io_uring_getevents_arg arg;
+    struct io_uring_sqe *sqe;
+    struct __kernel_timespec ts;
+    int tries;
+
+    if (!r) return;
+    if (r->fd >= 0 && r->inflight > 0) {
+        sqe = uringSQE(r, OP_READ, 0);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        sqe->user_data = -1ULL;
+        uringSubmit(r, 0);
+
+        // Give the cancellations a moment; a kernel without ANY-cancel may never finish them
+        for (tries = 0; r->inflight > 0 && tries < URING_CLOSE_TRIES; tries++) {
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (unsigned long)&ts;
+            ts.tv_sec = 0;
+            ts.tv_nsec = 10*1000*1000;
+            syscall(SYS_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                    &arg, sizeof(arg));
+            while (*r->cqhead != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(r->cqhead, *r->cqhead+1, __ATOMIC_RELEASE);
+                r->inflight--;
+            }
+        }
+        if (r->inflight > 0) r->bufs = NULL;
+    }
+    if (r->fd >= 0) close(r->fd);
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqessz);
+    if (r->cqring && r->cqring != MAP_FAILED && r->cqring != r->sqring) munmap(r->cqring, r->cqringsz);
+    if (r->sqring && r->sqring != MAP_FAILED) munmap(r->sqring, r->sqringsz);
+    free(r->bufs);
+    free(r);
+    x->ring = NULL;
+}
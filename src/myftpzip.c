@@ -0,0 +1,192 @@
+/*
+Final Project
+Elijah Delavar
+CS 360
+12/10/2023
+
+Transfer compression shared by myftp and myftpserve.
+
+After an accepted Y command, the next transfer's data travels as a stream of
+blocks (see myftp.h) instead of raw bytes.  Each block holds at most ZIP_CHUNK
+bytes and is deflated on its own, with zlib at its fastest level, so memory
+stays bounded and each block goes out as soon as it has been read.
+
+Data that doesn't shrink (archives, media) is stored in its block as-is.
+After ZIP_POOR such blocks in a row, the next ZIP_SKIP blocks are stored
+without even trying, and then one is sampled again, so an incompressible file
+costs little more than a copy.
+*/
+
+#include "myftp.h"
+#include <zlib.h>
+
+#define ZIP_LEVEL   1       // zlib's fastest level
+#define ZIP_SAVING  8       // A deflated block has to save at least 1/ZIP_SAVING of its bytes
+#define ZIP_POOR    2       // Blocks in a row that didn't shrink before skipping starts
+#define ZIP_SKIP    32      // Blocks stored without trying before sampling again
+
+/****************************************************************************************
+ * 
+ *                                      STREAMS
+ * 
+ ****************************************************************************************/
+
+/*
+Set up a compressing (deflating is 1) or decompressing stream.
+
+@return the stream (NULL on failure)
+*/
+struct zipper *zipOpen(int deflating) {
+    struct zipper *zp;
+    z_stream *z;
+    int err;
+
+    z = NULL;
+    if (!(zp = calloc(1, sizeof(struct zipper))) || !(z = calloc(1, sizeof(z_stream)))) {
+        free(zp);
+        return NULL;
+    }
+
+    // Raw deflate (no zlib header or checksum), since every block starts over anyway
+    if (deflating)  err = deflateInit2(z, ZIP_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    else            err = inflateInit2(z, -15);
+    if (err != Z_OK) {
+        free(z);
+        free(zp);
+        errno = ENOMEM;
+        return NULL;
+    }
+    zp->stream = z;
+    zp->deflating = deflating;
+    return zp;
+}
+
+/*
+Release a stream (NULL is ignored).
+*/
+void zipClose(struct zipper *zp) {
+    if (!zp) return;
+
+    if (zp->blocks) {
+        logDebug("%s %lld bytes as %lld (%.1f%%), %lld of %lld blocks stored", 
+                zp->deflating ? "Compressed" : "Decompressed", (long long)zp->rawbytes,
+                (long long)zp->wirebytes, 100.0 * zp->wirebytes / zp->rawbytes,
+                (long long)zp->stored, (long long)zp->blocks);
+    }
+    if (zp->deflating)  deflateEnd(zp->stream);
+    else                inflateEnd(zp->stream);
+    free(zp->stream);
+    free(zp);
+}
+
+/****************************************************************************************
+ * 
+ *                                      BLOCKS
+ * 
+ ****************************************************************************************/
+
+/*
+Pack n bytes of raw (at most ZIP_CHUNK) into a block at dst, which needs room
+for ZIP_HDR+n bytes.  n 0 packs the block that ends the stream.
+
+@return the block's size
+*/
+int zipPack(struct zipper *zp, char *raw, int n, char *dst) {
+    z_stream *z = zp->stream;
+    uint32_t hdr[2];
+    int packed;
+
+    packed = n;
+    if (n == 0) {
+        zp->ended = 1;
+    } else if (zp->skip > 0) {
+        zp->skip--;
+    } else {
+        // Deflate straight into the block, giving up once it wouldn't save enough
+        deflateReset(z);
+        z->next_in = (Bytef*)raw;
+        z->avail_in = n;
+        z->next_out = (Bytef*)dst + ZIP_HDR;
+        z->avail_out = n - n/ZIP_SAVING;
+        if (deflate(z, Z_FINISH) == Z_STREAM_END) {
+            packed = z->total_out;
+            zp->poor = 0;
+        } else if (++zp->poor >= ZIP_POOR) {
+            zp->skip = ZIP_SKIP;
+            zp->poor = 0;
+        }
+    }
+
+    if (n && packed == n) {
+        memcpy(dst+ZIP_HDR, raw, n);
+        zp->stored++;
+    }
+    hdr[0] = htonl(n);
+    hdr[1] = htonl(packed);
+    memcpy(dst, hdr, ZIP_HDR);
+
+    if (n) zp->blocks++;
+    zp->rawbytes += n;
+    zp->wirebytes += ZIP_HDR + packed;
+    return ZIP_HDR + packed;
+}
+
+/*
+Point dst at where the next bytes of the block being unpacked go.
+
+@return how many bytes the block still needs
+*/
+int zipNeed(struct zipper *zp, char **dst) {
+    *dst = zp->block + zp->have;
+    if (zp->have < ZIP_HDR) return ZIP_HDR - zp->have;
+    return ZIP_HDR + zp->packed - zp->have;
+}
+
+/*
+Note that n more bytes (at most what zipNeed asked for) were put where zipNeed said.
+Once the block is whole, data points at its unpacked bytes until the next call.
+
+@return the unpacked block's size, ZIP_NONE: the block needs more bytes,
+        ZIP_END: the stream ended, ZIP_BAD: the block is corrupt
+*/
+int zipGot(struct zipper *zp, int n, char **data) {
+    z_stream *z = zp->stream;
+    uint32_t hdr[2];
+
+    zp->have += n;
+    if (zp->have < ZIP_HDR) return ZIP_NONE;
+    if (zp->have == ZIP_HDR) {
+        memcpy(hdr, zp->block, ZIP_HDR);
+        zp->rawlen = ntohl(hdr[0]);
+        zp->packed = ntohl(hdr[1]);
+        if (zp->rawlen > ZIP_CHUNK || zp->packed > zp->rawlen || !zp->packed != !zp->rawlen) {
+            return ZIP_BAD;
+        }
+        if (zp->rawlen == 0) {
+            zp->ended = 1;
+            zp->have = 0;
+            zp->wirebytes += ZIP_HDR;
+            return ZIP_END;
+        }
+    }
+    if (zp->have < ZIP_HDR + (int)zp->packed) return ZIP_NONE;
+
+    zp->have = 0;
+    zp->blocks++;
+    zp->rawbytes += zp->rawlen;
+    zp->wirebytes += ZIP_HDR + zp->packed;
+    if (zp->packed == zp->rawlen) {
+        zp->stored++;
+        *data = zp->block + ZIP_HDR;
+        return zp->rawlen;
+    }
+
+    inflateReset(z);
+    z->next_in = (Bytef*)zp->block + ZIP_HDR;
+    z->avail_in = zp->packed;
+    z->next_out = (Bytef*)zp->raw;
+    z->avail_out = zp->rawlen;
+    if (inflate(z, Z_FINISH) != Z_STREAM_END || z->total_out != zp->rawlen) return ZIP_BAD;
+    *data = zp->raw;
+    return zp->rawlen;
+}